@@ -10,29 +10,136 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BLOCK_SIZE 128    // one disk block
 #define MAX_LINE 4096     // max input line
 #define PORT_DEFAULT 7780 // disk server port
+#define RUN_MAX 8192      // blocks per RN / WN, as the server's MAX_RUN
+
+#define PIPE_WINDOW 128        // requests in flight in batch modes
+#define PIPE_OUT_CAP (1 << 16) // outgoing commands are sent in chunks
+#define PIPE_IN_CAP (1 << 16)  // replies are read in chunks
+#define PIPE_REPLY_CAP (1 << 16) // reply bytes owed before we send more
+#define FILE_BUF_CAP (1 << 20) // stdio buffer for images and batch output
+
+// what a queued request expects back, and what to do with it
+enum {
+  REPLY_INFO,        // one line (I geometry, S statistics), printed
+  REPLY_READ_HEX,    // R or RN from a batch file, hex dumped
+  REPLY_READ_RAW,    // R during dump, block appended to the image
+  REPLY_WRITE,       // W or WN from a batch file, status printed
+  REPLY_WRITE_QUIET, // W during restore, only failures counted
+  REPLY_STATUS,      // anything else: "0\n"
+};
+
+/*
+ * Pipelined connection used by the batch, dump and restore modes. The
+ * disk server answers strictly in order, so we keep up to PIPE_WINDOW
+ * requests outstanding and match replies against a FIFO of expected
+ * reply kinds. Commands are coalesced into one send() per chunk and
+ * replies are parsed out of a read buffer instead of byte-sized recv()s.
+ * The replies owed are kept within PIPE_REPLY_CAP, which the socket
+ * buffers hold: a send never waits on a server stuck writing replies
+ * we are not reading.
+ */
+struct pipeline {
+  int fd;
+  char out[PIPE_OUT_CAP];
+  size_t out_len;
+  unsigned char in[PIPE_IN_CAP];
+  size_t in_pos;
+  size_t in_len;
+  unsigned char kinds[PIPE_WINDOW];
+  int nblocks[PIPE_WINDOW]; // blocks a read reply carries
+  size_t head;
+  size_t count;
+  size_t owed; // reply bytes the queued requests can bring back
+  FILE *sink; // where replies go (stdout or the dump image)
+  long done;
+  long failed;
+};
 
 static ssize_t send_all(int fd, const void *buf,
                         size_t n);                    // write whole buffer
 static ssize_t recv_all(int fd, void *buf, size_t n); // read exact n bytes
+static int connect_to_server(const char *ip);
+static int query_geometry(int fd, int *cylinders, int *sectors);
+static void hex_dump(FILE *out, const unsigned char *block);
+
+static int pl_submit(struct pipeline *pl, int kind, const void *cmd,
+                     size_t n); // queue one request, reaping if window full
+static int pl_submit_run(struct pipeline *pl, int kind, int nblocks,
+                         const void *cmd, size_t n);
+static int pl_reap(struct pipeline *pl); // consume the oldest reply
+static int pl_drain(struct pipeline *pl);
+
+static int run_batch(int fd, FILE *in);
+static int run_dump(int fd, const char *path);
+static int run_restore(int fd, const char *path);
+static int run_interactive(int fd);
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s <server_ip>                  interactive\n"
+          "       %s <server_ip> batch <file|->   pipelined command file\n"
+          "       %s <server_ip> dump <image>     copy whole disk to image\n"
+          "       %s <server_ip> restore <image>  copy image onto disk\n",
+          prog, prog, prog, prog);
+}
 
 int main(int argc, char *argv[]) {
 
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <server_ip>\n", argv[0]);
+  if (argc != 2 && argc != 4) {
+    usage(argv[0]);
     return 1;
   }
 
   const char *server_ip = argv[1];
+  const char *mode = (argc == 4) ? argv[2] : NULL;
+
+  if (mode && strcmp(mode, "batch") != 0 && strcmp(mode, "dump") != 0 &&
+      strcmp(mode, "restore") != 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int sock_fd = connect_to_server(server_ip);
+  if (sock_fd < 0)
+    return 1;
 
+  int rc;
+  if (!mode) {
+    rc = run_interactive(sock_fd);
+  } else if (strcmp(mode, "batch") == 0) {
+    FILE *in = stdin;
+    if (strcmp(argv[3], "-") != 0) {
+      in = fopen(argv[3], "rb");
+      if (!in) {
+        perror("open batch file");
+        close(sock_fd);
+        return 1;
+      }
+    }
+    rc = run_batch(sock_fd, in);
+    if (in != stdin)
+      fclose(in);
+  } else if (strcmp(mode, "dump") == 0) {
+    rc = run_dump(sock_fd, argv[3]);
+  } else {
+    rc = run_restore(sock_fd, argv[3]);
+  }
+
+  close(sock_fd);
+  return rc;
+}
+
+static int connect_to_server(const char *ip) {
   int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (sock_fd < 0) {
     perror("socket");
-    return 1;
+    return -1;
   }
 
   struct sockaddr_in srv_addr = {
@@ -41,10 +148,10 @@ int main(int argc, char *argv[]) {
       .sin_port = htons(PORT_DEFAULT),
   };
 
-  if (inet_pton(AF_INET, server_ip, &srv_addr.sin_addr) != 1) {
+  if (inet_pton(AF_INET, ip, &srv_addr.sin_addr) != 1) {
     fprintf(stderr, "bad ip\n");
     close(sock_fd);
-    return 1;
+    return -1;
   }
 
   struct sockaddr *sock_addr = (struct sockaddr *)&srv_addr;
@@ -53,13 +160,25 @@ int main(int argc, char *argv[]) {
   if (connect(sock_fd, sock_addr, addr_len) < 0) {
     perror("connect");
     close(sock_fd);
-    return 1;
+    return -1;
   }
 
+  return sock_fd;
+}
+
+// one-line interactive loop: each command waits for its reply
+static int run_interactive(int fd) {
+  int cylinders, sectors;
+  if (query_geometry(fd, &cylinders, &sectors) < 0)
+    return 1;
+
   fprintf(stderr, "Commands:\n"
                   "  I\n"
                   "  R c s\n"
-                  "  W c s l <enter l bytes>\n");
+                  "  RN c s n\n"
+                  "  W c s l <enter l bytes>\n"
+                  "  WN c s n <enter n*128 bytes>\n"
+                  "  S\n");
 
   char line[MAX_LINE];
 
@@ -71,86 +190,563 @@ int main(int argc, char *argv[]) {
     if (!fgets(line, sizeof(line), stdin))
       break; // EOF on stdin
 
-    /* handle write command specially */
-    int c, s, l;
-
-    if (sscanf(line, " W %d %d %d", &c, &s, &l) == 3) {
+    char cmd[8];
+    if (sscanf(line, " %7s", cmd) != 1)
+      continue;
 
-      if (l < 0 || l > BLOCK_SIZE) {
+    /* write commands carry a payload after the line */
+    int c, s, l;
+    int run = strcmp(cmd, "WN") == 0;
+    if (run || strcmp(cmd, "W") == 0) {
+      int ok = sscanf(line, run ? " WN %d %d %d" : " W %d %d %d", &c, &s,
+                      &l) == 3;
+      if (ok && !run && (l < 0 || l > BLOCK_SIZE)) {
         fprintf(stderr, "l must be 0..128\n");
         continue;
       }
-
-      /* send the whole command line, including its newline */
-      if (send_all(sock_fd, line, strlen(line)) < 0)
-        break;
-
-      unsigned char buf[BLOCK_SIZE] = {0};
-      size_t got = fread(buf, 1, (size_t)l, stdin); // read data for W
-
-      if (got != (size_t)l) {
-        fprintf(stderr, "needed %d bytes\n", l);
+      // the server answers a bad WN without reading its payload
+      if (run && (!ok || c < 0 || s < 0 || c >= cylinders || s >= sectors ||
+                  l < 1 || l > RUN_MAX ||
+                  (long long)c * sectors + s + l >
+                      (long long)cylinders * sectors)) {
+        fprintf(stderr, "bad WN run\n");
         continue;
       }
 
-      if (send_all(sock_fd, buf, (size_t)l) < 0)
-        break;
-
-      if (send_all(sock_fd, "\n", 1) < 0)
-        break;
+      if (ok) {
+        size_t bytes = run ? (size_t)l * BLOCK_SIZE : (size_t)l;
+        unsigned char *buf = calloc(1, bytes + BLOCK_SIZE);
+        if (!buf) {
+          fprintf(stderr, "out of memory\n");
+          continue;
+        }
+        if (fread(buf, 1, bytes, stdin) != bytes) { // read data for W
+          fprintf(stderr, "needed %zu bytes\n", bytes);
+          free(buf);
+          continue;
+        }
+
+        /* the whole command line, its data, then the closing newline */
+        int sent = send_all(fd, line, strlen(line)) >= 0 &&
+                   send_all(fd, buf, bytes) >= 0 && send_all(fd, "\n", 1) >= 0;
+        free(buf);
+        if (!sent)
+          break;
+      } else if (send_all(fd, line, strlen(line)) < 0) {
+        break; // malformed W: the server says "0"
+      }
 
       char ans[2];
-      ssize_t r = recv(sock_fd, ans, sizeof(ans), 0);
-      if (r > 0)
-        write(STDOUT_FILENO, ans, (size_t)r); // print status
-
+      if (recv_all(fd, ans, sizeof(ans)) <= 0)
+        break;
+      write(STDOUT_FILENO, ans, sizeof(ans)); // print status
       continue;
     }
 
-    /* normal commands (I, R, etc.) */
-    if (send_all(sock_fd, line, strlen(line)) < 0)
+    /* normal commands (I, R, RN, S, etc.) */
+    if (send_all(fd, line, strlen(line)) < 0)
       break;
 
-    /* read command needs special handling */
-    if (line[0] == 'R') {
+    /* reads answer "1" and their blocks, or "0\n" */
+    int nb = 0;
+    if (strcmp(cmd, "R") == 0)
+      nb = 1;
+    else if (strcmp(cmd, "RN") == 0 &&
+             (sscanf(line, " RN %d %d %d", &c, &s, &nb) != 3 || nb < 1 ||
+              nb > RUN_MAX))
+      nb = 1; // refused: the reply is "0\n"
+    if (nb > 0) {
 
       char tag;
 
-      if (recv_all(sock_fd, &tag, 1) <= 0)
+      if (recv_all(fd, &tag, 1) <= 0)
         break;
 
       if (tag != '1') {
+        char nl;
+        if (recv_all(fd, &nl, 1) <= 0) // rest of "0\n"
+          break;
         write(STDOUT_FILENO, "0\n", 2); // invalid read
         continue;
       }
 
       unsigned char block[BLOCK_SIZE];
+      int i;
+      for (i = 0; i < nb && recv_all(fd, block, BLOCK_SIZE) > 0; i++)
+        hex_dump(stdout, block); // hex dump of each 128-byte block
+      fflush(stdout);
+      if (i < nb)
+        break;
+
+    } else {
+
+      // I, S and any other command answer one line
+      char ch;
+      do {
+        if (recv_all(fd, &ch, 1) <= 0)
+          return 0;
+        write(STDOUT_FILENO, &ch, 1);
+      } while (ch != '\n');
+    }
+  }
 
-      if (recv_all(sock_fd, block, BLOCK_SIZE) <= 0)
+  return 0;
+}
+
+// format a 128-byte block as 16 bytes per line without per-byte printf
+static void hex_dump(FILE *out, const unsigned char *block) {
+  static const char digits[] = "0123456789abcdef";
+  char text[BLOCK_SIZE * 3 + 1];
+  size_t n = 0;
+
+  for (int i = 0; i < BLOCK_SIZE; i++) {
+    text[n++] = digits[block[i] >> 4];
+    text[n++] = digits[block[i] & 0xf];
+    text[n++] = (i % 16 == 15) ? '\n' : ' ';
+  }
+  if (BLOCK_SIZE % 16)
+    text[n++] = '\n';
+
+  fwrite(text, 1, n, out);
+}
+
+// ask the server for "cylinders sectors"
+static int query_geometry(int fd, int *cylinders, int *sectors) {
+  if (send_all(fd, "I\n", 2) < 0) {
+    perror("send I");
+    return -1;
+  }
+
+  char buf[64];
+  size_t n = 0;
+  while (n < sizeof(buf) - 1) {
+    if (recv_all(fd, buf + n, 1) <= 0) {
+      perror("recv I");
+      return -1;
+    }
+    if (buf[n++] == '\n')
+      break;
+  }
+  buf[n] = '\0';
+
+  if (sscanf(buf, "%d %d", cylinders, sectors) != 2 || *cylinders <= 0 ||
+      *sectors <= 0) {
+    fprintf(stderr, "bad geometry reply: %s\n", buf);
+    return -1;
+  }
+  return 0;
+}
+
+/* --------------- pipelined request stream --------------- */
+
+static void pl_init(struct pipeline *pl, int fd, FILE *sink) {
+  memset(pl, 0, sizeof(*pl));
+  pl->fd = fd;
+  pl->sink = sink;
+}
+
+static int pl_flush(struct pipeline *pl) {
+  if (pl->out_len == 0)
+    return 0;
+  if (send_all(pl->fd, pl->out, pl->out_len) < 0) {
+    perror("send");
+    return -1;
+  }
+  pl->out_len = 0;
+  return 0;
+}
+
+// copy exactly n reply bytes out of the read buffer, refilling as needed
+static int pl_read(struct pipeline *pl, void *dst, size_t n) {
+  unsigned char *p = dst;
+
+  while (n > 0) {
+    if (pl->in_pos == pl->in_len) {
+      ssize_t r = recv(pl->fd, pl->in, sizeof(pl->in), 0);
+      if (r == 0) {
+        fprintf(stderr, "server closed connection\n");
+        return -1;
+      }
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        perror("recv");
+        return -1;
+      }
+      pl->in_pos = 0;
+      pl->in_len = (size_t)r;
+    }
+
+    size_t chunk = pl->in_len - pl->in_pos;
+    if (chunk > n)
+      chunk = n;
+    memcpy(p, pl->in + pl->in_pos, chunk);
+    pl->in_pos += chunk;
+    p += chunk;
+    n -= chunk;
+  }
+  return 0;
+}
+
+static int pl_submit(struct pipeline *pl, int kind, const void *cmd,
+                     size_t n) {
+  return pl_submit_run(pl, kind, 1, cmd, n);
+}
+
+// longest reply a request of this kind can bring back
+static size_t pl_reply_bytes(int kind, int nblocks) {
+  if (kind == REPLY_READ_HEX || kind == REPLY_READ_RAW)
+    return 1 + (size_t)nblocks * BLOCK_SIZE;
+  return kind == REPLY_INFO ? 64 : 2;
+}
+
+// pl_submit for a request whose read reply holds nblocks blocks
+static int pl_submit_run(struct pipeline *pl, int kind, int nblocks,
+                         const void *cmd, size_t n) {
+  size_t reply = pl_reply_bytes(kind, nblocks);
+  while (pl->count == PIPE_WINDOW ||
+         (pl->count > 0 && pl->owed + reply > PIPE_REPLY_CAP))
+    if (pl_reap(pl) < 0)
+      return -1;
+
+  if (pl->out_len + n > sizeof(pl->out) && pl_flush(pl) < 0)
+    return -1;
+
+  if (n > sizeof(pl->out)) {
+    // a long WN goes out on its own, behind what is already buffered
+    if (send_all(pl->fd, cmd, n) < 0) {
+      perror("send");
+      return -1;
+    }
+  } else {
+    memcpy(pl->out + pl->out_len, cmd, n);
+    pl->out_len += n;
+  }
+
+  size_t slot = (pl->head + pl->count) % PIPE_WINDOW;
+  pl->kinds[slot] = (unsigned char)kind;
+  pl->nblocks[slot] = nblocks;
+  pl->count++;
+  pl->owed += reply;
+  return 0;
+}
+
+static int pl_reap(struct pipeline *pl) {
+  if (pl->count == 0)
+    return 0;
+
+  // whatever is still buffered must reach the server before we wait
+  if (pl_flush(pl) < 0)
+    return -1;
+
+  int kind = pl->kinds[pl->head];
+  int nblocks = pl->nblocks[pl->head];
+  pl->head = (pl->head + 1) % PIPE_WINDOW;
+  pl->count--;
+  pl->owed -= pl_reply_bytes(kind, nblocks);
+
+  if (kind == REPLY_INFO) {
+    char c;
+    do {
+      if (pl_read(pl, &c, 1) < 0)
+        return -1;
+      fputc(c, pl->sink);
+    } while (c != '\n');
+    pl->done++;
+    return 0;
+  }
+
+  if (kind == REPLY_READ_HEX || kind == REPLY_READ_RAW) {
+    unsigned char tag;
+    if (pl_read(pl, &tag, 1) < 0)
+      return -1;
+
+    unsigned char block[BLOCK_SIZE];
+    if (tag != '1') {
+      char nl;
+      if (pl_read(pl, &nl, 1) < 0) // rest of "0\n"
+        return -1;
+      pl->failed++;
+      if (kind == REPLY_READ_HEX) {
+        fputs("0\n", pl->sink);
+      } else {
+        memset(block, 0, sizeof(block)); // keep image offsets aligned
+        fwrite(block, 1, BLOCK_SIZE, pl->sink);
+      }
+      return 0;
+    }
+
+    for (int i = 0; i < nblocks; i++) {
+      if (pl_read(pl, block, BLOCK_SIZE) < 0)
+        return -1;
+
+      if (kind == REPLY_READ_HEX)
+        hex_dump(pl->sink, block);
+      else
+        fwrite(block, 1, BLOCK_SIZE, pl->sink);
+    }
+    pl->done++;
+    return 0;
+  }
+
+  // W, WN and invalid commands all answer with two bytes
+  char ans[2];
+  if (pl_read(pl, ans, sizeof(ans)) < 0)
+    return -1;
+
+  if (ans[0] == '1')
+    pl->done++;
+  else
+    pl->failed++;
+
+  if (kind != REPLY_WRITE_QUIET)
+    fwrite(ans, 1, sizeof(ans), pl->sink);
+  return 0;
+}
+
+static int pl_drain(struct pipeline *pl) {
+  while (pl->count > 0)
+    if (pl_reap(pl) < 0)
+      return -1;
+  return pl_flush(pl);
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Batch mode: same command syntax as interactive mode (a W line is
+ * followed by its l raw bytes, a WN c s n line by n full blocks), but
+ * requests stream to the server without waiting on each reply. Replies
+ * are printed in command order. A WN the server would turn down is
+ * stopped here: it answers without reading the payload, which would
+ * then be taken for commands.
+ */
+static int run_batch(int fd, FILE *in) {
+  int cylinders, sectors;
+  if (query_geometry(fd, &cylinders, &sectors) < 0)
+    return 1;
+
+  static struct pipeline pl;
+  pl_init(&pl, fd, stdout);
+  setvbuf(in, NULL, _IOFBF, FILE_BUF_CAP);
+  setvbuf(stdout, NULL, _IOFBF, FILE_BUF_CAP);
+
+  char line[MAX_LINE];
+  long lineno = 0;
+  int rc = 0;
+
+  while (fgets(line, sizeof(line), in)) {
+    lineno++;
+
+    char cmd[8];
+    if (sscanf(line, " %7s", cmd) != 1)
+      continue; // blank, e.g. the newline after W data
+
+    size_t len = strlen(line);
+    if (line[len - 1] != '\n') {
+      if (len + 1 >= sizeof(line)) {
+        fprintf(stderr, "line %ld: too long\n", lineno);
+        rc = 1;
         break;
+      }
+      line[len++] = '\n'; // last line without newline
+      line[len] = '\0';
+    }
 
-      // hex dump of the 128-byte block
-      for (int i = 0; i < BLOCK_SIZE; i++) {
-        printf("%02x%s", block[i], (i % 16 == 15) ? "\n" : " ");
+    int c, s, l;
+    if (strcmp(cmd, "WN") == 0) {
+      long long total = (long long)cylinders * sectors;
+      if (sscanf(line, " WN %d %d %d", &c, &s, &l) != 3 || c < 0 || s < 0 ||
+          c >= cylinders || s >= sectors || l < 1 || l > RUN_MAX ||
+          (long long)c * sectors + s + l > total) {
+        fprintf(stderr, "line %ld: bad WN run\n", lineno);
+        rc = 1;
+        break;
       }
-      if (BLOCK_SIZE % 16)
-        puts("");
 
-    } else {
+      size_t bytes = (size_t)l * BLOCK_SIZE;
+      char *req = malloc(len + bytes + 1);
+      if (!req) {
+        fprintf(stderr, "line %ld: out of memory\n", lineno);
+        rc = 1;
+        break;
+      }
+      memcpy(req, line, len);
+      if (fread(req + len, 1, bytes, in) != bytes) {
+        fprintf(stderr, "line %ld: needed %zu bytes\n", lineno, bytes);
+        free(req);
+        rc = 1;
+        break;
+      }
+      req[len + bytes] = '\n';
+
+      int sent = pl_submit(&pl, REPLY_WRITE, req, len + bytes + 1);
+      free(req);
+      if (sent < 0) {
+        rc = 1;
+        break;
+      }
+      continue;
+    }
+
+    if (strcmp(cmd, "W") == 0 && sscanf(line, " W %d %d %d", &c, &s, &l) == 3) {
+      if (l < 0 || l > BLOCK_SIZE) {
+        fprintf(stderr, "line %ld: l must be 0..128\n", lineno);
+        rc = 1;
+        break;
+      }
 
-      // for I and any other small replies
-      char buf[256];
-      ssize_t r = recv(sock_fd, buf, sizeof(buf), 0);
+      char req[MAX_LINE + BLOCK_SIZE + 1];
+      memcpy(req, line, len);
+      if (fread(req + len, 1, (size_t)l, in) != (size_t)l) {
+        fprintf(stderr, "line %ld: needed %d bytes\n", lineno, l);
+        rc = 1;
+        break;
+      }
+      req[len + (size_t)l] = '\n';
 
-      if (r <= 0)
+      if (pl_submit(&pl, REPLY_WRITE, req, len + (size_t)l + 1) < 0) {
+        rc = 1;
         break;
+      }
+      continue;
+    }
+
+    int kind = REPLY_STATUS;
+    int nblocks = 1;
+    if (strcmp(cmd, "I") == 0 || strcmp(cmd, "S") == 0) {
+      kind = REPLY_INFO;
+    } else if (strcmp(cmd, "R") == 0) {
+      kind = REPLY_READ_HEX;
+    } else if (strcmp(cmd, "RN") == 0) {
+      // a run the server turns down answers "0\n", as a bad R does
+      kind = REPLY_READ_HEX;
+      if (sscanf(line, " RN %d %d %d", &c, &s, &nblocks) != 3 ||
+          nblocks < 1 || nblocks > RUN_MAX)
+        nblocks = 1;
+    }
 
-      write(STDOUT_FILENO, buf, (size_t)r);
+    if (pl_submit_run(&pl, kind, nblocks, line, len) < 0) {
+      rc = 1;
+      break;
     }
   }
 
-  close(sock_fd);
-  return 0;
+  if (pl_drain(&pl) < 0)
+    rc = 1;
+  fflush(stdout);
+
+  fprintf(stderr, "batch: %ld ok, %ld failed\n", pl.done, pl.failed);
+  return (rc || pl.failed) ? 1 : 0;
+}
+
+// copy every block of the disk, in logical order, into a local image file
+static int run_dump(int fd, const char *path) {
+  int cylinders, sectors;
+  if (query_geometry(fd, &cylinders, &sectors) < 0)
+    return 1;
+
+  FILE *out = fopen(path, "wb");
+  if (!out) {
+    perror("open image");
+    return 1;
+  }
+  setvbuf(out, NULL, _IOFBF, FILE_BUF_CAP);
+
+  static struct pipeline pl;
+  pl_init(&pl, fd, out);
+
+  double t0 = now_sec();
+  int rc = 0;
+
+  for (int c = 0; c < cylinders && rc == 0; c++) {
+    for (int s = 0; s < sectors; s++) {
+      char cmd[64];
+      int n = snprintf(cmd, sizeof(cmd), "R %d %d\n", c, s);
+      if (pl_submit(&pl, REPLY_READ_RAW, cmd, (size_t)n) < 0) {
+        rc = 1;
+        break;
+      }
+    }
+  }
+
+  if (pl_drain(&pl) < 0)
+    rc = 1;
+
+  if (fclose(out) != 0) {
+    perror("write image");
+    rc = 1;
+  }
+
+  double secs = now_sec() - t0;
+  fprintf(stderr, "dump: %ld blocks (%ld failed) in %.2fs, %.1f KB/s\n",
+          pl.done, pl.failed, secs,
+          (double)pl.done * BLOCK_SIZE / 1024.0 / (secs > 0 ? secs : 1e-9));
+  return (rc || pl.failed) ? 1 : 0;
+}
+
+// write a local image onto the disk, block by block from the start
+static int run_restore(int fd, const char *path) {
+  int cylinders, sectors;
+  if (query_geometry(fd, &cylinders, &sectors) < 0)
+    return 1;
+
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    perror("open image");
+    return 1;
+  }
+  setvbuf(in, NULL, _IOFBF, FILE_BUF_CAP);
+
+  static struct pipeline pl;
+  pl_init(&pl, fd, stderr);
+
+  long total = (long)cylinders * sectors;
+  double t0 = now_sec();
+  int rc = 0;
+  long blk = 0;
+
+  for (; blk < total; blk++) {
+    unsigned char block[BLOCK_SIZE];
+    size_t got = fread(block, 1, BLOCK_SIZE, in);
+    if (got == 0)
+      break;
+    if (got < BLOCK_SIZE)
+      memset(block + got, 0, BLOCK_SIZE - got); // pad a short last block
+
+    char req[64 + BLOCK_SIZE + 1];
+    int n = snprintf(req, 64, "W %ld %ld %d\n", blk / sectors, blk % sectors,
+                     BLOCK_SIZE);
+    memcpy(req + n, block, BLOCK_SIZE);
+    req[n + BLOCK_SIZE] = '\n';
+
+    if (pl_submit(&pl, REPLY_WRITE_QUIET, req, (size_t)n + BLOCK_SIZE + 1) <
+        0) {
+      rc = 1;
+      break;
+    }
+  }
+
+  if (blk == total && fgetc(in) != EOF)
+    fprintf(stderr, "restore: image larger than disk, extra data ignored\n");
+  if (ferror(in)) {
+    perror("read image");
+    rc = 1;
+  }
+  fclose(in);
+
+  if (pl_drain(&pl) < 0)
+    rc = 1;
+
+  double secs = now_sec() - t0;
+  fprintf(stderr, "restore: %ld blocks (%ld failed) in %.2fs, %.1f KB/s\n",
+          pl.done, pl.failed, secs,
+          (double)pl.done * BLOCK_SIZE / 1024.0 / (secs > 0 ? secs : 1e-9));
+  return (rc || pl.failed) ? 1 : 0;
 }
 
 static ssize_t send_all(int fd, const void *buf, size_t n) {
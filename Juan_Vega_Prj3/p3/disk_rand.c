@@ -1,25 +1,206 @@
-
 #include <arpa/inet.h>
 #include <errno.h>
+#include <getopt.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BLOCK_SIZE 128
 #define MAX_LINE 256
 #define PORT_DEFAULT 7780
 
+/*
+ * Latency histogram: log-linear buckets in the style of HdrHistogram.
+ * Values below HIST_SUB are recorded exactly; above that every power of two
+ * is split into HIST_SUB / 2 linear sub-buckets, so any recorded value is
+ * within 1/64 (~1.6%) of the true latency. Covers the full uint64 range of
+ * nanoseconds in HIST_BUCKETS counters (~30 KB per histogram).
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_HALF + HIST_HALF)
+
+enum { OP_READ = 0, OP_WRITE = 1, OP_KINDS = 2 };
+enum { FMT_TEXT, FMT_JSON, FMT_CSV };
+enum { ARRIVAL_POISSON, ARRIVAL_UNIFORM };
+enum { DIST_UNIFORM, DIST_SEQ, DIST_ZIPF, DIST_HOT };
+
+#define INFLIGHT_MAX 65536 // open-loop requests awaiting a reply
+
+struct histogram {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+// one row of the optional per-interval time series
+struct interval_row {
+  double t_sec;
+  uint64_t count[OP_KINDS];
+  uint64_t p50[OP_KINDS];
+  uint64_t p99[OP_KINDS];
+  uint64_t max[OP_KINDS];
+};
+
+// one generated request
+struct op {
+  int kind;
+  int c, s;
+  long blk;
+  uint32_t version;     // verify: write's version, or read's floor
+  uint64_t intended_ns; // scheduled (open loop) or actual send time
+};
+
+// xoshiro256** generator; each worker owns one so no lock is needed
+struct rng {
+  uint64_t s[4];
+};
+
+// access pattern and pacing, shared read-only by all workers
+struct workload {
+  int cylinders;
+  int sectors;
+  long nblocks;
+  int dist;
+  double read_ratio;     // fraction of ops that are reads
+  long seq_len;          // DIST_SEQ: blocks per sequential run
+  double zipf_theta;     // DIST_ZIPF: skew, 0 < theta < 1
+  double zipf_zetan;     // precomputed zeta(nblocks, theta)
+  double zipf_alpha;     // 1 / (1 - theta)
+  double zipf_eta;       // YCSB/Gray et al. correction term
+  double hot_frac;       // DIST_HOT: fraction of blocks that are hot
+  double hot_traffic;    // DIST_HOT: fraction of ops sent to them
+  uint64_t burst_on_ns;  // on/off phases, 0 = always on
+  uint64_t burst_off_ns;
+  double rate;           // per-worker ops/s, 0 = closed loop
+  int arrival;
+  uint64_t verify_seed;       // payload derivation key
+  _Atomic uint64_t *shadow;   // verify: per-block versions, NULL = off
+};
+
+// one load-generating thread with its own connection
+struct worker {
+  int id;
+  int fd;
+  long ops;
+  struct rng rng;
+  long seq_next; // DIST_SEQ: next block of the current run
+  long seq_left; // DIST_SEQ: blocks left in the current run
+  const struct workload *wl;
+  struct run_stats *st;
+  pthread_t tid;
+};
+
+// everything measured during a run, shared by all workers under lock
+struct run_stats {
+  pthread_mutex_t lock;
+  struct histogram hist[OP_KINDS];  // whole run
+  struct histogram ihist[OP_KINDS]; // current time-series interval
+  FILE *series;
+  int fmt;
+  int first_row;
+  long ops;
+  long completed;
+  long errors;
+  uint64_t start_ns;
+  uint64_t interval_ns;
+  uint64_t next_tick;
+  uint64_t max_send_lag; // open loop: worst lateness vs. the timetable
+  int verify;
+  long verified;         // verify: reads checked against the shadow
+  long unverified;       // verify: reads of blocks not yet written
+  long mismatches;       // verify: reads that returned wrong data
+};
+
+// requests sent but not yet answered, in send order
+struct op_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct op *ring;
+  size_t cap;
+  size_t head;
+  size_t count;
+  int done;   // sender finished
+  int failed; // reply side hit an error
+  struct worker *w;
+};
+
 static ssize_t send_all(int fd, const void *buf, size_t n);
 static ssize_t recv_all(int fd, void *buf, size_t n);
 static int connect_to_server(const char *ip); // open TCP connection
 
+static uint64_t now_ns(void); // CLOCK_MONOTONIC in ns
+static void hist_reset(struct histogram *h);
+static void hist_record(struct histogram *h, uint64_t v);
+static uint64_t hist_percentile(const struct histogram *h, double pct);
+static void interval_emit(FILE *out, int fmt, const struct interval_row *row,
+                          int first);
+static void report(FILE *out, const struct run_stats *st, double elapsed,
+                   double rate);
+
+static uint64_t splitmix64(uint64_t *x);
+static void rng_seed(struct rng *r, uint64_t seed);
+static uint64_t rng_next(struct rng *r);
+static double rng_unit(struct rng *r); // uniform in [0,1)
+static int workload_parse_dist(struct workload *wl, const char *spec);
+static void workload_prepare(struct workload *wl);
+static uint64_t burst_next_on(const struct workload *wl, uint64_t start,
+                              uint64_t t);
+
+static void next_op(struct worker *w, struct op *op, unsigned char *payload);
+static int send_op(int fd, const struct op *op, const unsigned char *payload);
+static int recv_reply(struct worker *w, const struct op *op);
+static void payload_fill(const struct workload *wl, long blk, uint32_t version,
+                         unsigned char *out);
+static void op_stamp(struct worker *w, struct op *op);
+static void verify_read(struct worker *w, const struct op *op,
+                        const unsigned char *data);
+static void *worker_main(void *arg);
+static void run_closed_loop(struct worker *w);
+static void run_open_loop(struct worker *w);
+static void *reply_thread(void *arg);
+static void stats_record(struct run_stats *st, int kind, uint64_t lat);
+static void series_row(struct run_stats *st, uint64_t end);
+static void series_advance(struct run_stats *st, uint64_t t);
+static void stats_error(struct run_stats *st);
+static void sleep_until(uint64_t t_ns);
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s <server_ip> <ops> <seed> [options]\n"
+          "  --format text|json|csv  summary format on stdout (text)\n"
+          "  --interval MS           time-series interval in ms (off)\n"
+          "  --series PATH           write time series to PATH (stderr)\n"
+          "  --rate N[/s]            open loop at N ops/s (closed loop)\n"
+          "  --arrival poisson|uniform  open-loop arrival process (poisson)\n"
+          "  --dist uniform|seq:L|zipf:THETA|hot:X:Y\n"
+          "                          block distribution (uniform); hot:X:Y\n"
+          "                          sends Y%% of ops to X%% of the blocks\n"
+          "  --read-ratio R          fraction of reads, 0..1 (0.5)\n"
+          "  --burst ON_MS:OFF_MS    alternate busy and idle phases (off)\n"
+          "  --threads N             workers, one connection each (1)\n"
+          "  --verify                check every read against the last\n"
+          "                          acknowledged write of that block\n",
+          prog);
+}
+
 int main(int argc, char *argv[]) {
 
-  if (argc != 4) {
-    fprintf(stderr, "usage: %s <server_ip> <ops> <seed>\n", argv[0]);
+  if (argc < 4) {
+    usage(argv[0]);
     return 1;
   }
 
@@ -32,7 +213,147 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  srand(seed); // seed RNG
+  int fmt = FMT_TEXT;
+  long interval_ms = 0;
+  const char *series_path = NULL;
+  double rate = 0; // target ops/s, 0 = closed loop
+  int nthreads = 1;
+  int verify = 0;
+
+  struct workload wl;
+  memset(&wl, 0, sizeof(wl));
+  wl.dist = DIST_UNIFORM;
+  wl.read_ratio = 0.5;
+  wl.arrival = ARRIVAL_POISSON;
+
+  static const struct option long_opts[] = {
+      {"format", required_argument, NULL, 'f'},
+      {"interval", required_argument, NULL, 'i'},
+      {"series", required_argument, NULL, 's'},
+      {"rate", required_argument, NULL, 'r'},
+      {"arrival", required_argument, NULL, 'a'},
+      {"dist", required_argument, NULL, 'd'},
+      {"read-ratio", required_argument, NULL, 'R'},
+      {"burst", required_argument, NULL, 'b'},
+      {"threads", required_argument, NULL, 't'},
+      {"verify", no_argument, NULL, 'v'},
+      {NULL, 0, NULL, 0},
+  };
+
+  optind = 4; // options follow the positional arguments
+  int opt;
+  while ((opt = getopt_long(argc, argv, "f:i:s:r:a:d:R:b:t:v", long_opts,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'f':
+      if (strcmp(optarg, "text") == 0)
+        fmt = FMT_TEXT;
+      else if (strcmp(optarg, "json") == 0)
+        fmt = FMT_JSON;
+      else if (strcmp(optarg, "csv") == 0)
+        fmt = FMT_CSV;
+      else {
+        fprintf(stderr, "bad format: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'i':
+      interval_ms = strtol(optarg, NULL, 10);
+      if (interval_ms <= 0) {
+        fprintf(stderr, "interval must be >0\n");
+        return 1;
+      }
+      break;
+    case 's':
+      series_path = optarg;
+      break;
+    case 'r': {
+      char *end = NULL;
+      rate = strtod(optarg, &end); // accepts "N" or "N/s"
+      if (rate <= 0 || (*end != '\0' && strcmp(end, "/s") != 0)) {
+        fprintf(stderr, "bad rate: %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 'a':
+      if (strcmp(optarg, "poisson") == 0)
+        wl.arrival = ARRIVAL_POISSON;
+      else if (strcmp(optarg, "uniform") == 0)
+        wl.arrival = ARRIVAL_UNIFORM;
+      else {
+        fprintf(stderr, "bad arrival: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'd':
+      if (workload_parse_dist(&wl, optarg) < 0) {
+        fprintf(stderr, "bad dist: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'R': {
+      char *end = NULL;
+      wl.read_ratio = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || !(wl.read_ratio >= 0) ||
+          wl.read_ratio > 1) {
+        fprintf(stderr, "bad read ratio: %s (want 0..1)\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 'b': {
+      long on_ms = 0, off_ms = 0;
+      if (sscanf(optarg, "%ld:%ld", &on_ms, &off_ms) != 2 || on_ms <= 0 ||
+          off_ms < 0) {
+        fprintf(stderr, "bad burst: %s\n", optarg);
+        return 1;
+      }
+      wl.burst_on_ns = (uint64_t)on_ms * 1000000ull;
+      wl.burst_off_ns = (uint64_t)off_ms * 1000000ull;
+      break;
+    }
+    case 't':
+      nthreads = atoi(optarg);
+      if (nthreads <= 0) {
+        fprintf(stderr, "threads must be >0\n");
+        return 1;
+      }
+      break;
+    case 'v':
+      verify = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  struct run_stats *st = calloc(1, sizeof(*st));
+  if (!st) {
+    perror("calloc");
+    return 1;
+  }
+  for (int k = 0; k < OP_KINDS; k++) {
+    hist_reset(&st->hist[k]);
+    hist_reset(&st->ihist[k]);
+  }
+  pthread_mutex_init(&st->lock, NULL);
+  st->fmt = fmt;
+  st->ops = ops;
+  st->first_row = 1;
+
+  if (interval_ms > 0) {
+    st->series = stderr;
+    if (series_path) {
+      st->series = fopen(series_path, "w");
+      if (!st->series) {
+        perror("open series");
+        return 1;
+      }
+    }
+    st->interval_ns = (uint64_t)interval_ms * 1000000ull;
+  }
 
   int sock_fd = connect_to_server(server_ip);
   if (sock_fd < 0)
@@ -63,88 +384,805 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  fprintf(stderr, "geometry: C=%d S=%d  (seed=%u ops=%ld)\n", cylinders,
-          sectors, seed, ops);
+  fprintf(stderr, "geometry: C=%d S=%d  (seed=%u ops=%ld threads=%d)\n",
+          cylinders, sectors, seed, ops, nthreads);
+  if (rate > 0)
+    fprintf(stderr, "open loop: %.1f ops/s %s arrivals\n", rate,
+            wl.arrival == ARRIVAL_POISSON ? "poisson" : "uniform");
 
-  unsigned char write_buf[BLOCK_SIZE];
-  unsigned char read_buf[BLOCK_SIZE];
+  wl.cylinders = cylinders;
+  wl.sectors = sectors;
+  wl.nblocks = (long)cylinders * sectors;
+  wl.rate = rate / nthreads; // the total rate is split across workers
+  workload_prepare(&wl);
 
-  for (long i = 1; i <= ops; i++) {
+  if (verify) {
+    wl.verify_seed = splitmix64(&(uint64_t){seed});
+    wl.shadow = calloc((size_t)wl.nblocks, sizeof(*wl.shadow));
+    if (!wl.shadow) {
+      perror("calloc shadow");
+      close(sock_fd);
+      return 1;
+    }
+    fprintf(stderr, "verify: %zu bytes of shadow state\n",
+            (size_t)wl.nblocks * sizeof(*wl.shadow));
+    st->verify = 1;
+  }
 
-    int c = rand() % cylinders; // random cylinder
-    int s = rand() % sectors;   // random sector
+  struct worker *workers = calloc((size_t)nthreads, sizeof(*workers));
+  if (!workers) {
+    perror("calloc");
+    close(sock_fd);
+    return 1;
+  }
 
-    /* randomly choose read or write */
-    if ((rand() & 1) == 0) {
-      /* READ */
-      char cmd[MAX_LINE];
-      int n = snprintf(cmd, sizeof(cmd), "R %d %d\n", c, s);
+  // the geometry connection becomes worker 0's; the rest open their own
+  for (int t = 0; t < nthreads; t++) {
+    struct worker *w = &workers[t];
+    w->id = t;
+    w->ops = ops / nthreads + (t < ops % nthreads ? 1 : 0);
+    w->wl = &wl;
+    w->st = st;
+    rng_seed(&w->rng, (uint64_t)seed * 0x9e3779b97f4a7c15ull + (uint64_t)t);
+    w->fd = (t == 0) ? sock_fd : connect_to_server(server_ip);
+    if (w->fd < 0) {
+      for (int k = 0; k < t; k++)
+        close(workers[k].fd);
+      free(workers);
+      return 1;
+    }
+  }
 
-      if (send_all(sock_fd, cmd, (size_t)n) < 0) {
-        perror("send R");
-        break;
-      }
+  st->start_ns = now_ns();
+  st->next_tick = st->start_ns + st->interval_ns;
 
-      char tag;
-      if (recv_all(sock_fd, &tag, 1) <= 0) {
-        perror("recv R tag");
-        break;
-      }
+  int started = 0;
+  for (int t = 0; t < nthreads; t++) {
+    int err = pthread_create(&workers[t].tid, NULL, worker_main, &workers[t]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      st->errors++;
+      break;
+    }
+    started++;
+  }
+  for (int t = 0; t < started; t++)
+    pthread_join(workers[t].tid, NULL);
 
-      if (tag != '1') {
-        fprintf(stderr, "R invalid at (%d,%d)\n", c, s);
-        break;
-      }
+  uint64_t end_ns = now_ns();
+  double elapsed = (double)(end_ns - st->start_ns) / 1e9;
+  if (st->series) {
+    series_advance(st, end_ns);
+    if (end_ns > st->next_tick - st->interval_ns)
+      series_row(st, end_ns); // the last, partial interval
+  }
 
-      if (recv_all(sock_fd, read_buf, BLOCK_SIZE) <= 0) {
-        perror("recv R data");
-        break;
-      }
+  for (int t = started; t < nthreads; t++)
+    close(workers[t].fd);
+  free(workers);
 
-    } else {
-      /* WRITE */
-      for (int j = 0; j < BLOCK_SIZE; j++)
-        write_buf[j] = (unsigned char)rand(); // random payload
+  report(stdout, st, elapsed, rate);
 
-      char cmd[MAX_LINE];
-      int n = snprintf(cmd, sizeof(cmd), "W %d %d %d\n", c, s, BLOCK_SIZE);
+  if (st->series && st->series != stderr)
+    fclose(st->series);
 
-      if (send_all(sock_fd, cmd, (size_t)n) < 0) {
-        perror("send W");
-        break;
-      }
+  int rc = (st->errors || st->mismatches) ? 1 : 0;
+  free(wl.shadow);
+  pthread_mutex_destroy(&st->lock);
+  free(st);
+  return rc;
+}
 
-      if (send_all(sock_fd, write_buf, BLOCK_SIZE) < 0) {
-        perror("send W data");
-        break;
-      }
+/* --------------- workload generation --------------- */
 
-      if (send_all(sock_fd, "\n", 1) < 0) {
-        perror("send W nl");
-        break;
-      }
+static uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static void rng_seed(struct rng *r, uint64_t seed) {
+  for (int i = 0; i < 4; i++)
+    r->s[i] = splitmix64(&seed);
+}
+
+static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+static uint64_t rng_next(struct rng *r) {
+  uint64_t *s = r->s;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+static double rng_unit(struct rng *r) {
+  return (double)(rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+// uniform integer in [0, n)
+static long rng_below(struct rng *r, long n) {
+  return (long)(rng_unit(r) * (double)n);
+}
+
+// parse "uniform", "seq:L", "zipf:THETA" or "hot:X:Y" (percentages)
+static int workload_parse_dist(struct workload *wl, const char *spec) {
+  if (strcmp(spec, "uniform") == 0) {
+    wl->dist = DIST_UNIFORM;
+    return 0;
+  }
+  if (sscanf(spec, "seq:%ld", &wl->seq_len) == 1) {
+    wl->dist = DIST_SEQ;
+    return wl->seq_len > 0 ? 0 : -1;
+  }
+  if (sscanf(spec, "zipf:%lf", &wl->zipf_theta) == 1) {
+    wl->dist = DIST_ZIPF;
+    return (wl->zipf_theta > 0 && wl->zipf_theta < 1) ? 0 : -1;
+  }
+  double x, y;
+  if (sscanf(spec, "hot:%lf:%lf", &x, &y) == 2) {
+    wl->dist = DIST_HOT;
+    wl->hot_frac = x / 100.0;
+    wl->hot_traffic = y / 100.0;
+    return (x > 0 && x < 100 && y >= 0 && y <= 100) ? 0 : -1;
+  }
+  return -1;
+}
+
+// precompute per-distribution constants once geometry is known
+static void workload_prepare(struct workload *wl) {
+  if (wl->dist != DIST_ZIPF)
+    return;
+
+  // Gray et al., "Quickly Generating Billion-Record Synthetic Databases"
+  double theta = wl->zipf_theta;
+  double n = (double)wl->nblocks;
+  double zetan = 0;
+  for (long i = 1; i <= wl->nblocks; i++)
+    zetan += 1.0 / pow((double)i, theta);
+  double zeta2 = 1.0 + pow(0.5, theta);
+
+  wl->zipf_zetan = zetan;
+  wl->zipf_alpha = 1.0 / (1.0 - theta);
+  wl->zipf_eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+}
+
+// pick the next block number; rank 0 is the hottest block for skewed modes
+static long next_block(struct worker *w) {
+  const struct workload *wl = w->wl;
+  long n = wl->nblocks;
+
+  switch (wl->dist) {
+  case DIST_SEQ:
+    if (w->seq_left == 0) {
+      w->seq_next = rng_below(&w->rng, n);
+      w->seq_left = wl->seq_len;
+    }
+    w->seq_left--;
+    long b = w->seq_next;
+    w->seq_next = (w->seq_next + 1) % n; // runs wrap at the end of disk
+    return b;
+
+  case DIST_ZIPF: {
+    double u = rng_unit(&w->rng);
+    double uz = u * wl->zipf_zetan;
+    if (uz < 1.0)
+      return 0;
+    if (uz < 1.0 + pow(0.5, wl->zipf_theta))
+      return 1;
+    long r = (long)((double)n *
+                    pow(wl->zipf_eta * u - wl->zipf_eta + 1.0, wl->zipf_alpha));
+    return r < n ? r : n - 1;
+  }
+
+  case DIST_HOT: {
+    long hot = (long)(wl->hot_frac * (double)n);
+    if (hot < 1)
+      hot = 1;
+    if (hot >= n)
+      return rng_below(&w->rng, n);
+    if (rng_unit(&w->rng) < wl->hot_traffic)
+      return rng_below(&w->rng, hot); // hot set: blocks [0, hot)
+    return hot + rng_below(&w->rng, n - hot);
+  }
+
+  default:
+    return rng_below(&w->rng, n);
+  }
+}
+
+// earliest time >= t that falls inside an "on" phase
+static uint64_t burst_next_on(const struct workload *wl, uint64_t start,
+                              uint64_t t) {
+  if (wl->burst_on_ns == 0 || wl->burst_off_ns == 0 || t < start)
+    return t;
+
+  uint64_t cycle = wl->burst_on_ns + wl->burst_off_ns;
+  uint64_t phase = (t - start) % cycle;
+  if (phase < wl->burst_on_ns)
+    return t;
+  return t + (cycle - phase);
+}
+
+// draw the next operation; the payload is filled for writes
+static void next_op(struct worker *w, struct op *op, unsigned char *payload) {
+  const struct workload *wl = w->wl;
+  long blk = next_block(w);
+  op->blk = blk;
+  op->c = (int)(blk / wl->sectors);
+  op->s = (int)(blk % wl->sectors);
+  op->kind = (rng_unit(&w->rng) < wl->read_ratio) ? OP_READ : OP_WRITE;
+  op->version = 0;
 
-      char ans[2];
-      ssize_t r = recv(sock_fd, ans, sizeof(ans), 0);
-      if (r <= 0) {
-        perror("recv W");
+  if (op->kind == OP_WRITE && wl->shadow) {
+    /*
+     * Claim the next version of this block. Only one write per block may
+     * be outstanding, so versions are acknowledged in order and a read can
+     * be checked against a simple [acked, issued] window; if a write is
+     * already in flight, this op reads the block instead.
+     */
+    _Atomic uint64_t *sh = &wl->shadow[blk];
+    uint64_t cur = atomic_load(sh);
+    while (1) {
+      if ((uint32_t)(cur >> 32) != (uint32_t)cur) {
+        op->kind = OP_READ;
         break;
       }
-
-      if (!(r >= 1 && ans[0] == '1')) {
-        fprintf(stderr, "W failed at (%d,%d)\n", c, s);
+      if (atomic_compare_exchange_weak(sh, &cur, cur + (1ull << 32))) {
+        op->version = (uint32_t)(cur >> 32) + 1;
         break;
       }
     }
+  }
+
+  if (op->kind == OP_WRITE) {
+    if (wl->shadow) {
+      payload_fill(wl, blk, op->version, payload);
+      return;
+    }
+    for (int j = 0; j < BLOCK_SIZE; j += 8) {
+      uint64_t x = rng_next(&w->rng); // random payload
+      memcpy(payload + j, &x, 8);
+    }
+  }
+}
+
+/* --------------- data verification --------------- */
+
+/*
+ * Shadow state is one 64-bit word per block: the high half is the last
+ * version handed to a writer, the low half the last version the server
+ * acknowledged (0 = never written in this run). Payloads are a pure
+ * function of (seed, block, version), so nothing else has to be kept.
+ */
+
+// deterministic payload: block and version up front, keyed noise after
+static void payload_fill(const struct workload *wl, long blk, uint32_t version,
+                         unsigned char *out) {
+  uint64_t x = wl->verify_seed ^ ((uint64_t)blk * 0xd6e8feb86659fd93ull) ^
+               ((uint64_t)version << 1);
+  uint64_t hdr[2] = {(uint64_t)blk, (uint64_t)version};
+  memcpy(out, hdr, sizeof(hdr));
+  for (size_t j = sizeof(hdr); j < BLOCK_SIZE; j += 8) {
+    uint64_t v = splitmix64(&x);
+    memcpy(out + j, &v, 8);
+  }
+}
+
+// reads remember the newest acknowledged version at the moment they leave
+static void op_stamp(struct worker *w, struct op *op) {
+  if (op->kind == OP_READ && w->wl->shadow)
+    op->version = (uint32_t)atomic_load(&w->wl->shadow[op->blk]);
+}
+
+static void verify_read(struct worker *w, const struct op *op,
+                        const unsigned char *data) {
+  struct run_stats *st = w->st;
+  uint32_t floor = op->version;
+
+  if (floor == 0) {
+    // contents predate this run, nothing to compare against
+    pthread_mutex_lock(&st->lock);
+    st->unverified++;
+    pthread_mutex_unlock(&st->lock);
+    return;
+  }
+
+  uint64_t hdr[2];
+  memcpy(hdr, data, sizeof(hdr));
+  uint32_t ceil = (uint32_t)(atomic_load(&w->wl->shadow[op->blk]) >> 32);
+  uint32_t found = (uint32_t)hdr[1];
+
+  int ok = hdr[0] == (uint64_t)op->blk && hdr[1] <= UINT32_MAX &&
+           found >= floor && found <= ceil;
+  if (ok) {
+    unsigned char expect[BLOCK_SIZE];
+    payload_fill(w->wl, op->blk, found, expect);
+    ok = memcmp(expect, data, BLOCK_SIZE) == 0;
+  }
+
+  pthread_mutex_lock(&st->lock);
+  if (ok) {
+    st->verified++;
+  } else {
+    if (st->mismatches < 10) // keep the log readable
+      fprintf(stderr,
+              "VERIFY MISMATCH block %ld (%d,%d): header blk=%llu ver=%llu, "
+              "expected version %u..%u\n",
+              op->blk, op->c, op->s, (unsigned long long)hdr[0],
+              (unsigned long long)hdr[1], floor, ceil);
+    st->mismatches++;
+  }
+  pthread_mutex_unlock(&st->lock);
+}
+
+/* --------------- request/reply --------------- */
+
+// send one request; writes carry their payload
+static int send_op(int fd, const struct op *op, const unsigned char *payload) {
+  char cmd[MAX_LINE];
+
+  if (op->kind == OP_READ) {
+    int n = snprintf(cmd, sizeof(cmd), "R %d %d\n", op->c, op->s);
+    if (send_all(fd, cmd, (size_t)n) < 0) {
+      perror("send R");
+      return -1;
+    }
+    return 0;
+  }
+
+  int n = snprintf(cmd, sizeof(cmd), "W %d %d %d\n", op->c, op->s, BLOCK_SIZE);
+  if (send_all(fd, cmd, (size_t)n) < 0) {
+    perror("send W");
+    return -1;
+  }
 
-    if ((i % 1000) == 0) // progress every 1000 ops
-      fprintf(stderr, "progress: %ld/%ld\n", i, ops);
+  if (send_all(fd, payload, BLOCK_SIZE) < 0) {
+    perror("send W data");
+    return -1;
   }
 
-  close(sock_fd);
+  if (send_all(fd, "\n", 1) < 0) {
+    perror("send W nl");
+    return -1;
+  }
   return 0;
 }
 
+// consume the reply for op; the server answers strictly in request order
+static int recv_reply(struct worker *w, const struct op *op) {
+  int fd = w->fd;
+
+  if (op->kind == OP_READ) {
+    char tag;
+    if (recv_all(fd, &tag, 1) <= 0) {
+      perror("recv R tag");
+      return -1;
+    }
+
+    if (tag != '1') {
+      fprintf(stderr, "R invalid at (%d,%d)\n", op->c, op->s);
+      return -1;
+    }
+
+    unsigned char read_buf[BLOCK_SIZE];
+    if (recv_all(fd, read_buf, BLOCK_SIZE) <= 0) {
+      perror("recv R data");
+      return -1;
+    }
+
+    if (w->wl->shadow)
+      verify_read(w, op, read_buf);
+    return 0;
+  }
+
+  // reply is always two bytes ("1\n" or "0\n")
+  char ans[2];
+  if (recv_all(fd, ans, sizeof(ans)) <= 0) {
+    perror("recv W");
+    return -1;
+  }
+
+  if (ans[0] != '1') {
+    fprintf(stderr, "W failed at (%d,%d)\n", op->c, op->s);
+    return -1;
+  }
+
+  if (w->wl->shadow)
+    atomic_fetch_add(&w->wl->shadow[op->blk], 1); // acked == issued again
+  return 0;
+}
+
+static void *worker_main(void *arg) {
+  struct worker *w = arg;
+
+  if (w->wl->rate > 0)
+    run_open_loop(w);
+  else
+    run_closed_loop(w);
+
+  // close as soon as done: a serial disk server only then moves on
+  close(w->fd);
+  w->fd = -1;
+  return NULL;
+}
+
+// one request at a time: latency is measured from the actual send
+static void run_closed_loop(struct worker *w) {
+  unsigned char payload[BLOCK_SIZE];
+
+  for (long i = 1; i <= w->ops; i++) {
+    struct op op;
+    next_op(w, &op, payload);
+
+    uint64_t t = now_ns();
+    uint64_t on = burst_next_on(w->wl, w->st->start_ns, t);
+    if (on > t)
+      sleep_until(on); // idle phase of a burst cycle
+
+    op.intended_ns = now_ns();
+    op_stamp(w, &op);
+
+    if (send_op(w->fd, &op, payload) < 0 || recv_reply(w, &op) < 0) {
+      stats_error(w->st);
+      break;
+    }
+
+    stats_record(w->st, op.kind, now_ns() - op.intended_ns);
+  }
+}
+
+/*
+ * Open loop: requests leave on a fixed timetable whether or not earlier
+ * replies have arrived, and latency is measured from each request's
+ * intended send time. A stalled server therefore shows up as queueing
+ * delay instead of silently lowering the offered load (coordinated
+ * omission). Replies are collected by a separate thread.
+ */
+static void run_open_loop(struct worker *w) {
+  struct run_stats *st = w->st;
+  const struct workload *wl = w->wl;
+  int fd = w->fd;
+
+  struct op_queue q;
+  memset(&q, 0, sizeof(q));
+  q.cap = INFLIGHT_MAX;
+  q.ring = calloc(q.cap, sizeof(*q.ring));
+  if (!q.ring) {
+    perror("calloc");
+    stats_error(st);
+    return;
+  }
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.not_empty, NULL);
+  pthread_cond_init(&q.not_full, NULL);
+  q.w = w;
+
+  pthread_t rx;
+  int err = pthread_create(&rx, NULL, reply_thread, &q);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    free(q.ring);
+    stats_error(st);
+    return;
+  }
+
+  unsigned char payload[BLOCK_SIZE];
+  double period_ns = 1e9 / wl->rate;
+  double sched = (double)st->start_ns;
+
+  for (long i = 1; i <= w->ops; i++) {
+    if (wl->arrival == ARRIVAL_POISSON) {
+      // exponential inter-arrival gap
+      sched += -log(1.0 - rng_unit(&w->rng)) * period_ns;
+    } else {
+      sched += period_ns;
+    }
+    // arrivals scheduled into an idle phase move to the next busy one
+    sched = (double)burst_next_on(wl, st->start_ns, (uint64_t)sched);
+
+    struct op op;
+    next_op(w, &op, payload);
+    op.intended_ns = (uint64_t)sched;
+
+    sleep_until(op.intended_ns);
+
+    uint64_t lag = now_ns() - op.intended_ns;
+    pthread_mutex_lock(&st->lock);
+    if (lag > st->max_send_lag)
+      st->max_send_lag = lag; // generator fell behind its own schedule
+    pthread_mutex_unlock(&st->lock);
+
+    op_stamp(w, &op);
+
+    // enqueue before sending so the reply thread sees requests in order
+    pthread_mutex_lock(&q.lock);
+    while (q.count == q.cap && !q.failed)
+      pthread_cond_wait(&q.not_full, &q.lock);
+    int failed = q.failed;
+    if (!failed) {
+      q.ring[(q.head + q.count) % q.cap] = op;
+      q.count++;
+      pthread_cond_signal(&q.not_empty);
+    }
+    pthread_mutex_unlock(&q.lock);
+
+    if (failed || send_op(fd, &op, payload) < 0)
+      break;
+  }
+
+  pthread_mutex_lock(&q.lock);
+  q.done = 1;
+  pthread_cond_signal(&q.not_empty);
+  pthread_mutex_unlock(&q.lock);
+
+  // a failed send leaves queued requests that will never be answered
+  if (!q.failed)
+    shutdown(fd, SHUT_WR);
+
+  pthread_join(rx, NULL);
+
+  if (q.failed || q.count > 0)
+    stats_error(st);
+
+  pthread_mutex_destroy(&q.lock);
+  pthread_cond_destroy(&q.not_empty);
+  pthread_cond_destroy(&q.not_full);
+  free(q.ring);
+}
+
+// reply side of the open loop: match replies to queued requests in order
+static void *reply_thread(void *arg) {
+  struct op_queue *q = arg;
+
+  while (1) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->done)
+      pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count == 0) {
+      pthread_mutex_unlock(&q->lock);
+      break;
+    }
+    struct op op = q->ring[q->head];
+    pthread_mutex_unlock(&q->lock);
+
+    if (recv_reply(q->w, &op) < 0) {
+      pthread_mutex_lock(&q->lock);
+      q->failed = 1;
+      pthread_cond_signal(&q->not_full);
+      pthread_mutex_unlock(&q->lock);
+      shutdown(q->w->fd, SHUT_RDWR); // unblock a sender stuck in send()
+      break;
+    }
+
+    stats_record(q->w->st, op.kind, now_ns() - op.intended_ns);
+
+    pthread_mutex_lock(&q->lock);
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+  }
+  return NULL;
+}
+
+// record one completed op, after the rows of the intervals it ends
+static void stats_record(struct run_stats *st, int kind, uint64_t lat) {
+  pthread_mutex_lock(&st->lock);
+  hist_record(&st->hist[kind], lat);
+  st->completed++;
+
+  if (st->series) {
+    series_advance(st, now_ns());
+    hist_record(&st->ihist[kind], lat);
+  }
+
+  if ((st->completed % 1000) == 0) // progress every 1000 ops
+    fprintf(stderr, "progress: %ld/%ld\n", st->completed, st->ops);
+  pthread_mutex_unlock(&st->lock);
+}
+
+// emit the row of the interval ending at end and start the next one
+static void series_row(struct run_stats *st, uint64_t end) {
+  struct interval_row row;
+  row.t_sec = (double)(end - st->start_ns) / 1e9;
+  for (int k = 0; k < OP_KINDS; k++) {
+    row.count[k] = st->ihist[k].count;
+    row.p50[k] = hist_percentile(&st->ihist[k], 50.0);
+    row.p99[k] = hist_percentile(&st->ihist[k], 99.0);
+    row.max[k] = st->ihist[k].max;
+    hist_reset(&st->ihist[k]);
+  }
+  interval_emit(st->series, st->fmt, &row, st->first_row);
+  st->first_row = 0;
+}
+
+// one row per interval that ended by t, empty ones included
+static void series_advance(struct run_stats *st, uint64_t t) {
+  while (t >= st->next_tick) {
+    series_row(st, st->next_tick);
+    st->next_tick += st->interval_ns;
+  }
+}
+
+static void stats_error(struct run_stats *st) {
+  pthread_mutex_lock(&st->lock);
+  st->errors++;
+  pthread_mutex_unlock(&st->lock);
+}
+
+static void sleep_until(uint64_t t_ns) {
+  struct timespec ts = {.tv_sec = (time_t)(t_ns / 1000000000ull),
+                        .tv_nsec = (long)(t_ns % 1000000000ull)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void hist_reset(struct histogram *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+// map a value to its bucket: exact below HIST_SUB, log-linear above
+static int hist_index(uint64_t v) {
+  if (v < HIST_SUB)
+    return (int)v;
+  int msb = 63 - __builtin_clzll(v);
+  int shift = msb - (HIST_SUB_BITS - 1);
+  return shift * HIST_HALF + (int)(v >> shift);
+}
+
+// largest value that maps to bucket idx
+static uint64_t hist_upper(int idx) {
+  if (idx < HIST_SUB)
+    return (uint64_t)idx;
+  int shift = idx / HIST_HALF - 1;
+  uint64_t sub = (uint64_t)(idx % HIST_HALF + HIST_HALF);
+  return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *h, uint64_t v) {
+  h->buckets[hist_index(v)]++;
+  h->count++;
+  h->sum += (double)v;
+  if (v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double pct) {
+  if (h->count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)((pct / 100.0) * (double)h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t v = hist_upper(i);
+      return v > h->max ? h->max : v; // never report past the true max
+    }
+  }
+  return h->max;
+}
+
+static const char *op_name[OP_KINDS] = {"read", "write"};
+
+static void interval_emit(FILE *out, int fmt, const struct interval_row *row,
+                          int first) {
+  if (fmt == FMT_JSON) {
+    fprintf(out, "{\"t\":%.3f", row->t_sec);
+    for (int k = 0; k < OP_KINDS; k++)
+      fprintf(out,
+              ",\"%s\":{\"ops\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+              "\"max_us\":%.1f}",
+              op_name[k], (unsigned long long)row->count[k],
+              row->p50[k] / 1e3, row->p99[k] / 1e3, row->max[k] / 1e3);
+    fprintf(out, "}\n");
+  } else {
+    if (first)
+      fprintf(out, "t_sec,read_ops,read_p50_us,read_p99_us,read_max_us,"
+                   "write_ops,write_p50_us,write_p99_us,write_max_us\n");
+    fprintf(out, "%.3f", row->t_sec);
+    for (int k = 0; k < OP_KINDS; k++)
+      fprintf(out, ",%llu,%.1f,%.1f,%.1f", (unsigned long long)row->count[k],
+              row->p50[k] / 1e3, row->p99[k] / 1e3, row->max[k] / 1e3);
+    fprintf(out, "\n");
+  }
+  fflush(out);
+}
+
+static void report(FILE *out, const struct run_stats *st, double elapsed,
+                   double rate) {
+  static const double pcts[] = {50.0, 90.0, 99.0, 99.9};
+  static const char *pct_name[] = {"p50", "p90", "p99", "p99.9"};
+  const int npct = (int)(sizeof(pcts) / sizeof(pcts[0]));
+
+  const struct histogram *hist = st->hist;
+  uint64_t total = hist[OP_READ].count + hist[OP_WRITE].count;
+  double secs = elapsed > 0 ? elapsed : 1e-9;
+  const char *mode = rate > 0 ? "open" : "closed";
+
+  if (st->fmt == FMT_JSON) {
+    fprintf(out, "{\"mode\":\"%s\",\"target_rate\":%.1f,"
+                 "\"max_send_lag_us\":%.1f,\"elapsed_s\":%.6f,"
+                 "\"ops\":%llu,\"errors\":%ld,\"throughput_ops\":%.1f",
+            mode, rate, st->max_send_lag / 1e3, elapsed,
+            (unsigned long long)total, st->errors, total / secs);
+    for (int k = 0; k < OP_KINDS; k++) {
+      const struct histogram *h = &hist[k];
+      fprintf(out, ",\"%s\":{\"ops\":%llu,\"throughput_ops\":%.1f",
+              op_name[k], (unsigned long long)h->count, h->count / secs);
+      fprintf(out, ",\"mean_us\":%.1f",
+              h->count ? h->sum / (double)h->count / 1e3 : 0.0);
+      for (int p = 0; p < npct; p++)
+        fprintf(out, ",\"%s_us\":%.1f", pct_name[p],
+                hist_percentile(h, pcts[p]) / 1e3);
+      fprintf(out, ",\"max_us\":%.1f}", h->max / 1e3);
+    }
+    if (st->verify)
+      fprintf(out,
+              ",\"verify\":{\"verified\":%ld,\"unverified\":%ld,"
+              "\"mismatches\":%ld}",
+              st->verified, st->unverified, st->mismatches);
+    fprintf(out, "}\n");
+    return;
+  }
+
+  if (st->fmt == FMT_CSV) {
+    fprintf(out, "op,mode,target_rate,ops,errors,elapsed_s,throughput_ops,"
+                 "mean_us,p50_us,p90_us,p99_us,p99.9_us,max_us,mismatches\n");
+    for (int k = 0; k < OP_KINDS; k++) {
+      const struct histogram *h = &hist[k];
+      fprintf(out, "%s,%s,%.1f,%llu,%ld,%.6f,%.1f,%.1f", op_name[k], mode,
+              rate, (unsigned long long)h->count, st->errors, elapsed,
+              h->count / secs,
+              h->count ? h->sum / (double)h->count / 1e3 : 0.0);
+      for (int p = 0; p < npct; p++)
+        fprintf(out, ",%.1f", hist_percentile(h, pcts[p]) / 1e3);
+      fprintf(out, ",%.1f,%ld\n", h->max / 1e3, st->mismatches);
+    }
+    return;
+  }
+
+  fprintf(out, "ops=%llu errors=%ld elapsed=%.3fs throughput=%.1f ops/s\n",
+          (unsigned long long)total, st->errors, elapsed, total / secs);
+  if (rate > 0)
+    fprintf(out, "open loop: target=%.1f ops/s max_send_lag=%.1fus "
+                 "(latency measured from intended send time)\n",
+            rate, st->max_send_lag / 1e3);
+  for (int k = 0; k < OP_KINDS; k++) {
+    const struct histogram *h = &hist[k];
+    fprintf(out, "%-5s n=%-8llu %9.1f ops/s  mean=%.1fus", op_name[k],
+            (unsigned long long)h->count, h->count / secs,
+            h->count ? h->sum / (double)h->count / 1e3 : 0.0);
+    for (int p = 0; p < npct; p++)
+      fprintf(out, " %s=%.1fus", pct_name[p],
+              hist_percentile(h, pcts[p]) / 1e3);
+    fprintf(out, " max=%.1fus\n", h->max / 1e3);
+  }
+  if (st->verify)
+    fprintf(out, "verify: verified=%ld unverified=%ld mismatches=%ld\n",
+            st->verified, st->unverified, st->mismatches);
+}
+
 static int connect_to_server(const char *ip) {
 
   int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -172,6 +1210,11 @@ static int connect_to_server(const char *ip) {
     return -1;
   }
 
+  // a W goes out as header, payload and '\n'; without this the last
+  // piece waits for the server's delayed ACK and skews every latency
+  int yes = 1;
+  setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
   return sock_fd; // ready to use
 }
 
@@ -4,6 +4,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +19,7 @@
 #define BLOCK_SIZE 128    // bytes per block
 #define MAX_LINE 4096     // max size for incoming command
 #define PORT_DEFAULT 7780 // listening port
+#define MAX_RUN 8192      // blocks per RN / WN request (1 MB)
 
 static ssize_t recv_all(int fd, void *buf,
                         size_t bytes_requested); // read exact count
@@ -28,8 +31,35 @@ static ssize_t recv_line(int fd, char *buf,
 static off_t blk_offset(int cylinders, int sectors, int cylinder_request,
                         int sector_request);
 static void sleep_tracks(int tracks, int delay_us); // simulate seek time
+static void head_move(int c, int last_cyl, int delay_us);
+static int parse_run(const char *line, const char *fmt, int cylinders,
+                     int sectors, int *c, int *s, int *n);
 static void serve_client(int client_fd, int cylinders, int sectors,
                          int delay_us, int backing_fd); // handle one connection
+static void *client_thread(void *arg);
+
+// what a client thread needs to serve its connection
+struct client_args {
+  int client_fd;
+  int cylinders;
+  int sectors;
+  int delay_us;
+  int backing_fd;
+};
+
+/*
+ * There is one arm, shared by every client: a request moves it from
+ * wherever the previous request (from any client) left it, and holds
+ * head_lock through the seek and the transfer. Receiving payloads,
+ * sending replies and fsync happen outside, so clients overlap there.
+ */
+static pthread_mutex_t head_lock = PTHREAD_MUTEX_INITIALIZER;
+static int head_cyl = 0; // cylinder the head is on
+
+// seek statistics for S, also guarded by head_lock
+static long long stat_requests = 0; // block requests served
+static long long stat_seeks = 0;    // of those, ones that moved the head
+static long long stat_tracks = 0;   // cylinders crossed seeking
 
 int main(int argc, char *argv[]) {
 
@@ -98,7 +128,8 @@ int main(int argc, char *argv[]) {
           "disk_server: Cylinders=%d Sectors=%d Delay=%dus file=%s port=%d\n",
           cylinders, sectors, delay_us, argv[4], PORT_DEFAULT);
 
-  // accept clients one at a time (no fork/threads here)
+  // one thread per client, so a file system server can hold several
+  // connections open at once
   while (1) {
 
     int client_fd = accept(listen_fd, NULL, NULL);
@@ -109,10 +140,39 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    serve_client(client_fd, cylinders, sectors, delay_us, backing_fd);
+    // replies are small and the client waits on each one
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    struct client_args *ca = malloc(sizeof(*ca));
+    if (!ca) {
+      close(client_fd);
+      continue;
+    }
+    ca->client_fd = client_fd;
+    ca->cylinders = cylinders;
+    ca->sectors = sectors;
+    ca->delay_us = delay_us;
+    ca->backing_fd = backing_fd;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, client_thread, ca) != 0) {
+      perror("pthread_create");
+      close(client_fd);
+      free(ca);
+      continue;
+    }
+    pthread_detach(tid);
   }
 }
 
+static void *client_thread(void *arg) {
+  struct client_args ca = *(struct client_args *)arg;
+  free(arg);
+  serve_client(ca.client_fd, ca.cylinders, ca.sectors, ca.delay_us,
+               ca.backing_fd);
+  return NULL;
+}
+
 static ssize_t recv_all(int fd, void *buf, size_t bytes_requested) {
   size_t bytes_filled = 0;
   char *buf_pointer = buf;
@@ -196,11 +256,36 @@ static void sleep_tracks(int tracks, int delay_us) {
   usleep((useconds_t)total); // simulate seek latency
 }
 
+/*
+ * Seek to cylinder c, then step to last_cyl along a run, and count the
+ * seek. Caller holds head_lock.
+ */
+static void head_move(int c, int last_cyl, int delay_us) {
+  int dist = abs(head_cyl - c);
+  sleep_tracks(dist + (last_cyl - c), delay_us);
+  head_cyl = last_cyl;
+  stat_requests++;
+  if (dist > 0) {
+    stat_seeks++;
+    stat_tracks += dist;
+  }
+}
+
+// parse "<cmd> c s n" for a run of n consecutive blocks starting at (c,s)
+static int parse_run(const char *line, const char *fmt, int cylinders,
+                     int sectors, int *c, int *s, int *n) {
+  if (sscanf(line, fmt, c, s, n) != 3 || *c < 0 || *s < 0 ||
+      *c >= cylinders || *s >= sectors || *n <= 0 || *n > MAX_RUN)
+    return -1;
+  if ((long long)*c * sectors + *s + *n > (long long)cylinders * sectors)
+    return -1; // runs past the last block
+  return 0;
+}
+
 static void serve_client(int client_fd, int cylinders, int sectors,
                          int delay_us, int backing_fd) {
 
   char line[MAX_LINE];
-  int current_cyl = 0; // remember last cylinder head was on
 
   while (1) {
 
@@ -217,16 +302,16 @@ static void serve_client(int client_fd, int cylinders, int sectors,
     if (n > 0 && line[n - 1] == '\n')
       line[n - 1] = '\0'; // trim newline
 
-    char cmd;
+    char cmd[8];
     int c, s, l;
 
-    if (sscanf(line, " %c", &cmd) != 1) {
+    if (sscanf(line, " %7s", cmd) != 1) {
       send_all(client_fd, "0\n", 2);
       continue;
     }
 
     /* ----- I: geometry ----- */
-    if (cmd == 'I') {
+    if (strcmp(cmd, "I") == 0) {
 
       char out[64];
       int m = snprintf(out, sizeof(out), "%d %d\n", cylinders, sectors);
@@ -237,8 +322,23 @@ static void serve_client(int client_fd, int cylinders, int sectors,
       continue;
     }
 
+    /* ----- S: seek statistics since startup ----- */
+    if (strcmp(cmd, "S") == 0) {
+
+      char out[96];
+      pthread_mutex_lock(&head_lock);
+      int m = snprintf(out, sizeof(out), "%lld %lld %lld\n", stat_requests,
+                       stat_seeks, stat_tracks);
+      pthread_mutex_unlock(&head_lock);
+
+      if (send_all(client_fd, out, (size_t)m) < 0)
+        break;
+
+      continue;
+    }
+
     /* ----- R: read block ----- */
-    if (cmd == 'R') {
+    if (strcmp(cmd, "R") == 0) {
 
       if (sscanf(line, " R %d %d", &c, &s) != 2 || c < 0 || s < 0 ||
           c >= cylinders || s >= sectors) {
@@ -247,38 +347,114 @@ static void serve_client(int client_fd, int cylinders, int sectors,
         continue;
       }
 
-      int tracks = abs(current_cyl - c);
-      sleep_tracks(tracks, delay_us); // simulate moving head
-      current_cyl = c;
+      unsigned char reply[1 + BLOCK_SIZE];
+      unsigned char *block = reply + 1;
 
-      unsigned char block[BLOCK_SIZE];
+      pthread_mutex_lock(&head_lock);
+      head_move(c, c, delay_us); // simulate moving head
+      ssize_t r = pread(backing_fd, block, BLOCK_SIZE,
+                        blk_offset(cylinders, sectors, c, s));
+      pthread_mutex_unlock(&head_lock);
+      if (r < 0) {
+        send_all(client_fd, "0\n", 2);
+        continue;
+      }
+
+      if (r < BLOCK_SIZE)
+        memset(block + r, 0, BLOCK_SIZE - r); // pad short reads
+
+      reply[0] = '1'; // status and data in one segment
+      if (send_all(client_fd, reply, sizeof(reply)) < 0)
+        break;
+
+      continue;
+    }
 
-      if (lseek(backing_fd, blk_offset(cylinders, sectors, c, s), SEEK_SET) <
+    /* ----- RN: read n consecutive blocks, one seek ----- */
+    if (strcmp(cmd, "RN") == 0) {
+      int nb;
+      if (parse_run(line, " RN %d %d %d", cylinders, sectors, &c, &s, &nb) <
           0) {
         send_all(client_fd, "0\n", 2);
         continue;
       }
 
-      ssize_t r = read(backing_fd, block, BLOCK_SIZE);
-      if (r < 0) {
+      size_t bytes = (size_t)nb * BLOCK_SIZE;
+      unsigned char *reply = malloc(1 + bytes);
+      if (!reply) {
         send_all(client_fd, "0\n", 2);
         continue;
       }
 
-      if (r < BLOCK_SIZE)
-        memset(block + r, 0, BLOCK_SIZE - r); // pad short reads
+      // seek to the first block, then step track to track along the run
+      int last_cyl = (c * sectors + s + nb - 1) / sectors;
+      pthread_mutex_lock(&head_lock);
+      head_move(c, last_cyl, delay_us);
+      ssize_t r = pread(backing_fd, reply + 1, bytes,
+                        blk_offset(cylinders, sectors, c, s));
+      pthread_mutex_unlock(&head_lock);
+      if (r < 0) {
+        free(reply);
+        send_all(client_fd, "0\n", 2);
+        continue;
+      }
+      if ((size_t)r < bytes)
+        memset(reply + 1 + r, 0, bytes - (size_t)r); // pad short reads
 
-      if (send_all(client_fd, "1", 1) < 0)
+      reply[0] = '1';
+      ssize_t sent = send_all(client_fd, reply, 1 + bytes);
+      free(reply);
+      if (sent < 0)
         break;
 
-      if (send_all(client_fd, block, BLOCK_SIZE) < 0)
+      continue;
+    }
+
+    /* ----- WN: write n consecutive blocks, one seek ----- */
+    if (strcmp(cmd, "WN") == 0) {
+      int nb;
+      if (parse_run(line, " WN %d %d %d", cylinders, sectors, &c, &s, &nb) <
+          0) {
+        send_all(client_fd, "0\n", 2);
+        continue;
+      }
+
+      // payload is always nb full blocks plus '\n'
+      size_t bytes = (size_t)nb * BLOCK_SIZE;
+      unsigned char *data = malloc(bytes + 1);
+      if (!data) {
+        send_all(client_fd, "0\n", 2);
+        break; // cannot resync without consuming the payload
+      }
+
+      if (recv_all(client_fd, data, bytes + 1) <= 0 || data[bytes] != '\n') {
+        free(data);
+        send_all(client_fd, "0\n", 2);
+        continue;
+      }
+
+      int last_cyl = (c * sectors + s + nb - 1) / sectors;
+      pthread_mutex_lock(&head_lock);
+      head_move(c, last_cyl, delay_us);
+      ssize_t w = pwrite(backing_fd, data, bytes,
+                         blk_offset(cylinders, sectors, c, s));
+      pthread_mutex_unlock(&head_lock);
+      free(data);
+      if (w != (ssize_t)bytes) {
+        send_all(client_fd, "0\n", 2);
+        continue;
+      }
+
+      (void)fsync(backing_fd); // one flush for the whole run
+
+      if (send_all(client_fd, "1\n", 2) < 0)
         break;
 
       continue;
     }
 
     /* ----- W: write block ----- */
-    if (cmd == 'W') {
+    if (strcmp(cmd, "W") == 0) {
 
       if (sscanf(line, " W %d %d %d", &c, &s, &l) != 3 || c < 0 || s < 0 ||
           c >= cylinders || s >= sectors || l < 0 || l > BLOCK_SIZE) {
@@ -301,17 +477,13 @@ static void serve_client(int client_fd, int cylinders, int sectors,
         continue;
       }
 
-      int tracks = abs(current_cyl - c);
-      sleep_tracks(tracks, delay_us);
-      current_cyl = c;
-
-      if (lseek(backing_fd, blk_offset(cylinders, sectors, c, s), SEEK_SET) <
-          0) {
-        send_all(client_fd, "0\n", 2);
-        continue;
-      }
+      pthread_mutex_lock(&head_lock);
+      head_move(c, c, delay_us);
+      ssize_t w = pwrite(backing_fd, block, BLOCK_SIZE,
+                         blk_offset(cylinders, sectors, c, s));
+      pthread_mutex_unlock(&head_lock);
 
-      if (write(backing_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+      if (w != BLOCK_SIZE) {
         send_all(client_fd, "0\n", 2);
         continue;
       }
@@ -0,0 +1,780 @@
+#include "alloc.h"
+#include "cache.h"
+#include "compact.h"
+#include "disk.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET 1 // built without -mavx2, picked at run time
+#endif
+
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t *bm_dirty = NULL; // bitmap blocks to write, under alloc_lock
+
+#define REGION_BLOCKS 4096 // blocks per bitmap summary region
+
+static struct fs_extent *ext_root[2];
+
+/*
+ * Allocation bitmap, 1 = used, padding bits past the end kept set. The
+ * block map of record under every policy; region_free lets scans skip
+ * full regions. resv_count free blocks belong to delayed files. Guarded
+ * by alloc_lock.
+ */
+uint64_t *bm_words = NULL;
+static unsigned int *region_free = NULL;
+int bm_nwords = 0;
+static int nregions = 0;
+int free_count = 0; // free blocks
+int resv_count = 0; // of those, reserved by fs_reserve_blocks
+int alloc_policy = ALLOC_GROUP;
+static int alloc_cursor = 0; // next-fit resumes here
+
+/*
+ * Cylinder groups, as in FFS: each directory gets a group
+ * (fs_pick_group), and under ALLOC_GROUP its files' blocks go to the
+ * first room in it, a growing file's right after its last run.
+ * Guarded by alloc_lock.
+ */
+int cg_cyls = CG_CYLS_DEFAULT;
+int cg_blocks = 0; // blocks per group
+int cg_count = 0;
+static int *cg_free = NULL; // free blocks per group
+static int *cg_dirs = NULL; // directories in memory per group
+
+/* --------------- free-space allocator --------------- */
+
+static int ext_height(const struct fs_extent *n, int t) {
+  return n ? n->link[t].height : 0;
+}
+
+// order by offset, or by length then offset; offsets are unique
+static int ext_cmp(const struct fs_extent *a, const struct fs_extent *b,
+                   int t) {
+  if (t == EXT_BY_LEN && a->len != b->len)
+    return (a->len < b->len) ? -1 : 1;
+  if (a->off != b->off)
+    return (a->off < b->off) ? -1 : 1;
+  return 0;
+}
+
+// recompute height (and max_len in the offset tree) from the children
+static void ext_update(struct fs_extent *n, int t) {
+  struct fs_extent *l = n->link[t].left;
+  struct fs_extent *r = n->link[t].right;
+  int hl = ext_height(l, t);
+  int hr = ext_height(r, t);
+  n->link[t].height = 1 + (hl > hr ? hl : hr);
+
+  if (t == EXT_BY_OFF) {
+    int m = n->len;
+    if (l && l->max_len > m)
+      m = l->max_len;
+    if (r && r->max_len > m)
+      m = r->max_len;
+    n->max_len = m;
+  }
+}
+
+static struct fs_extent *ext_rotate_right(struct fs_extent *n, int t) {
+  struct fs_extent *l = n->link[t].left;
+  n->link[t].left = l->link[t].right;
+  l->link[t].right = n;
+  ext_update(n, t);
+  ext_update(l, t);
+  return l;
+}
+
+static struct fs_extent *ext_rotate_left(struct fs_extent *n, int t) {
+  struct fs_extent *r = n->link[t].right;
+  n->link[t].right = r->link[t].left;
+  r->link[t].left = n;
+  ext_update(n, t);
+  ext_update(r, t);
+  return r;
+}
+
+// restore the AVL invariant at n after one child changed height by one
+static struct fs_extent *ext_balance(struct fs_extent *n, int t) {
+  ext_update(n, t);
+  struct fs_extent *l = n->link[t].left;
+  struct fs_extent *r = n->link[t].right;
+  int bal = ext_height(l, t) - ext_height(r, t);
+
+  if (bal > 1) {
+    if (ext_height(l->link[t].left, t) < ext_height(l->link[t].right, t))
+      n->link[t].left = ext_rotate_left(l, t);
+    return ext_rotate_right(n, t);
+  }
+  if (bal < -1) {
+    if (ext_height(r->link[t].right, t) < ext_height(r->link[t].left, t))
+      n->link[t].right = ext_rotate_right(r, t);
+    return ext_rotate_left(n, t);
+  }
+  return n;
+}
+
+static struct fs_extent *ext_insert(struct fs_extent *root, struct fs_extent *n,
+                                    int t) {
+  if (!root) {
+    n->link[t].left = NULL;
+    n->link[t].right = NULL;
+    ext_update(n, t);
+    return n;
+  }
+  if (ext_cmp(n, root, t) < 0)
+    root->link[t].left = ext_insert(root->link[t].left, n, t);
+  else
+    root->link[t].right = ext_insert(root->link[t].right, n, t);
+  return ext_balance(root, t);
+}
+
+// detach the leftmost node of a subtree into *min
+static struct fs_extent *ext_remove_min(struct fs_extent *root, int t,
+                                        struct fs_extent **min) {
+  if (!root->link[t].left) {
+    *min = root;
+    return root->link[t].right;
+  }
+  root->link[t].left = ext_remove_min(root->link[t].left, t, min);
+  return ext_balance(root, t);
+}
+
+static struct fs_extent *ext_remove(struct fs_extent *root, struct fs_extent *n,
+                                    int t) {
+  if (!root)
+    return NULL;
+
+  int c = ext_cmp(n, root, t);
+  if (c < 0) {
+    root->link[t].left = ext_remove(root->link[t].left, n, t);
+  } else if (c > 0) {
+    root->link[t].right = ext_remove(root->link[t].right, n, t);
+  } else {
+    // replace root by its in-order successor
+    struct fs_extent *l = root->link[t].left;
+    struct fs_extent *r = root->link[t].right;
+    if (!r)
+      return l;
+    struct fs_extent *m;
+    r = ext_remove_min(r, t, &m);
+    m->link[t].left = l;
+    m->link[t].right = r;
+    return ext_balance(m, t);
+  }
+  return ext_balance(root, t);
+}
+
+static void ext_attach(struct fs_extent *e) {
+  ext_root[EXT_BY_OFF] = ext_insert(ext_root[EXT_BY_OFF], e, EXT_BY_OFF);
+  ext_root[EXT_BY_LEN] = ext_insert(ext_root[EXT_BY_LEN], e, EXT_BY_LEN);
+}
+
+static void ext_detach(struct fs_extent *e) {
+  ext_root[EXT_BY_OFF] = ext_remove(ext_root[EXT_BY_OFF], e, EXT_BY_OFF);
+  ext_root[EXT_BY_LEN] = ext_remove(ext_root[EXT_BY_LEN], e, EXT_BY_LEN);
+}
+
+// shortest extent of at least need blocks, lowest offset among ties
+static struct fs_extent *ext_best_fit(int need) {
+  struct fs_extent *best = NULL;
+  struct fs_extent *n = ext_root[EXT_BY_LEN];
+  while (n) {
+    if (n->len >= need) {
+      best = n;
+      n = n->link[EXT_BY_LEN].left;
+    } else {
+      n = n->link[EXT_BY_LEN].right;
+    }
+  }
+  return best;
+}
+
+// lowest-offset extent starting at or after from with at least need blocks
+static struct fs_extent *ext_first_fit(struct fs_extent *n, int from,
+                                       int need) {
+  if (!n || n->max_len < need)
+    return NULL;
+  if (n->off >= from) {
+    struct fs_extent *f = ext_first_fit(n->link[EXT_BY_OFF].left, from, need);
+    if (f)
+      return f;
+    if (n->len >= need)
+      return n;
+  }
+  return ext_first_fit(n->link[EXT_BY_OFF].right, from, need);
+}
+
+// highest-offset extent starting before before with at least need blocks
+static struct fs_extent *ext_last_fit(struct fs_extent *n, int before,
+                                      int need) {
+  if (!n || n->max_len < need)
+    return NULL;
+  if (n->off < before) {
+    struct fs_extent *f = ext_last_fit(n->link[EXT_BY_OFF].right, before, need);
+    if (f)
+      return f;
+    if (n->len >= need)
+      return n;
+  }
+  return ext_last_fit(n->link[EXT_BY_OFF].left, before, need);
+}
+
+static void ext_free_tree(struct fs_extent *n) {
+  if (!n)
+    return;
+  ext_free_tree(n->link[EXT_BY_OFF].left);
+  ext_free_tree(n->link[EXT_BY_OFF].right);
+  free(n);
+}
+
+// forget all free space and start with one extent covering the disk
+static int ext_reset(void) {
+  ext_free_tree(ext_root[EXT_BY_OFF]);
+  ext_root[EXT_BY_OFF] = NULL;
+  ext_root[EXT_BY_LEN] = NULL;
+  if (alloc_policy == ALLOC_BITMAP)
+    return 0;
+
+  struct fs_extent *e = malloc(sizeof(*e));
+  if (!e)
+    return -1;
+  e->off = 0;
+  e->len = total_blocks;
+  ext_attach(e);
+  return 0;
+}
+
+// return a run to the extent trees, merging with free neighbours
+void ext_release(int first, int blocks) {
+  // closest free extents below and above the run
+  struct fs_extent *prev = NULL;
+  struct fs_extent *next = NULL;
+  for (struct fs_extent *n = ext_root[EXT_BY_OFF]; n;) {
+    if (n->off < first) {
+      prev = n;
+      n = n->link[EXT_BY_OFF].right;
+    } else {
+      next = n;
+      n = n->link[EXT_BY_OFF].left;
+    }
+  }
+
+  int off = first;
+  int end = first + blocks;
+  struct fs_extent *e = NULL;
+  if (prev && prev->off + prev->len == first) {
+    ext_detach(prev);
+    off = prev->off;
+    e = prev;
+  }
+  if (next && next->off == end) {
+    ext_detach(next);
+    end = next->off + next->len;
+    if (e)
+      free(next);
+    else
+      e = next;
+  }
+  if (!e)
+    e = malloc(sizeof(*e));
+  if (!e) {
+    // still free in the bitmap; only the trees lose track of it
+    fprintf(stderr, "out of memory: leaked blocks %d..%d\n", first, end - 1);
+    return;
+  }
+
+  e->off = off;
+  e->len = end - off;
+  ext_attach(e);
+}
+
+// number of leading all-zero words in w[0..n)
+static size_t bm_zero_words_scalar(const uint64_t *w, size_t n) {
+  size_t i = 0;
+  while (i < n && w[i] == 0)
+    i++;
+  return i;
+}
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2"))) static size_t
+bm_zero_words_avx2(const uint64_t *w, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(w + i));
+    if (!_mm256_testz_si256(v, v))
+      break;
+  }
+  return i + bm_zero_words_scalar(w + i, n - i);
+}
+#endif
+
+static size_t (*bm_zero_words)(const uint64_t *, size_t) =
+    bm_zero_words_scalar;
+
+// every block free, padding bits past total_blocks set
+static int bm_reset(void) {
+  free(bm_words);
+  free(region_free);
+  bm_nwords = (total_blocks + 63) / 64;
+  nregions = (total_blocks + REGION_BLOCKS - 1) / REGION_BLOCKS;
+  bm_words = calloc((size_t)bm_nwords, sizeof(*bm_words));
+  region_free = malloc((size_t)nregions * sizeof(*region_free));
+  if (!bm_words || !region_free)
+    return -1;
+
+  free(cg_free);
+  free(cg_dirs);
+  long long cg = (long long)cg_cyls * sectors;
+  cg_blocks = cg < total_blocks ? (int)(cg + 63) / 64 * 64 : total_blocks;
+  cg_count = (total_blocks + cg_blocks - 1) / cg_blocks;
+  cg_free = malloc((size_t)cg_count * sizeof(*cg_free));
+  cg_dirs = calloc((size_t)cg_count, sizeof(*cg_dirs));
+  if (!cg_free || !cg_dirs)
+    return -1;
+  for (int g = 0; g < cg_count; g++)
+    cg_free[g] = cg_blocks;
+  cg_free[cg_count - 1] = total_blocks - (cg_count - 1) * cg_blocks;
+
+  if (total_blocks % 64)
+    bm_words[bm_nwords - 1] = ~0ull << (total_blocks % 64);
+  for (int r = 0; r < nregions; r++)
+    region_free[r] = REGION_BLOCKS;
+  if (total_blocks % REGION_BLOCKS)
+    region_free[nregions - 1] = total_blocks % REGION_BLOCKS;
+  free_count = total_blocks;
+  resv_count = 0;
+
+#ifdef HAVE_AVX2_TARGET
+  if (__builtin_cpu_supports("avx2"))
+    bm_zero_words = bm_zero_words_avx2;
+#endif
+  return 0;
+}
+
+// set (used) or clear a run of bits a word at a time, keeping the summary
+void bm_mark(int first, int blocks, int used) {
+  int pos = first;
+  int end = first + blocks;
+  while (pos < end) {
+    int wi = pos / 64;
+    int lo = pos % 64;
+    int n = (end - pos < 64 - lo) ? end - pos : 64 - lo;
+    uint64_t mask = (n == 64) ? ~0ull : ((1ull << n) - 1) << lo;
+
+    uint64_t w = bm_words[wi];
+    uint64_t flip = used ? (mask & ~w) : (mask & w);
+    int changed = __builtin_popcountll(flip);
+    bm_words[wi] = w ^ flip;
+    if (used)
+      region_free[pos / REGION_BLOCKS] -= (unsigned int)changed;
+    else
+      region_free[pos / REGION_BLOCKS] += (unsigned int)changed;
+    free_count += used ? -changed : changed;
+    cg_free[pos / cg_blocks] += used ? -changed : changed;
+    if (changed && bm_dirty) {
+      int k = wi / (BLOCK_SIZE / 8); // bitmap block holding the word
+      bm_dirty[k / 64] |= 1ull << (k % 64);
+    }
+    pos += n;
+  }
+}
+
+/*
+ * First run of need free blocks starting at or after from, -1 if none.
+ * Full regions are skipped by their summary, empty ones are taken whole,
+ * and mixed words are walked run by run with ctz instead of bit by bit.
+ */
+int bm_find_run(int from, int need) {
+  int run = 0;
+  int run_start = 0;
+  int pos = from;
+
+  while (pos < total_blocks) {
+    int r = pos / REGION_BLOCKS;
+    int region_end = (r + 1) * REGION_BLOCKS;
+    if (region_end > total_blocks)
+      region_end = total_blocks;
+
+    if (region_free[r] == 0) {
+      run = 0;
+      pos = region_end;
+      continue;
+    }
+    if (region_free[r] == REGION_BLOCKS && pos % REGION_BLOCKS == 0) {
+      if (run == 0)
+        run_start = pos;
+      run += REGION_BLOCKS;
+      if (run >= need)
+        return run_start;
+      pos = region_end;
+      continue;
+    }
+
+    int wend = (region_end + 63) / 64;
+    int bit = pos % 64;
+    for (int wi = pos / 64; wi < wend; wi++, bit = 0) {
+      uint64_t x = bm_words[wi];
+      if (bit)
+        x |= (1ull << bit) - 1; // blocks before from are off limits
+
+      if (x == 0) {
+        // long free stretch: count whole zero words, 4 at a time with AVX2
+        size_t want = (size_t)(need - run + 63) / 64;
+        size_t avail = (size_t)(wend - wi);
+        size_t z = bm_zero_words(bm_words + wi, want < avail ? want : avail);
+        if (run == 0)
+          run_start = wi * 64;
+        run += (int)z * 64;
+        if (run >= need)
+          return run_start;
+        wi += (int)z - 1;
+        continue;
+      }
+
+      while (bit < 64) {
+        uint64_t rest = x >> bit;
+        if (rest == 0) {
+          // free to the end of the word
+          if (run == 0)
+            run_start = wi * 64 + bit;
+          run += 64 - bit;
+          break;
+        }
+        int zeros = __builtin_ctzll(rest);
+        if (zeros > 0) {
+          if (run == 0)
+            run_start = wi * 64 + bit;
+          run += zeros;
+          if (run >= need)
+            return run_start;
+          bit += zeros;
+        }
+        // skip the used bits that end the run
+        uint64_t ones = ~(x >> bit);
+        bit += ones ? __builtin_ctzll(ones) : 64 - bit;
+        run = 0;
+      }
+      if (run >= need)
+        return run_start;
+    }
+    pos = region_end;
+  }
+  return -1;
+}
+
+// carve blocks off the front of free extent e; the rest stays in place
+int ext_carve(struct fs_extent *e, int blocks) {
+  int start = e->off;
+  ext_detach(e);
+  if (e->len > blocks) {
+    e->off += blocks;
+    e->len -= blocks;
+    ext_attach(e);
+  } else {
+    free(e);
+  }
+  return start;
+}
+
+/*
+ * Take blocks from the middle of e, at start. The part before start
+ * stays in e, the part after gets a node of its own; without the memory
+ * for it the blocks come off e's front instead.
+ */
+static int ext_carve_at(struct fs_extent *e, int start, int blocks) {
+  int end = e->off + e->len;
+  if (start == e->off)
+    return ext_carve(e, blocks);
+  struct fs_extent *tail = NULL;
+  if (start + blocks < end) {
+    tail = malloc(sizeof(*tail));
+    if (!tail)
+      return ext_carve(e, blocks);
+  }
+  ext_detach(e);
+  e->len = start - e->off;
+  ext_attach(e);
+  if (tail) {
+    tail->off = start + blocks;
+    tail->len = end - tail->off;
+    ext_attach(tail);
+  }
+  return start;
+}
+
+/*
+ * Run of need free blocks from goal on: at goal itself when the free
+ * extent around it has the room, else the first fit after it, so files
+ * laid down one after another read back in one sweep and a full group
+ * spills into the next. Past the last fit on the disk, the tail of the
+ * last fit before goal.
+ */
+int ext_goal_fit(int goal, int need) {
+  struct fs_extent *b = ext_last_fit(ext_root[EXT_BY_OFF], goal, need);
+  int end = b ? b->off + b->len : 0;
+  if (b && end >= goal + need)
+    return ext_carve_at(b, goal, need);
+  struct fs_extent *a = ext_first_fit(ext_root[EXT_BY_OFF], goal, need);
+  if (a)
+    return ext_carve(a, need);
+  return b ? ext_carve_at(b, end - need, need) : -1;
+}
+
+// longest free extent, NULL if the disk is full
+static struct fs_extent *ext_largest(void) {
+  struct fs_extent *n = ext_root[EXT_BY_LEN];
+  while (n && n->link[EXT_BY_LEN].right)
+    n = n->link[EXT_BY_LEN].right;
+  return n;
+}
+
+/*
+ * Find exactly blocks contiguous free blocks, near goal under
+ * ALLOC_GROUP; caller holds alloc_lock.
+ */
+int alloc_exact_locked(int goal, int blocks) {
+  if (alloc_policy == ALLOC_BITMAP) {
+    int start = bm_find_run(alloc_cursor, blocks);
+    if (start < 0)
+      start = bm_find_run(0, blocks); // wrap around
+    return start;
+  }
+
+  if (alloc_policy == ALLOC_GROUP)
+    return ext_goal_fit(goal, blocks);
+
+  struct fs_extent *e;
+  if (alloc_policy == ALLOC_NEXT) {
+    e = ext_first_fit(ext_root[EXT_BY_OFF], alloc_cursor, blocks);
+    if (!e)
+      e = ext_first_fit(ext_root[EXT_BY_OFF], 0, blocks); // wrap around
+  } else {
+    e = ext_best_fit(blocks);
+  }
+  return e ? ext_carve(e, blocks) : -1;
+}
+
+/*
+ * Claim one run of at most max blocks and set *got to its length. A
+ * single run of max is preferred, as near goal as the policy cares;
+ * failing that the longest free extent is taken (extent policies) or
+ * the request is halved until a run turns up (bitmap policy), so a file
+ * needs as few runs as possible.
+ */
+int fs_alloc_run(int goal, int max, int *got) {
+  if (max <= 0)
+    return -1;
+
+  pthread_mutex_lock(&alloc_lock);
+  int n = max;
+  int start = alloc_exact_locked(goal, n);
+  if (start < 0 && alloc_policy != ALLOC_BITMAP) {
+    struct fs_extent *e = ext_largest();
+    if (e) {
+      n = e->len;
+      start = ext_carve(e, n);
+    }
+  }
+  while (start < 0 && alloc_policy == ALLOC_BITMAP && n > 1) {
+    n /= 2;
+    start = alloc_exact_locked(goal, n);
+  }
+  if (start < 0) {
+    pthread_mutex_unlock(&alloc_lock);
+    return -1;
+  }
+
+  bm_mark(start, n, 1);
+  alloc_cursor = start + n;
+  pthread_mutex_unlock(&alloc_lock);
+  if (n < max)
+    fs_compact_kick(0); // free space is too broken up for one run
+  *got = n;
+  return start;
+}
+
+// free extent starting exactly at off; caller holds alloc_lock
+struct fs_extent *ext_find_at(int off) {
+  struct fs_extent *n = ext_root[EXT_BY_OFF];
+  while (n && n->off != off)
+    n = (off < n->off) ? n->link[EXT_BY_OFF].left : n->link[EXT_BY_OFF].right;
+  return n;
+}
+
+// length of the free stretch starting at blk, capped at max
+static int bm_free_len(int blk, int max) {
+  int n = 0;
+  int bit = blk % 64;
+  for (int wi = blk / 64; wi < bm_nwords && n < max; wi++, bit = 0) {
+    uint64_t x = bm_words[wi] >> bit;
+    if (x != 0) {
+      n += __builtin_ctzll(x); // padding bits stop us at the disk's end
+      break;
+    }
+    n += 64 - bit;
+  }
+  return n < max ? n : max;
+}
+
+/*
+ * Claim up to max blocks starting exactly at start, for growing a run in
+ * place. Returns how many were free (possibly 0).
+ */
+int fs_alloc_at(int start, int max) {
+  if (start < 0 || start >= total_blocks || max <= 0)
+    return 0;
+
+  pthread_mutex_lock(&alloc_lock);
+  int n = 0;
+  if (alloc_policy == ALLOC_BITMAP) {
+    n = bm_free_len(start, max);
+  } else {
+    // start follows a used block, so a free extent there begins at it
+    struct fs_extent *e = ext_find_at(start);
+    if (e) {
+      n = e->len < max ? e->len : max;
+      ext_carve(e, n);
+    }
+  }
+  if (n > 0)
+    bm_mark(start, n, 1);
+  pthread_mutex_unlock(&alloc_lock);
+  return n;
+}
+
+// free extents and the longest one, for COMPACT
+void fs_free_stats(int *extents, int *largest) {
+  *extents = 0;
+  *largest = 0;
+  pthread_mutex_lock(&alloc_lock);
+  for (int pos = bm_find_run(0, 1); pos >= 0;) {
+    int len = bm_free_len(pos, total_blocks - pos);
+    (*extents)++;
+    if (len > *largest)
+      *largest = len;
+    pos = pos + len < total_blocks ? bm_find_run(pos + len, 1) : -1;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Cylinder group for a new directory, picked as FFS does: of the groups
+ * with at least the average share of free blocks, one holding the
+ * fewest directories. Among those, the one farthest from any group
+ * holding more, so directories that outgrow their group spill into
+ * empty ones rather than into each other.
+ */
+int fs_pick_group(void) {
+  pthread_mutex_lock(&alloc_lock);
+  int avg = free_count / cg_count;
+  int min = INT_MAX;
+  for (int g = 0; g < cg_count; g++)
+    if (cg_free[g] >= avg && cg_dirs[g] < min)
+      min = cg_dirs[g];
+
+  // walk the gaps between groups holding more than min directories
+  int best = 0;
+  int best_dist = -1;
+  int prev = -1;
+  for (int next = 0; next <= cg_count; next++) {
+    if (next < cg_count && cg_dirs[next] <= min)
+      continue;
+    for (int g = prev + 1; g < next; g++) {
+      if (cg_free[g] < avg || cg_dirs[g] != min)
+        continue;
+      int dist = prev < 0 ? INT_MAX : g - prev;
+      if (next < cg_count && next - g < dist)
+        dist = next - g;
+      if (dist > best_dist) {
+        best = g;
+        best_dist = dist;
+      }
+    }
+    prev = next;
+  }
+  cg_dirs[best]++;
+  pthread_mutex_unlock(&alloc_lock);
+  return best;
+}
+
+// count a directory read in (delta 1) or removed (-1) in its group
+void fs_group_count(int group, int delta) {
+  pthread_mutex_lock(&alloc_lock);
+  cg_dirs[group] += delta;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Promise n free blocks (negative to give them back) to a delayed file,
+ * so it is sure to find room when it gets its blocks; -1 if fewer than
+ * n free blocks are unpromised.
+ */
+int fs_reserve_blocks(int n) {
+  pthread_mutex_lock(&alloc_lock);
+  if (n > 0 && free_count - resv_count < n) {
+    pthread_mutex_unlock(&alloc_lock);
+    return -1;
+  }
+  resv_count += n;
+  pthread_mutex_unlock(&alloc_lock);
+  return 0;
+}
+
+// return a run of blocks to the free space
+void fs_free_blocks(int first, int blocks) {
+  if (first < 0 || blocks <= 0 || first + blocks > total_blocks)
+    return;
+  cache_forget(first, blocks);
+  pthread_mutex_lock(&alloc_lock);
+  bm_mark(first, blocks, 0);
+  if (alloc_policy != ALLOC_BITMAP)
+    ext_release(first, blocks);
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// forget all allocations
+int fs_free_space_reset(void) {
+  alloc_cursor = 0;
+  if (bm_reset() < 0)
+    return -1;
+  return ext_reset();
+}
+
+/*
+ * Rebuild the summaries from bitmap words read off disk: the free count
+ * per region and per cylinder group, and one extent per free stretch.
+ */
+int fs_free_space_load(void) {
+  if (total_blocks % 64)
+    bm_words[bm_nwords - 1] |= ~0ull << (total_blocks % 64);
+  for (int r = 0; r < nregions; r++)
+    region_free[r] = 0;
+  for (int g = 0; g < cg_count; g++)
+    cg_free[g] = 0;
+  free_count = 0;
+  for (int wi = 0; wi < bm_nwords; wi++) {
+    int n = 64 - __builtin_popcountll(bm_words[wi]);
+    region_free[wi * 64 / REGION_BLOCKS] += (unsigned int)n;
+    cg_free[wi * 64 / cg_blocks] += n;
+    free_count += n;
+  }
+
+  ext_free_tree(ext_root[EXT_BY_OFF]);
+  ext_root[EXT_BY_OFF] = NULL;
+  ext_root[EXT_BY_LEN] = NULL;
+  if (alloc_policy == ALLOC_BITMAP)
+    return 0;
+  for (int pos = bm_find_run(0, 1); pos >= 0;) {
+    struct fs_extent *e = malloc(sizeof(*e));
+    if (!e)
+      return -1;
+    e->off = pos;
+    e->len = bm_free_len(pos, total_blocks - pos);
+    ext_attach(e);
+    pos = pos + e->len < total_blocks ? bm_find_run(pos + e->len, 1) : -1;
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include "fs.h"
+
+// allocation policies for fs_alloc_run
+#define ALLOC_BEST 0 // smallest free extent that fits
+#define ALLOC_NEXT 1 // first fit at or after the previous allocation
+#define ALLOC_BITMAP 2 // next-fit by scanning the bitmap, no extent trees
+#define ALLOC_GROUP 3 // first fit from a goal in the file's cylinder group
+
+#define CG_CYLS_DEFAULT 16 // cylinders per cylinder group, --cg-cyls
+
+#define EXT_BY_OFF 0
+#define EXT_BY_LEN 1
+
+/*
+ * Free space is a set of maximal free extents, each linked into two AVL
+ * trees at once: one ordered by offset, one by (length, offset). The
+ * offset tree also keeps the largest length in every subtree, so
+ * next-fit can skip whole subtrees that are too fragmented. Allocate,
+ * free and both searches are O(log extents); a free merges with the
+ * free extents on either side. Guarded by alloc_lock.
+ */
+struct fs_extent {
+  int off;
+  int len;
+  int max_len; // largest len in this node's offset subtree
+  struct {
+    struct fs_extent *left;
+    struct fs_extent *right;
+    int height;
+  } link[2]; // EXT_BY_OFF, EXT_BY_LEN
+};
+
+extern pthread_mutex_t alloc_lock;
+extern uint64_t *bm_dirty;
+extern uint64_t *bm_words;
+extern int bm_nwords;
+extern int free_count;
+extern int resv_count;
+extern int alloc_policy;
+extern int cg_cyls;
+extern int cg_blocks;
+extern int cg_count;
+
+void ext_release(int first, int blocks);
+void bm_mark(int first, int blocks, int used);
+int bm_find_run(int from, int need);
+int ext_carve(struct fs_extent *e, int blocks);
+int ext_goal_fit(int goal, int need);
+int alloc_exact_locked(int goal, int blocks);
+int fs_alloc_run(int goal, int max, int *got);
+struct fs_extent *ext_find_at(int off);
+int fs_alloc_at(int start, int max);
+void fs_free_stats(int *extents, int *largest);
+int fs_pick_group(void);
+void fs_group_count(int group, int delta);
+int fs_reserve_blocks(int n);
+void fs_free_blocks(int first, int blocks);
+int fs_free_space_reset(void);
+int fs_free_space_load(void);
+
+#endif
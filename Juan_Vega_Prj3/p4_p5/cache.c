@@ -0,0 +1,712 @@
+#include "cache.h"
+#include "disk.h"
+
+/*
+ * Write-back block cache of CACHE_PAGE_BLOCKS pages in a fixed pool of
+ * frames, hashed by page number, with per-block valid and dirty bits.
+ * Pinned pages are never evicted; eviction is CLOCK, writing back a
+ * batch of dirty pages when no clean one is left. Requests over
+ * CACHE_BYPASS blocks go to the disk directly. Readahead pages start
+ * unreferenced. cache_lock guards everything and is never held across
+ * disk I/O.
+ */
+struct cache_page {
+  int page;           // disk block / CACHE_PAGE_BLOCKS, -1 if unused
+  int pins;           // users; a pinned page is never evicted
+  int hash_next;      // bucket chain, or free list link
+  uint32_t valid;     // blocks holding current data
+  uint32_t dirty;     // blocks newer than the disk
+  uint32_t fill;      // blocks a readahead is bringing in
+  unsigned char ref;  // CLOCK reference bit
+  unsigned char busy; // dirty blocks being written back
+};
+
+// a readahead in flight, see cache_prefetch
+struct cache_ahead {
+  struct disk_batch batch; // first: the done callback gets this back
+  struct cache_page *pin[CACHE_BYPASS / CACHE_PAGE_BLOCKS + 2];
+  unsigned char *fill; // blocks lo .. lo + nb - 1 come in here
+  int lo;
+  int nb;
+  int cnt; // pinned pages
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_idle = PTHREAD_COND_INITIALIZER; // busy / fill
+static struct cache_page *cache_pages = NULL;
+static unsigned char *cache_data = NULL; // CACHE_PAGE bytes per frame
+static int *cache_buckets = NULL;
+static int cache_mask = 0;    // buckets - 1
+static int cache_nframes = 0; // 0 = no cache
+static int cache_hwm = 0;     // frames ever handed out
+static int cache_free = -1;   // unused frames below cache_hwm
+static int cache_hand = 0;    // CLOCK hand
+static int cache_ahead = 0;   // readaheads in flight
+long cache_mb = CACHE_MB_DEFAULT;
+
+/* --------------- buffer cache --------------- */
+
+// size the frame pool from cache_mb; 0 MB turns the cache off
+int cache_init(void) {
+  long long frames = (long long)cache_mb * 1024 * 1024 / CACHE_PAGE;
+  if (frames > INT_MAX / 2)
+    frames = INT_MAX / 2;
+  cache_nframes = (int)frames;
+  if (cache_nframes == 0)
+    return 0;
+
+  int nbuckets = 1;
+  while (nbuckets < cache_nframes)
+    nbuckets *= 2;
+  cache_pages = calloc((size_t)cache_nframes, sizeof(*cache_pages));
+  cache_buckets = malloc((size_t)nbuckets * sizeof(*cache_buckets));
+  // frames are only touched once used, so the budget is a ceiling
+  cache_data = malloc((size_t)cache_nframes * CACHE_PAGE);
+  if (!cache_pages || !cache_buckets || !cache_data)
+    return -1;
+  cache_mask = nbuckets - 1;
+  memset(cache_buckets, 0xff, (size_t)nbuckets * sizeof(*cache_buckets));
+  return 0;
+}
+
+// drop every page, dirty or not; caller holds fs_lock exclusive
+void cache_reset(void) {
+  if (cache_nframes == 0)
+    return;
+  pthread_mutex_lock(&cache_lock);
+  while (cache_ahead > 0) // their pages are pinned
+    pthread_cond_wait(&cache_idle, &cache_lock);
+  memset(cache_buckets, 0xff, (size_t)(cache_mask + 1) * sizeof(int));
+  cache_hwm = 0;
+  cache_free = -1;
+  cache_hand = 0;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static unsigned char *cache_frame(const struct cache_page *p) {
+  return cache_data + (size_t)(p - cache_pages) * CACHE_PAGE;
+}
+
+static struct cache_page *cache_lookup(int pg) {
+  int i = cache_buckets[pg & cache_mask];
+  while (i >= 0 && cache_pages[i].page != pg)
+    i = cache_pages[i].hash_next;
+  return i >= 0 ? &cache_pages[i] : NULL;
+}
+
+static void cache_unhash(struct cache_page *p) {
+  int i = (int)(p - cache_pages);
+  int *link = &cache_buckets[p->page & cache_mask];
+  while (*link != i)
+    link = &cache_pages[*link].hash_next;
+  *link = p->hash_next;
+}
+
+// the blocks of page pg inside [blk, blk + n), as a mask
+static uint32_t cache_span(int pg, int blk, int n) {
+  int base = pg * CACHE_PAGE_BLOCKS;
+  int lo = blk > base ? blk - base : 0;
+  int hi = blk + n - base;
+  if (hi > CACHE_PAGE_BLOCKS)
+    hi = CACHE_PAGE_BLOCKS;
+  if (hi <= lo)
+    return 0;
+  uint32_t m = (hi - lo == 32) ? ~0u : (1u << (hi - lo)) - 1;
+  return m << lo;
+}
+
+static int cache_page_cmp(const void *a, const void *b) {
+  const struct cache_page *x = *(struct cache_page *const *)a;
+  const struct cache_page *y = *(struct cache_page *const *)b;
+  return (x->page > y->page) - (x->page < y->page);
+}
+
+/*
+ * Write back the dirty blocks of cnt pages the caller has pinned and
+ * marked busy, one disk request per stretch of consecutive dirty blocks
+ * across the pages. Entered and left with cache_lock held; it is
+ * dropped for the disk I/O. Blocks whose write fails stay dirty.
+ */
+static int cache_flush(struct cache_page **list, int cnt) {
+  qsort(list, (size_t)cnt, sizeof(*list), cache_page_cmp);
+  unsigned char *buf = malloc((size_t)cnt * CACHE_PAGE);
+  uint32_t *mask = malloc((size_t)cnt * sizeof(*mask));
+  int rc = (buf && mask) ? 0 : -1;
+
+  if (rc == 0) {
+    for (int i = 0; i < cnt; i++) {
+      mask[i] = list[i]->dirty;
+      list[i]->dirty = 0;
+      memcpy(buf + (size_t)i * CACHE_PAGE, cache_frame(list[i]), CACHE_PAGE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // slot j of buf is block j % CACHE_PAGE_BLOCKS of page j / that;
+    // every stretch is in flight before the first reply is awaited
+    struct disk_batch batch = {0, 0, NULL};
+    int slots = cnt * CACHE_PAGE_BLOCKS;
+    int start = -1; // first slot of the stretch being collected
+    int first = 0;  // its disk block
+    for (int j = 0; j <= slots; j++) {
+      int blk = -1;
+      int i = j / CACHE_PAGE_BLOCKS;
+      int b = j % CACHE_PAGE_BLOCKS;
+      if (j < slots && (mask[i] >> b & 1))
+        blk = list[i]->page * CACHE_PAGE_BLOCKS + b;
+      if (start >= 0 && blk != first + (j - start)) {
+        disk_submit_run(&batch, 1, first, j - start,
+                        buf + (size_t)start * BLOCK_SIZE,
+                        (size_t)(j - start) * BLOCK_SIZE);
+        start = -1;
+      }
+      if (blk >= 0 && start < 0) {
+        start = j;
+        first = blk;
+      }
+    }
+    rc = disk_wait(&batch);
+    pthread_mutex_lock(&cache_lock);
+  }
+
+  for (int i = 0; i < cnt; i++) {
+    if (rc < 0 && mask && buf)
+      list[i]->dirty |= mask[i];
+    list[i]->busy = 0;
+    list[i]->pins--;
+  }
+  pthread_cond_broadcast(&cache_idle);
+  free(buf);
+  free(mask);
+  return rc;
+}
+
+// write back up to CACHE_FLUSH_BATCH unpinned dirty pages
+static int cache_flush_some(void) {
+  struct cache_page *list[CACHE_FLUSH_BATCH];
+  int cnt = 0;
+  for (int k = 0; k < cache_hwm && cnt < CACHE_FLUSH_BATCH; k++) {
+    struct cache_page *p = &cache_pages[(cache_hand + k) % cache_hwm];
+    if (p->page < 0 || p->pins > 0 || !p->dirty)
+      continue;
+    p->pins++;
+    p->busy = 1;
+    list[cnt++] = p;
+  }
+  if (cnt == 0)
+    return 0;
+  return cache_flush(list, cnt) < 0 ? -1 : cnt;
+}
+
+/*
+ * Write back every page dirty at the call, sorted by disk block and
+ * CACHE_FLUSH_BATCH pages per cache_flush. A page someone else is
+ * writing back is waited for and then looked at again: blocks dirtied
+ * while its write was in flight are not in that write.
+ */
+int cache_sync(void) {
+  if (cache_nframes == 0)
+    return 0;
+  struct cache_page **list = malloc((size_t)cache_nframes * sizeof(*list));
+  int *later = malloc((size_t)cache_nframes * sizeof(*later));
+  if (!list || !later) {
+    free(list);
+    free(later);
+    return -1;
+  }
+
+  int rc = 0;
+  int cnt = 0;
+  int nlater = 0;
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < cache_hwm; i++) {
+    struct cache_page *p = &cache_pages[i];
+    if (p->page < 0)
+      continue;
+    if (p->busy) {
+      later[nlater++] = i;
+    } else if (p->dirty) {
+      p->pins++;
+      p->busy = 1;
+      list[cnt++] = p;
+    }
+  }
+  qsort(list, (size_t)cnt, sizeof(*list), cache_page_cmp);
+  for (int k = 0; k < cnt; k += CACHE_FLUSH_BATCH) {
+    int n = cnt - k < CACHE_FLUSH_BATCH ? cnt - k : CACHE_FLUSH_BATCH;
+    if (cache_flush(list + k, n) < 0)
+      rc = -1;
+  }
+
+  for (int k = 0; k < nlater; k++) {
+    struct cache_page *p = &cache_pages[later[k]];
+    while (p->busy)
+      pthread_cond_wait(&cache_idle, &cache_lock);
+    if (p->page >= 0 && p->dirty) {
+      p->pins++;
+      p->busy = 1;
+      if (cache_flush(&p, 1) < 0)
+        rc = -1;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  free(list);
+  free(later);
+  return rc;
+}
+
+/*
+ * Pin disk page pg, giving it a frame if it is not cached. Returns NULL
+ * when every frame is pinned or write-back fails, and the caller goes
+ * to the disk directly. With flush set it may drop cache_lock to write
+ * dirty pages back; without, it gives up when only dirty ones are left.
+ */
+static struct cache_page *cache_pin(int pg, int flush) {
+  while (1) {
+    struct cache_page *p = cache_lookup(pg);
+    if (p) {
+      p->pins++;
+      p->ref = 1;
+      return p;
+    }
+
+    int i = -1;
+    if (cache_free >= 0) {
+      i = cache_free;
+      cache_free = cache_pages[i].hash_next;
+    } else if (cache_hwm < cache_nframes) {
+      i = cache_hwm++;
+    } else {
+      // CLOCK: two sweeps clear every reference bit on the way
+      int dirty = 0;
+      for (int k = 0; k < 2 * cache_hwm && i < 0; k++) {
+        struct cache_page *v = &cache_pages[cache_hand];
+        cache_hand = (cache_hand + 1) % cache_hwm;
+        if (v->page < 0 || v->pins > 0)
+          continue;
+        if (v->ref) {
+          v->ref = 0;
+        } else if (v->dirty) {
+          dirty = 1;
+        } else {
+          cache_unhash(v);
+          i = (int)(v - cache_pages);
+        }
+      }
+      if (i < 0) {
+        if (!dirty || !flush || cache_flush_some() <= 0)
+          return NULL;
+        continue; // pg may have been cached while the lock was dropped
+      }
+    }
+
+    p = &cache_pages[i];
+    p->page = pg;
+    p->pins = 1;
+    p->valid = 0;
+    p->dirty = 0;
+    p->fill = 0;
+    p->ref = 1;
+    p->busy = 0;
+    p->hash_next = cache_buckets[pg & cache_mask];
+    cache_buckets[pg & cache_mask] = i;
+    return p;
+  }
+}
+
+// pin pages pg0 .. pg0 + cnt - 1 into pin[], all or nothing
+static int cache_pin_range(int pg0, int cnt, struct cache_page **pin) {
+  for (int i = 0; i < cnt; i++) {
+    pin[i] = cache_pin(pg0 + i, 1);
+    if (!pin[i]) {
+      while (i-- > 0)
+        pin[i]->pins--;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// wait until no cached page of pg0 .. pg1 is being written back
+static void cache_wait_idle(int pg0, int pg1) {
+  for (int pg = pg0; pg <= pg1; pg++) {
+    struct cache_page *p = cache_lookup(pg);
+    if (p && p->busy) {
+      pthread_cond_wait(&cache_idle, &cache_lock);
+      pg = pg0 - 1; // anything may have moved, look again
+    }
+  }
+}
+
+// page p's share of a write of [blk, blk + n), zero padded past len
+static void cache_copy_in(struct cache_page *p, int blk, int n,
+                          const unsigned char *data, size_t len) {
+  int base = p->page * CACHE_PAGE_BLOCKS;
+  int lo = blk > base ? blk : base;
+  int hi = blk + n < base + CACHE_PAGE_BLOCKS ? blk + n
+                                              : base + CACHE_PAGE_BLOCKS;
+  unsigned char *dst = cache_frame(p) + (size_t)(lo - base) * BLOCK_SIZE;
+  size_t off = (size_t)(lo - blk) * BLOCK_SIZE;
+  size_t bytes = (size_t)(hi - lo) * BLOCK_SIZE;
+  size_t have = off < len ? len - off : 0;
+  if (have > bytes)
+    have = bytes;
+  memcpy(dst, data + off, have);
+  memset(dst + have, 0, bytes - have);
+}
+
+// page p's share of a read of [blk, blk + n), stopping at len
+static void cache_copy_out(const struct cache_page *p, int blk, int n,
+                           unsigned char *data, size_t len) {
+  int base = p->page * CACHE_PAGE_BLOCKS;
+  int lo = blk > base ? blk : base;
+  int hi = blk + n < base + CACHE_PAGE_BLOCKS ? blk + n
+                                              : base + CACHE_PAGE_BLOCKS;
+  size_t off = (size_t)(lo - blk) * BLOCK_SIZE;
+  size_t bytes = (size_t)(hi - lo) * BLOCK_SIZE;
+  if (off >= len)
+    return;
+  if (bytes > len - off)
+    bytes = len - off;
+  memcpy(data + off, cache_frame(p) + (size_t)(lo - base) * BLOCK_SIZE,
+         bytes);
+}
+
+/*
+ * Uncached write. Cached pages it overlaps must not later write their
+ * older dirty copy over it, so their write-back is waited for and their
+ * dirty bits dropped first; afterwards they take the new bytes.
+ */
+static int cache_write_direct(int blk, int n, const unsigned char *data,
+                              size_t len) {
+  int pg0 = blk / CACHE_PAGE_BLOCKS;
+  int pg1 = (blk + n - 1) / CACHE_PAGE_BLOCKS;
+
+  pthread_mutex_lock(&cache_lock);
+  cache_wait_idle(pg0, pg1);
+  for (int pg = pg0; pg <= pg1; pg++) {
+    struct cache_page *p = cache_lookup(pg);
+    if (p)
+      p->dirty &= ~cache_span(pg, blk, n);
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  int rc = disk_write_run(blk, n, data, len);
+
+  pthread_mutex_lock(&cache_lock);
+  for (int pg = pg0; pg <= pg1; pg++) {
+    struct cache_page *p = cache_lookup(pg);
+    if (!p)
+      continue;
+    uint32_t m = cache_span(pg, blk, n);
+    if (rc < 0) {
+      p->valid &= ~m; // the disk holds who knows what now
+      continue;
+    }
+    cache_copy_in(p, blk, n, data, len);
+    p->valid |= m;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return rc;
+}
+
+// uncached read; dirty cached blocks in the range reach the disk first
+static int cache_read_direct(int blk, int n, unsigned char *data,
+                             size_t len) {
+  int pg0 = blk / CACHE_PAGE_BLOCKS;
+  int pg1 = (blk + n - 1) / CACHE_PAGE_BLOCKS;
+
+  pthread_mutex_lock(&cache_lock);
+  while (1) {
+    cache_wait_idle(pg0, pg1);
+    struct cache_page *list[CACHE_FLUSH_BATCH];
+    int cnt = 0;
+    for (int pg = pg0; pg <= pg1 && cnt < CACHE_FLUSH_BATCH; pg++) {
+      struct cache_page *p = cache_lookup(pg);
+      if (!p || !(p->dirty & cache_span(pg, blk, n)))
+        continue;
+      p->pins++;
+      p->busy = 1;
+      list[cnt++] = p;
+    }
+    if (cnt == 0)
+      break;
+    if (cache_flush(list, cnt) < 0) {
+      pthread_mutex_unlock(&cache_lock);
+      return -1;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return disk_read_run(blk, n, data, len);
+}
+
+/*
+ * Write len bytes to blocks [blk, blk + n) through the cache, zero
+ * padding the last block. Returns once the pages are dirty; the disk
+ * sees them on write-back.
+ */
+int cache_write_run(int blk, int n, const unsigned char *data,
+                    size_t len) {
+  if (cache_nframes == 0)
+    return disk_write_run(blk, n, data, len);
+  if (blk < 0 || n <= 0 || blk + n > total_blocks ||
+      len > (size_t)n * BLOCK_SIZE)
+    return -1;
+  if (n > CACHE_BYPASS)
+    return cache_write_direct(blk, n, data, len);
+
+  struct cache_page *pin[CACHE_BYPASS / CACHE_PAGE_BLOCKS + 2];
+  int pg0 = blk / CACHE_PAGE_BLOCKS;
+  int cnt = (blk + n - 1) / CACHE_PAGE_BLOCKS - pg0 + 1;
+
+  pthread_mutex_lock(&cache_lock);
+  if (cache_pin_range(pg0, cnt, pin) < 0) {
+    pthread_mutex_unlock(&cache_lock);
+    return cache_write_direct(blk, n, data, len);
+  }
+  for (int i = 0; i < cnt; i++) {
+    uint32_t m = cache_span(pg0 + i, blk, n);
+    cache_copy_in(pin[i], blk, n, data, len);
+    pin[i]->valid |= m;
+    pin[i]->dirty |= m;
+    pin[i]->pins--;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+/*
+ * Start reading the first len bytes of blocks [blk, blk + n) through the
+ * cache; cache_read_end() waits and copies the data out. Whatever the
+ * pages touched are missing goes out as one RN, whole pages at a time so
+ * neighbouring reads hit, and the pages stay pinned until the end.
+ */
+void cache_read_begin(struct cache_read *cr, int blk, int n,
+                      unsigned char *data, size_t len) {
+  memset(cr, 0, sizeof(*cr));
+  cr->blk = blk;
+  cr->n = n;
+  cr->data = data;
+  cr->len = len;
+  cr->mode = CR_DISK;
+  if (!disk_run_ok(blk, n, len)) {
+    cr->batch.failed = 1;
+    return;
+  }
+  if (cache_nframes == 0) {
+    disk_submit_run(&cr->batch, 0, blk, n, data, len);
+    return;
+  }
+  cr->mode = CR_DIRECT;
+  if (n > CACHE_BYPASS)
+    return;
+
+  int pg0 = blk / CACHE_PAGE_BLOCKS;
+  int cnt = (blk + n - 1) / CACHE_PAGE_BLOCKS - pg0 + 1;
+
+  pthread_mutex_lock(&cache_lock);
+  if (cache_pin_range(pg0, cnt, cr->pin) < 0) {
+    pthread_mutex_unlock(&cache_lock);
+    return;
+  }
+  cr->mode = CR_CACHE;
+  cr->cnt = cnt;
+
+  // blocks past the end of the disk count as present
+  uint32_t tail = cache_span(pg0 + cnt - 1, 0, total_blocks);
+  int lo;
+  int hi;
+  int wait;
+  do {
+    lo = INT_MAX;
+    hi = -1;
+    wait = 0;
+    for (int i = 0; i < cnt; i++) {
+      uint32_t miss = ~cr->pin[i]->valid & (i == cnt - 1 ? tail : ~0u);
+      if (!miss)
+        continue;
+      if (miss & cache_span(pg0 + i, blk, n) & cr->pin[i]->fill)
+        wait = 1; // a readahead is already bringing it in
+      int base = (pg0 + i) * CACHE_PAGE_BLOCKS;
+      if (lo == INT_MAX)
+        lo = base + __builtin_ctz(miss);
+      hi = base + 31 - __builtin_clz(miss);
+    }
+    if (wait)
+      pthread_cond_wait(&cache_idle, &cache_lock);
+  } while (wait);
+  pthread_mutex_unlock(&cache_lock);
+
+  if (hi < 0)
+    return;
+  cr->lo = lo;
+  cr->nb = hi - lo + 1;
+  cr->fill = malloc((size_t)cr->nb * BLOCK_SIZE);
+  if (!cr->fill) {
+    cr->batch.failed = 1;
+    return;
+  }
+  disk_submit_run(&cr->batch, 0, lo, cr->nb, cr->fill,
+                  (size_t)cr->nb * BLOCK_SIZE);
+}
+
+// finish a cache_read_begin(): 0 once the data is in place, else -1
+int cache_read_end(struct cache_read *cr) {
+  if (cr->mode == CR_DIRECT)
+    return cache_read_direct(cr->blk, cr->n, cr->data, cr->len);
+  int rc = disk_wait(&cr->batch);
+  if (cr->mode == CR_DISK)
+    return rc;
+
+  int pg0 = cr->blk / CACHE_PAGE_BLOCKS;
+  pthread_mutex_lock(&cache_lock);
+
+  // blocks someone made valid meanwhile are newer than the disk copy
+  for (int i = 0; i < cr->cnt && rc == 0 && cr->nb > 0; i++) {
+    int base = (pg0 + i) * CACHE_PAGE_BLOCKS;
+    uint32_t m = cache_span(pg0 + i, cr->lo, cr->nb) & ~cr->pin[i]->valid;
+    for (uint32_t left = m; left; left &= left - 1) {
+      int b = __builtin_ctz(left);
+      memcpy(cache_frame(cr->pin[i]) + (size_t)b * BLOCK_SIZE,
+             cr->fill + (size_t)(base + b - cr->lo) * BLOCK_SIZE,
+             BLOCK_SIZE);
+    }
+    cr->pin[i]->valid |= m;
+  }
+
+  for (int i = 0; i < cr->cnt; i++) {
+    if (rc == 0)
+      cache_copy_out(cr->pin[i], cr->blk, cr->n, cr->data, cr->len);
+    cr->pin[i]->pins--;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  free(cr->fill);
+  return rc;
+}
+
+// freed blocks: their cached copies, dirty or not, are garbage now
+void cache_forget(int first, int blocks) {
+  if (cache_nframes == 0)
+    return;
+  int pg0 = first / CACHE_PAGE_BLOCKS;
+  int pg1 = (first + blocks - 1) / CACHE_PAGE_BLOCKS;
+
+  pthread_mutex_lock(&cache_lock);
+  for (int pg = pg0; pg <= pg1; pg++) {
+    struct cache_page *p = cache_lookup(pg);
+    if (!p)
+      continue;
+    uint32_t m = cache_span(pg, first, blocks);
+    p->valid &= ~m;
+    p->dirty &= ~m;
+    p->fill &= ~m; // a readahead of them must not make them valid
+    if (p->valid == 0 && p->dirty == 0 && p->pins == 0) {
+      cache_unhash(p);
+      p->page = -1;
+      p->hash_next = cache_free;
+      cache_free = (int)(p - cache_pages);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// last reply of a readahead: fill the blocks nobody wrote meanwhile
+static void cache_ahead_done(struct disk_batch *b) {
+  struct cache_ahead *ca = (struct cache_ahead *)b;
+
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < ca->cnt; i++) {
+    struct cache_page *p = ca->pin[i];
+    int base = p->page * CACHE_PAGE_BLOCKS;
+    uint32_t span = cache_span(p->page, ca->lo, ca->nb);
+    uint32_t m = b->failed ? 0 : span & p->fill & ~p->valid;
+    for (uint32_t left = m; left; left &= left - 1) {
+      int k = __builtin_ctz(left);
+      memcpy(cache_frame(p) + (size_t)k * BLOCK_SIZE,
+             ca->fill + (size_t)(base + k - ca->lo) * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    p->valid |= m;
+    p->fill &= ~span;
+    p->pins--;
+  }
+  cache_ahead--;
+  pthread_cond_broadcast(&cache_idle);
+  pthread_mutex_unlock(&cache_lock);
+  free(ca->fill);
+  free(ca);
+}
+
+/*
+ * Start bringing blocks [blk, blk + n) into the cache and return
+ * without waiting. Readahead is a hint: it only takes frames that are
+ * free or clean, never writes back to make room, and quietly does less
+ * (or nothing) when frames or memory run short.
+ */
+void cache_prefetch(int blk, int n) {
+  if (cache_nframes == 0 || n > CACHE_BYPASS || !disk_run_ok(blk, n, 0))
+    return;
+  struct cache_ahead *ca = malloc(sizeof(*ca));
+  if (!ca)
+    return;
+
+  int pg0 = blk / CACHE_PAGE_BLOCKS;
+  int cnt = (blk + n - 1) / CACHE_PAGE_BLOCKS - pg0 + 1;
+  uint32_t tail = cache_span(pg0 + cnt - 1, 0, total_blocks);
+  int lo = INT_MAX;
+  int hi = -1;
+  int first = 0; // pin[] index of the page holding lo
+  int last = -1; // and of the one holding hi
+
+  pthread_mutex_lock(&cache_lock);
+  int got = 0;
+  for (; got < cnt; got++) {
+    int fresh = !cache_lookup(pg0 + got);
+    struct cache_page *p = cache_pin(pg0 + got, 0);
+    if (!p)
+      break;
+    if (fresh)
+      p->ref = 0; // not used yet; evicted first if it never is
+    ca->pin[got] = p;
+
+    uint32_t miss = ~p->valid & ~p->fill & (got == cnt - 1 ? tail : ~0u);
+    if (!miss)
+      continue;
+    int base = (pg0 + got) * CACHE_PAGE_BLOCKS;
+    if (lo == INT_MAX) {
+      lo = base + __builtin_ctz(miss);
+      first = got;
+    }
+    hi = base + 31 - __builtin_clz(miss);
+    last = got;
+  }
+
+  ca->fill = hi >= 0 ? malloc((size_t)(hi - lo + 1) * BLOCK_SIZE) : NULL;
+  if (!ca->fill) {
+    for (int i = 0; i < got; i++)
+      ca->pin[i]->pins--;
+    pthread_mutex_unlock(&cache_lock);
+    free(ca);
+    return;
+  }
+
+  // keep only the pages the read lands in
+  for (int i = 0; i < got; i++)
+    if (i < first || i > last)
+      ca->pin[i]->pins--;
+  memmove(ca->pin, ca->pin + first, (size_t)(last - first + 1) *
+                                        sizeof(ca->pin[0]));
+  ca->cnt = last - first + 1;
+  ca->lo = lo;
+  ca->nb = hi - lo + 1;
+  for (int i = 0; i < ca->cnt; i++) {
+    struct cache_page *p = ca->pin[i];
+    p->fill |= cache_span(p->page, lo, ca->nb) & ~p->valid;
+  }
+  cache_ahead++;
+  pthread_mutex_unlock(&cache_lock);
+
+  // one pending of our own until every piece is queued
+  ca->batch = (struct disk_batch){1, 0, cache_ahead_done};
+  disk_submit_run(&ca->batch, 0, lo, ca->nb, ca->fill,
+                  (size_t)ca->nb * BLOCK_SIZE);
+  disk_put(&ca->batch, 0);
+}
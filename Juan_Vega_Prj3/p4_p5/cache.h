@@ -0,0 +1,45 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "disk.h"
+
+// buffer cache
+#define CACHE_PAGE_BLOCKS 32 // blocks per cache page, one mask bit each
+#define CACHE_PAGE (CACHE_PAGE_BLOCKS * BLOCK_SIZE)
+#define CACHE_MB_DEFAULT 16  // memory budget, --cache
+#define CACHE_BYPASS 1024    // larger requests go straight to the disk
+#define CACHE_FLUSH_BATCH 64 // dirty pages written back per eviction pass
+
+// how a cache_read gets its data
+#define CR_DISK 0   // RN straight into the caller's buffer (no cache)
+#define CR_CACHE 1  // through pinned pages, missing blocks via fill
+#define CR_DIRECT 2 // uncached read done synchronously at the end
+
+// a read in flight through the cache, see cache_read_begin
+struct cache_read {
+  struct disk_batch batch;
+  struct cache_page *pin[CACHE_BYPASS / CACHE_PAGE_BLOCKS + 2];
+  unsigned char *data; // caller's buffer
+  size_t len;
+  unsigned char *fill; // blocks lo .. lo + nb - 1 come in here
+  int blk;
+  int n;
+  int cnt; // pinned pages
+  int lo;
+  int nb;
+  int mode; // CR_*
+};
+
+extern long cache_mb;
+
+int cache_init(void);
+void cache_reset(void);
+int cache_sync(void);
+int cache_write_run(int blk, int n, const unsigned char *data, size_t len);
+void cache_read_begin(struct cache_read *cr, int blk, int n,
+                      unsigned char *data, size_t len);
+int cache_read_end(struct cache_read *cr);
+void cache_forget(int first, int blocks);
+void cache_prefetch(int blk, int n);
+
+#endif
@@ -0,0 +1,243 @@
+#include "alloc.h"
+#include "cache.h"
+#include "compact.h"
+#include "file.h"
+#include "flusher.h"
+#include "itab.h"
+#include "journal.h"
+
+#define COMPACT_FILE_MAX 8192   // blocks; larger files are not moved
+#define COMPACT_AUTO_MS 10000   // least time between automatic passes
+
+/*
+ * Online compaction: the compactor walks the tree like a session and
+ * moves a file into one run that joins it up or lies nearer the start
+ * of its group. The inode switches in a journal handle and the old
+ * blocks are freed only after that commits (fs_free_ext), so a crash
+ * finds the file in one place. compact_kb bounds the copy rate.
+ * compact_lock guards the state below and is a leaf lock.
+ */
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_kick = PTHREAD_COND_INITIALIZER;
+static int compact_wanted = 0;       // a pass was asked for
+static int compact_running = 0;      // a pass is under way
+static long long compact_last = 0;   // ms (monotonic) the last pass ended
+static long long compact_passes = 0; // passes done since startup
+static long long compact_files = 0;  // files moved by them
+static long long compact_blocks = 0; // and the blocks those held
+int compact_kb = COMPACT_KB_DEFAULT; // KB/s, 0 = no limit
+
+// ask for a compaction pass; an automatic one waits COMPACT_AUTO_MS
+void fs_compact_kick(int manual) {
+  pthread_mutex_lock(&compact_lock);
+  if (manual || (!compact_running && !compact_wanted &&
+                 fs_now_ms() - compact_last >= COMPACT_AUTO_MS)) {
+    compact_wanted = 1;
+    pthread_cond_signal(&compact_kick);
+  }
+  pthread_mutex_unlock(&compact_lock);
+}
+
+// what COMPACT STAT reports: a pass pending or running, and the totals
+void fs_compact_stat(int *busy, long long *passes, long long *files,
+                     long long *blocks) {
+  pthread_mutex_lock(&compact_lock);
+  *busy = compact_running || compact_wanted;
+  *passes = compact_passes;
+  *files = compact_files;
+  *blocks = compact_blocks;
+  pthread_mutex_unlock(&compact_lock);
+}
+
+/*
+ * Move file idx of directory dir to one run nearer its goal, see
+ * Online compaction. Returns the blocks moved, 0 if it stays, -1 on a
+ * disk error. Caller holds the file lock exclusive.
+ */
+static int fs_compact_file(int idx, int dir) {
+  struct fs_entry *e = fs_ent(idx);
+  int n = e->nblocks;
+  if (e->store != STORE_BLOCKS || n == 0 || n > COMPACT_FILE_MAX)
+    return 0;
+  struct fs_run *old = fs_runs(e);
+  int goal = alloc_policy == ALLOC_GROUP ? fs_ent(dir)->dir->group * cg_blocks
+                                         : 0;
+
+  pthread_mutex_lock(&alloc_lock);
+  int first = -1;
+  if (free_count - resv_count >= n)
+    first = alloc_policy == ALLOC_BITMAP ? bm_find_run(goal, n)
+                                         : ext_goal_fit(goal, n);
+  int better = first >= 0 && (e->nruns > 1 || abs(first - goal) <
+                                                  abs(old[0].first - goal));
+  if (better)
+    bm_mark(first, n, 1);
+  else if (first >= 0 && alloc_policy != ALLOC_BITMAP)
+    ext_release(first, n); // taken from the trees only
+  pthread_mutex_unlock(&alloc_lock);
+  if (!better)
+    return 0;
+
+  size_t bytes = (size_t)n * BLOCK_SIZE;
+  unsigned char *buf = malloc(bytes);
+  if (!buf || fs_io_blocks(e, 0, n, buf, bytes, 0) < 0 ||
+      cache_write_run(first, n, buf, bytes) < 0) {
+    free(buf);
+    fs_free_blocks(first, n);
+    return buf ? -1 : 0;
+  }
+  free(buf);
+
+  struct fs_run ext = e->nruns > 1 ? old[e->nruns] : (struct fs_run){-1, 0};
+  fs_jnl_begin();
+  for (int i = 0; i < e->nruns; i++) {
+    cache_forget(old[i].first, old[i].len); // the copy is in the new run
+    fs_free_ext(old[i]);
+  }
+  if (ext.len > 0)
+    fs_free_ext(ext);
+  if (e->nruns > 1)
+    free(e->runs);
+  e->nruns = 1;
+  e->run = (struct fs_run){first, n};
+  fs_meta_data(idx);
+  fs_jnl_end();
+  return n;
+}
+
+// sleep until moved bytes since start_ms fit in compact_kb
+static void fs_compact_throttle(long long start_ms, long long moved) {
+  if (compact_kb <= 0)
+    return;
+  long long wait = start_ms + moved * 1000 / ((long long)compact_kb * 1024) -
+                   fs_now_ms();
+  if (wait > 0) {
+    struct timespec ts = {.tv_sec = wait / 1000,
+                          .tv_nsec = (long)(wait % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+  }
+}
+
+/*
+ * One compaction pass over directory dir: its files in creation order,
+ * then its subdirectories depth first. Children are listed by name and
+ * looked up again one at a time, as a session would, so the locks are
+ * held only while a file is moved. The caller holds a reference on dir.
+ * *moved counts the bytes copied since start_ms; -1 once a format has
+ * replaced the tree.
+ */
+static int fs_compact_dir(int dir, unsigned int epoch, long long start_ms,
+                          long long *moved) {
+  fs_lock_shared();
+  if (atomic_load(&fs_epoch) != epoch) {
+    pthread_rwlock_unlock(&fs_lock);
+    return -1;
+  }
+  if (fs_dir_load(dir) < 0) {
+    pthread_rwlock_unlock(&fs_lock);
+    return 0;
+  }
+  pthread_rwlock_rdlock(dir_lock(dir));
+  struct fs_dir *d = fs_ent(dir)->dir;
+  int cnt = d->nchildren;
+  char(*names)[MAX_NAME] = malloc((size_t)(cnt + 1) * MAX_NAME);
+  unsigned char *is_dir = malloc((size_t)cnt + 1);
+  int n = 0;
+  for (int i = d->first_child; names && is_dir && i >= 0 && n < cnt;
+       i = fs_ent(i)->next_sibling) {
+    memcpy(names[n], fs_name(fs_ent(i)), fs_ent(i)->name_len + 1u);
+    is_dir[n++] = fs_ent(i)->is_dir;
+  }
+  pthread_rwlock_unlock(dir_lock(dir));
+  pthread_rwlock_unlock(&fs_lock);
+
+  int rc = 0;
+  for (int i = 0; i < n && rc == 0; i++) {
+    if (is_dir[i])
+      continue;
+    fs_lock_shared();
+    if (atomic_load(&fs_epoch) != epoch) {
+      pthread_rwlock_unlock(&fs_lock);
+      rc = -1;
+      break;
+    }
+    int got = 0;
+    int idx = fs_file_lock_in(dir, names[i], 1);
+    if (idx >= 0) {
+      got = fs_compact_file(idx, dir);
+      fs_file_unlock(idx);
+    }
+    // the blocks it left can take the next file
+    if (got > 0 && fs_jnl_release() < 0)
+      fprintf(stderr, "compactor: checkpoint failed\n");
+    pthread_rwlock_unlock(&fs_lock);
+    if (got < 0)
+      fprintf(stderr, "compactor: could not move %s\n", names[i]);
+    if (got > 0) {
+      pthread_mutex_lock(&compact_lock);
+      compact_files++;
+      compact_blocks += got;
+      pthread_mutex_unlock(&compact_lock);
+      *moved += (long long)got * BLOCK_SIZE;
+      fs_compact_throttle(start_ms, *moved);
+    }
+  }
+
+  for (int i = 0; i < n && rc == 0; i++) {
+    if (!is_dir[i])
+      continue;
+    fs_lock_shared();
+    if (atomic_load(&fs_epoch) != epoch) {
+      pthread_rwlock_unlock(&fs_lock);
+      rc = -1;
+      break;
+    }
+    pthread_rwlock_rdlock(dir_lock(dir));
+    int sub = fs_find(names[i], 1, dir);
+    if (sub >= 0)
+      fs_ref_dir(sub); // pinned before the lock drops, as cd does
+    pthread_rwlock_unlock(dir_lock(dir));
+    pthread_rwlock_unlock(&fs_lock);
+    if (sub < 0)
+      continue;
+
+    rc = fs_compact_dir(sub, epoch, start_ms, moved);
+    fs_lock_shared();
+    if (atomic_load(&fs_epoch) == epoch)
+      atomic_fetch_sub(&fs_ent(sub)->dir->refs, 1);
+    pthread_rwlock_unlock(&fs_lock);
+  }
+  free(names);
+  free(is_dir);
+  return rc;
+}
+
+// background compactor: one pass over the tree per kick
+void *fs_compactor(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&compact_lock);
+  while (1) {
+    while (!compact_wanted)
+      pthread_cond_wait(&compact_kick, &compact_lock);
+    compact_wanted = 0;
+    compact_running = 1;
+    pthread_mutex_unlock(&compact_lock);
+
+    fs_lock_shared();
+    unsigned int epoch = atomic_load(&fs_epoch);
+    fs_ref_dir(0);
+    pthread_rwlock_unlock(&fs_lock);
+    long long moved = 0;
+    fs_compact_dir(0, epoch, fs_now_ms(), &moved);
+    fs_lock_shared();
+    if (atomic_load(&fs_epoch) == epoch)
+      atomic_fetch_sub(&fs_ent(0)->dir->refs, 1);
+    pthread_rwlock_unlock(&fs_lock);
+
+    pthread_mutex_lock(&compact_lock);
+    compact_running = 0;
+    compact_passes++;
+    compact_last = fs_now_ms();
+  }
+  return NULL;
+}
@@ -0,0 +1,15 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "fs.h"
+
+#define COMPACT_KB_DEFAULT 1024 // compactor copy budget per second
+
+extern int compact_kb;
+
+void fs_compact_kick(int manual);
+void fs_compact_stat(int *busy, long long *passes, long long *files,
+                     long long *blocks);
+void *fs_compactor(void *arg);
+
+#endif
@@ -0,0 +1,447 @@
+#include "disk.h"
+
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t disk_done = PTHREAD_COND_INITIALIZER; // replies
+static struct disk_conn *disk_conns = NULL;
+int disk_nconns = DISK_CONNS_DEFAULT;
+static atomic_uint disk_next; // spreads ties between connections
+int disk_window = DISK_WINDOW_DEFAULT;
+static int cylinders = 0;
+int sectors = 0;
+int total_blocks = 0;
+
+static void *disk_reader(void *arg);
+
+/* --------------- generic I/O helpers --------------- */
+
+// send exactly n bytes (unless error)
+ssize_t send_all(int fd, const void *buf, size_t n) {
+  size_t off = 0;
+  const char *p = buf;
+
+  while (off < n) {
+    ssize_t r = send(fd, p + off, n - off, 0);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    off += (size_t)r;
+  }
+  return (ssize_t)off;
+}
+
+// recv exactly n bytes (or return 0 on EOF)
+ssize_t recv_all(int fd, void *buf, size_t n) {
+  size_t off = 0;
+  char *p = buf;
+
+  while (off < n) {
+    ssize_t r = recv(fd, p + off, n - off, 0);
+    if (r == 0)
+      return 0;
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    off += (size_t)r;
+  }
+  return (ssize_t)off;
+}
+
+// read one line (up to and including '\n')
+ssize_t recv_line(int fd, char *buf, size_t cap) {
+  size_t n = 0;
+
+  while (n < cap) {
+    char c;
+    ssize_t r = recv(fd, &c, 1, 0);
+    if (r == 0)
+      break;
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf[n++] = c;
+    if (c == '\n')
+      break;
+  }
+  return (ssize_t)n;
+}
+
+/* --------------- disk helpers --------------- */
+
+// open one connection to the disk server
+static int disk_dial(const struct sockaddr_in *sa) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("disk socket");
+    return -1;
+  }
+
+  if (connect(fd, (const struct sockaddr *)sa, sizeof(*sa)) < 0) {
+    perror("connect disk");
+    close(fd);
+    return -1;
+  }
+
+  // a request's last segment must not wait for an ACK of the one before
+  int yes = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  return fd;
+}
+
+// connect the pool to the disk server and read geometry
+int disk_connect(const char *ip, int port) {
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+
+  if (inet_pton(AF_INET, ip, &sa.sin_addr) != 1) {
+    fprintf(stderr, "bad disk ip\n");
+    return -1;
+  }
+
+  disk_conns = calloc((size_t)disk_nconns, sizeof(*disk_conns));
+  if (!disk_conns) {
+    fprintf(stderr, "out of memory\n");
+    return -1;
+  }
+
+  for (int i = 0; i < disk_nconns; i++) {
+    struct disk_conn *dc = &disk_conns[i];
+    dc->sock = disk_dial(&sa);
+    if (dc->sock < 0)
+      return -1;
+    pthread_mutex_init(&dc->send_lock, NULL);
+    pthread_mutex_init(&dc->lock, NULL);
+    pthread_cond_init(&dc->queued, NULL);
+    pthread_cond_init(&dc->room, NULL);
+  }
+
+  int sock = disk_conns[0].sock;
+  if (send_all(sock, "I\n", 2) < 0) {
+    perror("send I");
+    return -1;
+  }
+
+  char buf[64];
+  ssize_t n = recv(sock, buf, sizeof(buf) - 1, 0);
+  if (n <= 0) {
+    perror("recv I");
+    return -1;
+  }
+  buf[n] = '\0';
+
+  if (sscanf(buf, "%d %d", &cylinders, &sectors) != 2 || cylinders <= 0 ||
+      sectors <= 0) {
+    fprintf(stderr, "bad disk geometry: %s\n", buf);
+    return -1;
+  }
+
+  total_blocks = cylinders * sectors;
+  fprintf(stderr, "disk: C=%d S=%d blocks=%d, %d connections, window %d\n",
+          cylinders, sectors, total_blocks, disk_nconns, disk_window);
+
+  for (int i = 0; i < disk_nconns; i++) {
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, disk_reader, &disk_conns[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      return -1;
+    }
+    pthread_detach(tid);
+  }
+  return 0;
+}
+
+// send one WN: header, len bytes, zeros to the end of the last block
+static int disk_send_write(int sock, int blk, int n,
+                           const unsigned char *data, size_t len) {
+  static const unsigned char zeros[BLOCK_SIZE];
+  int c = blk / sectors;
+  int s = blk % sectors;
+
+  char cmd[64];
+  int m = snprintf(cmd, sizeof(cmd), "WN %d %d %d\n", c, s, n);
+  if (send_all(sock, cmd, (size_t)m) < 0)
+    return -1;
+
+  if (len > 0 && send_all(sock, data, len) < 0)
+    return -1;
+
+  // zero-fill the rest of the last block
+  size_t pad = (size_t)n * BLOCK_SIZE - len;
+  while (pad > 0) {
+    size_t k = pad < sizeof(zeros) ? pad : sizeof(zeros);
+    if (send_all(sock, zeros, k) < 0)
+      return -1;
+    pad -= k;
+  }
+
+  return send_all(sock, "\n", 1) < 0 ? -1 : 0;
+}
+
+// send one RN
+static int disk_send_read(int sock, int blk, int n) {
+  char cmd[64];
+  int m = snprintf(cmd, sizeof(cmd), "RN %d %d %d\n", blk / sectors,
+                   blk % sectors, n);
+  return send_all(sock, cmd, (size_t)m) < 0 ? -1 : 0;
+}
+
+// take the reply to r off the socket; -1 = rejected, -2 = connection lost
+static int disk_recv_reply(int sock, struct disk_req *r) {
+  char tag;
+  if (recv_all(sock, &tag, 1) <= 0)
+    return -2;
+  if (r->write || tag != '1') {
+    char nl; // "1\n" / "0\n"
+    if (recv_all(sock, &nl, 1) <= 0)
+      return -2;
+    return tag == '1' ? 0 : -1;
+  }
+
+  if (r->len > 0 && recv_all(sock, r->data, r->len) <= 0)
+    return -2;
+
+  // drop the tail of the last block beyond len
+  size_t rest = (size_t)r->n * BLOCK_SIZE - r->len;
+  while (rest > 0) {
+    unsigned char skip[BLOCK_SIZE];
+    size_t k = rest < sizeof(skip) ? rest : sizeof(skip);
+    if (recv_all(sock, skip, k) <= 0)
+      return -2;
+    rest -= k;
+  }
+  return 0;
+}
+
+/*
+ * Drop one pending request of b. A waited-for batch may be gone as soon
+ * as disk_lock is released; one with a done callback belongs to its
+ * last reply, which runs the callback.
+ */
+void disk_put(struct disk_batch *b, int failed) {
+  pthread_mutex_lock(&disk_lock);
+  if (failed)
+    b->failed = 1;
+  int last = --b->pending == 0 && b->done;
+  pthread_cond_broadcast(&disk_done);
+  pthread_mutex_unlock(&disk_lock);
+  if (last)
+    b->done(b);
+}
+
+static void disk_complete(struct disk_req *r, int failed) {
+  struct disk_batch *b = r->batch;
+  free(r);
+  disk_put(b, failed);
+}
+
+// the connection is unusable: fail its queue and all that follows
+static void disk_kill_locked(struct disk_conn *dc) {
+  if (!dc->dead) {
+    dc->dead = 1;
+    shutdown(dc->sock, SHUT_RDWR); // wakes the reader
+    pthread_cond_signal(&dc->queued);
+  }
+}
+
+/*
+ * Reply reader, one per connection. disk_server answers in order, so
+ * the reply on the wire always belongs to the oldest queued request;
+ * reads land straight in the submitter's buffer.
+ */
+static void *disk_reader(void *arg) {
+  struct disk_conn *dc = arg;
+  pthread_mutex_lock(&dc->lock);
+  while (!dc->dead) {
+    if (!dc->head) {
+      pthread_cond_wait(&dc->queued, &dc->lock);
+      continue;
+    }
+    struct disk_req *r = dc->head;
+    pthread_mutex_unlock(&dc->lock);
+
+    int rc = disk_recv_reply(dc->sock, r);
+
+    pthread_mutex_lock(&dc->lock);
+    if (rc == -2) {
+      disk_kill_locked(dc);
+      break;
+    }
+    dc->head = r->next;
+    if (!dc->head)
+      dc->tail = NULL;
+    dc->inflight--;
+    pthread_cond_signal(&dc->room);
+    pthread_mutex_unlock(&dc->lock);
+    disk_complete(r, rc < 0);
+    pthread_mutex_lock(&dc->lock);
+  }
+
+  // fail whatever is still queued; later submits go elsewhere
+  struct disk_req *r = dc->head;
+  dc->head = NULL;
+  dc->tail = NULL;
+  dc->inflight = 0;
+  pthread_cond_broadcast(&dc->room);
+  pthread_mutex_unlock(&dc->lock);
+  while (r) {
+    struct disk_req *next = r->next;
+    disk_complete(r, 1);
+    r = next;
+  }
+  fprintf(stderr, "disk connection %d lost\n", (int)(dc - disk_conns));
+  return NULL;
+}
+
+// the live connection with the fewest requests in flight, or NULL
+static struct disk_conn *disk_pick(void) {
+  struct disk_conn *best = NULL;
+  int best_load = INT_MAX;
+  unsigned int start = atomic_fetch_add(&disk_next, 1);
+  for (int k = 0; k < disk_nconns; k++) {
+    struct disk_conn *dc = &disk_conns[(start + (unsigned int)k) %
+                                       (unsigned int)disk_nconns];
+    int load = atomic_load(&dc->inflight);
+    if (load < best_load && !dc->dead) {
+      best = dc;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+/*
+ * Queue one RN / WN of n blocks at blk on batch b and put it on the
+ * wire of the least busy connection, waiting while it already has
+ * disk_window requests out. disk_wait() waits for the batch.
+ */
+static void disk_submit(struct disk_batch *b, int write, int blk, int n,
+                        unsigned char *data, size_t len) {
+  struct disk_req *r = malloc(sizeof(*r));
+  if (!r) {
+    pthread_mutex_lock(&disk_lock);
+    b->failed = 1;
+    pthread_mutex_unlock(&disk_lock);
+    return;
+  }
+  r->next = NULL;
+  r->batch = b;
+  r->data = data;
+  r->len = len;
+  r->n = n;
+  r->write = write;
+
+  pthread_mutex_lock(&disk_lock);
+  b->pending++;
+  pthread_mutex_unlock(&disk_lock);
+
+  struct disk_conn *dc = disk_pick();
+  if (!dc) {
+    disk_complete(r, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&dc->send_lock);
+  pthread_mutex_lock(&dc->lock);
+  while (dc->inflight >= disk_window && !dc->dead)
+    pthread_cond_wait(&dc->room, &dc->lock);
+  if (dc->dead) {
+    pthread_mutex_unlock(&dc->lock);
+    pthread_mutex_unlock(&dc->send_lock);
+    disk_complete(r, 1);
+    return;
+  }
+  if (dc->tail)
+    dc->tail->next = r;
+  else
+    dc->head = r;
+  dc->tail = r;
+  dc->inflight++;
+  pthread_cond_signal(&dc->queued);
+  pthread_mutex_unlock(&dc->lock);
+
+  // requests go on the wire in queue order, so replies match up
+  int rc = write ? disk_send_write(dc->sock, blk, n, data, len)
+                 : disk_send_read(dc->sock, blk, n);
+  if (rc < 0) {
+    pthread_mutex_lock(&dc->lock);
+    disk_kill_locked(dc);
+    pthread_mutex_unlock(&dc->lock);
+  }
+  pthread_mutex_unlock(&dc->send_lock);
+}
+
+/*
+ * Queue [blk, blk + n) on batch b in pieces of at most DISK_PIECE
+ * blocks. A large read is cut into one piece per connection (none
+ * under DISK_PIECE_MIN) so it keeps the whole pool busy; writes are
+ * not cut further, since disk_server pays an fsync per WN.
+ */
+void disk_submit_run(struct disk_batch *b, int write, int blk, int n,
+                     unsigned char *data, size_t len) {
+  int piece = DISK_PIECE;
+  if (!write) {
+    piece = (n + disk_nconns - 1) / disk_nconns;
+    if (piece < DISK_PIECE_MIN)
+      piece = DISK_PIECE_MIN;
+    if (piece > DISK_PIECE)
+      piece = DISK_PIECE;
+  }
+
+  while (n > 0) {
+    int k = n < piece ? n : piece;
+    size_t bytes = (size_t)k * BLOCK_SIZE;
+    if (bytes > len)
+      bytes = len;
+    disk_submit(b, write, blk, k, data, bytes);
+    blk += k;
+    n -= k;
+    data += bytes;
+    len -= bytes;
+  }
+}
+
+// wait for every request of b; -1 if any failed
+int disk_wait(struct disk_batch *b) {
+  pthread_mutex_lock(&disk_lock);
+  while (b->pending > 0)
+    pthread_cond_wait(&disk_done, &disk_lock);
+  int failed = b->failed;
+  pthread_mutex_unlock(&disk_lock);
+  return failed ? -1 : 0;
+}
+
+int disk_run_ok(int blk, int n, size_t len) {
+  return blk >= 0 && n > 0 && blk + n <= total_blocks &&
+         len <= (size_t)n * BLOCK_SIZE;
+}
+
+/*
+ * Write len bytes to the n consecutive blocks starting at blk, zero
+ * padding the last block. The pieces are all in flight at once.
+ */
+int disk_write_run(int blk, int n, const unsigned char *data,
+                   size_t len) {
+  if (!disk_run_ok(blk, n, len))
+    return -1;
+  struct disk_batch b = {0, 0, NULL};
+  disk_submit_run(&b, 1, blk, n, (unsigned char *)data, len);
+  return disk_wait(&b);
+}
+
+// read the first len bytes of the n consecutive blocks starting at blk
+int disk_read_run(int blk, int n, unsigned char *data, size_t len) {
+  if (!disk_run_ok(blk, n, len))
+    return -1;
+  struct disk_batch b = {0, 0, NULL};
+  disk_submit_run(&b, 0, blk, n, data, len);
+  return disk_wait(&b);
+}
@@ -0,0 +1,63 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include "fs.h"
+
+#define DISK_PIECE 2048 // blocks per RN / WN; disk_server takes up to 8192
+#define DISK_PIECE_MIN 512 // smallest piece a read is split into
+#define DISK_WINDOW_DEFAULT 16 // requests in flight per disk connection
+#define DISK_CONNS_DEFAULT 4   // disk connections, --disk-conns
+
+/*
+ * Disk I/O goes over disk_nconns connections, each with a queue of up
+ * to disk_window RN / WN requests in flight and a disk_reader thread
+ * matching replies in order. A request goes to the least busy one. A
+ * disk_batch groups requests for one wait or a done callback.
+ * send_lock keeps a request together on the wire, lock guards the
+ * queue, disk_lock the batches.
+ */
+struct disk_batch {
+  int pending; // requests without a reply yet
+  int failed;  // some request failed
+  void (*done)(struct disk_batch *b); // NULL: someone disk_wait()s
+};
+
+struct disk_req {
+  struct disk_req *next; // queue, oldest first
+  struct disk_batch *batch;
+  unsigned char *data; // WN payload, or where RN data goes
+  size_t len;          // bytes of data, the rest of n blocks is zero
+  int n;               // blocks
+  int write;           // WN, else RN
+};
+
+struct disk_conn {
+  int sock;
+  pthread_mutex_t send_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t queued; // for the reader
+  pthread_cond_t room;   // window
+  struct disk_req *head;
+  struct disk_req *tail;
+  atomic_int inflight; // read unlocked to pick a connection
+  atomic_int dead;     // connection lost, its requests fail
+};
+
+extern int disk_nconns;
+extern int disk_window;
+extern int sectors;
+extern int total_blocks;
+
+ssize_t send_all(int fd, const void *buf, size_t n);
+ssize_t recv_all(int fd, void *buf, size_t n);
+ssize_t recv_line(int fd, char *buf, size_t cap);
+int disk_connect(const char *ip, int port);
+void disk_put(struct disk_batch *b, int failed);
+void disk_submit_run(struct disk_batch *b, int write, int blk, int n,
+                     unsigned char *data, size_t len);
+int disk_wait(struct disk_batch *b);
+int disk_run_ok(int blk, int n, size_t len);
+int disk_write_run(int blk, int n, const unsigned char *data, size_t len);
+int disk_read_run(int blk, int n, unsigned char *data, size_t len);
+
+#endif
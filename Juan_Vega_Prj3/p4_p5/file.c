@@ -0,0 +1,446 @@
+#include "alloc.h"
+#include "cache.h"
+#include "file.h"
+#include "flusher.h"
+#include "itab.h"
+#include "journal.h"
+
+pthread_rwlock_t file_lock[FILE_LOCK_STRIPES];
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t fs_gate = PTHREAD_MUTEX_INITIALIZER; // F waits here
+
+atomic_uint fs_epoch; // bumped by every format
+
+int ra_max = RA_KB_DEFAULT * 1024 / BLOCK_SIZE; // blocks, 0 = off
+
+/*
+ * fs_lock shared, for a command or a background pass. New holders wait
+ * behind an F that is waiting, so F is not starved by a steady stream.
+ * Never taken again by a thread that already holds it.
+ */
+void fs_lock_shared(void) {
+  pthread_mutex_lock(&fs_gate);
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_mutex_unlock(&fs_gate);
+}
+
+// fs_lock back after dropping it for network I/O; -1 if F ran meanwhile
+int fs_lock_retake(const struct session *ss) {
+  fs_lock_shared();
+  return atomic_load(&fs_epoch) == ss->epoch ? 0 : -1;
+}
+
+pthread_rwlock_t *dir_lock(int idx) {
+  return &fs_ent(idx)->dir->lock;
+}
+
+// create an empty file in cwd
+int fs_create_file(struct session *ss, const char *name) {
+  int dir = ss->cwd;
+  pthread_rwlock_wrlock(dir_lock(dir));
+
+  if (fs_find(name, 0, dir) >= 0) {
+    pthread_rwlock_unlock(dir_lock(dir));
+    return 1;
+  }
+
+  fs_jnl_begin();
+  int idx = fs_alloc_entry(name);
+  int rc = idx < 0 ? -1 : fs_publish_entry(idx, 0, dir);
+  fs_jnl_end();
+  pthread_rwlock_unlock(dir_lock(dir));
+  return rc == 0 ? 0 : 2;
+}
+
+// delete file and free its blocks
+int fs_delete_file(struct session *ss, const char *name) {
+  int dir = ss->cwd;
+  pthread_rwlock_wrlock(dir_lock(dir));
+
+  int idx = fs_find(name, 0, dir);
+  if (idx < 0) {
+    pthread_rwlock_unlock(dir_lock(dir));
+    return 1;
+  }
+
+  // wait out readers and writers of this file
+  pthread_rwlock_t *fl = &file_lock[idx % FILE_LOCK_STRIPES];
+  pthread_rwlock_wrlock(fl);
+  fs_jnl_begin();
+  fs_release_runs(fs_ent(idx), 1);
+  fs_dir_unlink(dir, idx);
+  fs_free_entry(idx);
+  fs_jnl_end();
+  pthread_rwlock_unlock(fl);
+
+  pthread_rwlock_unlock(dir_lock(dir));
+  return 0;
+}
+
+/*
+ * Look up a file in directory dir and return it locked (exclusive if
+ * excl). The directory lock is dropped once the file lock is held: a
+ * delete needs the file lock too, so the entry stays valid until
+ * fs_file_unlock(). The caller keeps dir alive, as a cwd reference does.
+ */
+int fs_file_lock_in(int dir, const char *name, int excl) {
+  pthread_rwlock_rdlock(dir_lock(dir));
+
+  int idx = fs_find(name, 0, dir);
+  if (idx >= 0) {
+    if (excl)
+      pthread_rwlock_wrlock(&file_lock[idx % FILE_LOCK_STRIPES]);
+    else
+      pthread_rwlock_rdlock(&file_lock[idx % FILE_LOCK_STRIPES]);
+  }
+
+  pthread_rwlock_unlock(dir_lock(dir));
+  return idx;
+}
+
+// fs_file_lock_in the session's cwd
+int fs_file_lock(struct session *ss, const char *name, int excl) {
+  return fs_file_lock_in(ss->cwd, name, excl);
+}
+
+void fs_file_unlock(int idx) {
+  pthread_rwlock_unlock(&file_lock[idx % FILE_LOCK_STRIPES]);
+}
+
+/*
+ * Free a file's blocks and its run list, or its in-memory bytes. held
+ * says an inode on disk may point at the blocks: they wait for the
+ * checkpoint then (fs_free_ext), or a write after a crash could land in
+ * a file the replay brings back. Runs no commit has seen go at once.
+ */
+void fs_release_runs(struct fs_entry *e, int held) {
+  if (e->store == STORE_DELAYED) {
+    fs_delay_drop(e); // no blocks yet
+    return;
+  }
+  if (e->store == STORE_INLINE) {
+    if (e->inl.ref != NAME_NONE) {
+      pthread_mutex_lock(&table_lock);
+      fs_arena_release(e->inl.ref, (size_t)e->inl.cap);
+      pthread_mutex_unlock(&table_lock);
+    }
+    e->store = STORE_BLOCKS;
+    return;
+  }
+  struct fs_run *r = fs_runs(e);
+  for (int i = 0; i < e->nruns; i++) {
+    if (!held) {
+      fs_free_blocks(r[i].first, r[i].len);
+      continue;
+    }
+    cache_forget(r[i].first, r[i].len); // dead data, never written back
+    fs_free_ext(r[i]);
+  }
+  if (e->nruns > 1 && r[e->nruns].len > 0)
+    fs_free_ext(r[e->nruns]);
+  if (e->nruns > 1)
+    free(e->runs);
+  e->nruns = 0;
+  e->nblocks = 0;
+}
+
+/*
+ * Add blocks to the end of a file, all or nothing: the last run grows
+ * in place if it can, the rest comes from fs_alloc_run. The caller's
+ * resv reserved blocks are used up on success. A heap run list has one
+ * extra entry past its end: where it is stored once longer than
+ * INODE_RUNS, else {-1, 0}.
+ */
+int fs_grow_file(struct fs_entry *e, int add, int resv) {
+  int nold = e->nruns;
+  int cap = nold + 4;
+  struct fs_run *list = malloc((size_t)cap * sizeof(*list));
+  if (!list)
+    return -1;
+
+  // hold all add blocks as reserved while they are taken, so a
+  // concurrent grow cannot eat into the caller's share
+  pthread_mutex_lock(&alloc_lock);
+  int room = free_count - (resv_count - resv) >= add;
+  if (room)
+    resv_count += add - resv;
+  pthread_mutex_unlock(&alloc_lock);
+  if (!room) {
+    free(list);
+    return -1;
+  }
+  memcpy(list, fs_runs(e), (size_t)nold * sizeof(*list));
+  int old_tail = nold > 0 ? list[nold - 1].len : 0;
+  struct fs_run ext = nold > 1 ? fs_runs(e)[nold] : (struct fs_run){-1, 0};
+  struct fs_run old_ext = {-1, 0};
+
+  int n = nold;
+  int left = add;
+  if (n > 0) {
+    int got = fs_alloc_at(list[n - 1].first + list[n - 1].len, left);
+    list[n - 1].len += got;
+    left -= got;
+  }
+
+  while (left > 0) {
+    // a new file starts in its directory's group, the rest follows on
+    int goal = n > 0 ? list[n - 1].first + list[n - 1].len
+                     : fs_ent(e->parent)->dir->group * cg_blocks;
+    int got = 0;
+    int first = fs_alloc_run(goal, left, &got);
+    if (first < 0)
+      break;
+
+    if (n > 0 && list[n - 1].first + list[n - 1].len == first) {
+      list[n - 1].len += got; // continues the previous run
+    } else {
+      if (n == cap) {
+        struct fs_run *bigger = realloc(list, (size_t)cap * 2 * sizeof(*list));
+        if (!bigger) {
+          fs_free_blocks(first, got);
+          break;
+        }
+        list = bigger;
+        cap *= 2;
+      }
+      list[n].first = first;
+      list[n].len = got;
+      n++;
+    }
+    left -= got;
+  }
+
+  int ok = left == 0;
+  if (ok && n == cap) {
+    struct fs_run *bigger = realloc(list, (size_t)(cap + 1) * sizeof(*list));
+    ok = bigger != NULL;
+    if (bigger)
+      list = bigger;
+  }
+  int ext_need = (n * (int)sizeof(*list) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (ok && n > INODE_RUNS && ext.len < ext_need) {
+    // the list outgrew its blocks on disk: take twice what it needs,
+    // out of what nobody else has reserved
+    pthread_mutex_lock(&alloc_lock);
+    int spare = free_count - (resv_count - add);
+    int want = ext_need * 2;
+    int near = list[n - 1].first + list[n - 1].len;
+    int first = spare >= want ? alloc_exact_locked(near, want) : -1;
+    if (first < 0 && spare >= ext_need)
+      first = alloc_exact_locked(near, want = ext_need);
+    if (first >= 0)
+      bm_mark(first, want, 1);
+    pthread_mutex_unlock(&alloc_lock);
+    ok = first >= 0;
+    if (ok) {
+      old_ext = ext;
+      ext = (struct fs_run){first, want};
+    }
+  }
+
+  if (!ok) {
+    // out of space (or memory): hand back everything we took
+    for (int i = nold; i < n; i++)
+      fs_free_blocks(list[i].first, list[i].len);
+    if (nold > 0)
+      fs_free_blocks(list[nold - 1].first + old_tail,
+                     list[nold - 1].len - old_tail);
+    free(list);
+    fs_reserve_blocks(resv - add);
+    return -1;
+  }
+  fs_reserve_blocks(-add);
+  if (old_ext.len > 0)
+    fs_free_ext(old_ext);
+
+  if (e->nruns > 1)
+    free(e->runs);
+  if (n == 1) {
+    e->run = list[0];
+    free(list);
+  } else {
+    list[n] = ext;
+    e->runs = list;
+  }
+  e->nruns = n;
+  e->nblocks += add;
+  return 0;
+}
+
+// move fresh's run list into e, which has none
+void fs_take_runs(struct fs_entry *e, struct fs_entry *fresh) {
+  e->nruns = fresh->nruns;
+  e->nblocks = fresh->nblocks;
+  if (fresh->nruns > 1)
+    e->runs = fresh->runs;
+  else
+    e->run = fresh->run;
+}
+
+/*
+ * Start reading file blocks [blk, blk + n) into buf, stopping after len
+ * bytes, with one cache read per run touched; they are all in flight
+ * until fs_read_end().
+ */
+int fs_read_begin(struct fs_read *fr, struct fs_entry *e, int blk,
+                  int n, unsigned char *buf, size_t len) {
+  struct fs_run *r = fs_runs(e);
+  int base = 0; // file block where run i starts
+
+  fr->cnt = 0;
+  fr->missed = 0;
+  fr->rd = malloc((size_t)(e->nruns < n ? e->nruns : n) * sizeof(*fr->rd));
+  if (!fr->rd)
+    return -1;
+
+  for (int i = 0; i < e->nruns && n > 0 && len > 0; base += r[i].len, i++) {
+    if (blk >= base + r[i].len)
+      continue;
+
+    int skip = blk - base;
+    int k = r[i].len - skip;
+    if (k > n)
+      k = n;
+    size_t bytes = (size_t)k * BLOCK_SIZE;
+    if (bytes > len)
+      bytes = len;
+
+    struct cache_read *cr = &fr->rd[fr->cnt++];
+    cache_read_begin(cr, r[i].first + skip, k, buf, bytes);
+    fr->missed += cr->mode != CR_CACHE ? k : cr->nb < k ? cr->nb : k;
+    buf += bytes;
+    len -= bytes;
+    blk += k;
+    n -= k;
+  }
+  return 0;
+}
+
+int fs_read_end(struct fs_read *fr) {
+  int rc = 0;
+  for (int i = 0; i < fr->cnt; i++)
+    if (cache_read_end(&fr->rd[i]) < 0)
+      rc = -1;
+  free(fr->rd);
+  return rc;
+}
+
+// readahead of file blocks [blk, blk + n), one cache_prefetch per run
+static void fs_prefetch(struct fs_entry *e, int blk, int n) {
+  struct fs_run *r = fs_runs(e);
+  int base = 0; // file block where run i starts
+
+  for (int i = 0; i < e->nruns && n > 0; base += r[i].len, i++) {
+    if (blk >= base + r[i].len)
+      continue;
+
+    int skip = blk - base;
+    int k = r[i].len - skip;
+    if (k > n)
+      k = n;
+    cache_prefetch(r[i].first + skip, k);
+    blk += k;
+    n -= k;
+  }
+}
+
+/*
+ * Account a read of [offset, offset + len) of file idx to the session's
+ * stream on that file, missed of its blocks having come from the disk,
+ * and send the next window once the reader has reached the last one.
+ * Caller holds the file lock.
+ */
+void fs_readahead(struct session *ss, int idx, long long offset,
+                  long long len, int missed) {
+  struct fs_entry *e = fs_ent(idx);
+  int b0 = (int)(offset / BLOCK_SIZE);
+  int b1 = (int)((offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+  if (ra_max == 0 || len <= 0)
+    return;
+  struct readahead *ra = &ss->ra[0];
+  for (int i = 0; i < RA_STREAMS && ra->file != idx; i++)
+    if (ss->ra[i].file == idx || ss->ra[i].used < ra->used)
+      ra = &ss->ra[i];
+  ra->used = ++ss->reads;
+
+  if (ra->file != idx) {
+    ra->win = 4 * RA_MIN;
+  } else if (ra->next != offset) {
+    // the reader jumped, short of what was fetched for it
+    if (ra->end > (int)((ra->next + BLOCK_SIZE - 1) / BLOCK_SIZE) &&
+        ra->win > RA_MIN)
+      ra->win /= 2;
+  }
+  if (ra->file != idx || ra->next != offset) {
+    ra->file = idx;
+    ra->next = offset + len;
+    ra->mark = 0;
+    ra->end = 0;
+    return;
+  }
+
+  ra->next = offset + len;
+  if (missed > 0 && b0 < ra->end && ra->win > RA_MIN)
+    ra->win /= 2; // fetched blocks were evicted before the reader came
+  if (ra->end > 0 && b1 <= ra->mark)
+    return; // still reading what came ahead of the last window
+  if (ra->end > 0 && missed == 0 && ra->win < ra_max)
+    ra->win *= 2; // the previous window was all used
+
+  int start = b1 > ra->end ? b1 : ra->end;
+  int n = ra->win > b1 - b0 ? ra->win : b1 - b0;
+  if (n > ra_max)
+    n = ra_max;
+  if (n > e->nblocks - start)
+    n = e->nblocks - start;
+  if (n <= 0)
+    return;
+  fs_prefetch(e, start, n);
+  ra->mark = start;
+  ra->end = start + n;
+}
+
+/*
+ * Move file blocks [blk, blk + n) to or from buf, one disk request per
+ * run touched. Reads stop after len bytes; writes zero-pad past len.
+ */
+int fs_io_blocks(struct fs_entry *e, int blk, int n, unsigned char *buf,
+                 size_t len, int write) {
+  if (!write) {
+    struct fs_read fr;
+    if (fs_read_begin(&fr, e, blk, n, buf, len) < 0)
+      return -1;
+    return fs_read_end(&fr);
+  }
+
+  struct fs_run *r = fs_runs(e);
+  int base = 0; // file block where run i starts
+
+  for (int i = 0; i < e->nruns && n > 0; base += r[i].len, i++) {
+    if (blk >= base + r[i].len)
+      continue;
+
+    int skip = blk - base;
+    int k = r[i].len - skip;
+    if (k > n)
+      k = n;
+    size_t bytes = (size_t)k * BLOCK_SIZE;
+    if (bytes > len)
+      bytes = len;
+
+    if (cache_write_run(r[i].first + skip, k, buf, bytes) < 0)
+      return -1;
+
+    buf += bytes;
+    len -= bytes;
+    blk += k;
+    n -= k;
+  }
+  return 0;
+}
+
+// pin a directory as some session's cwd
+void fs_ref_dir(int idx) {
+  atomic_fetch_add(&fs_ent(idx)->dir->refs, 1);
+}
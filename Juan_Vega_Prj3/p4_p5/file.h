@@ -0,0 +1,55 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "fs.h"
+
+// a file read in flight: one cache read per run it touches
+struct fs_read {
+  struct cache_read *rd;
+  int cnt;
+  int missed; // blocks not found in the cache
+};
+
+/*
+ * Lock order, outermost first:
+ *   fs_lock (shared per command, exclusive for F; dropped while bytes
+ *     cross the network)
+ *   parent dir lock, then the child's dir lock or file_lock stripe
+ *   meta_flush_lock, itab_lock
+ *   table_lock, alloc_lock, then meta_lock
+ *   cache_lock, disk_lock, delay_lock, compact_lock (leaves)
+ * An operation joins the transaction (jnl_lock) holding its dir and
+ * file locks and no leaf lock. The flusher locks files by index without
+ * their directory.
+ */
+extern pthread_rwlock_t file_lock[FILE_LOCK_STRIPES];
+extern pthread_rwlock_t fs_lock;
+extern pthread_mutex_t fs_gate;
+extern atomic_uint fs_epoch;
+extern int ra_max;
+
+void fs_lock_shared(void);
+int fs_lock_retake(const struct session *ss);
+pthread_rwlock_t *dir_lock(int idx);
+int fs_create_file(struct session *ss, const char *name);
+int fs_delete_file(struct session *ss, const char *name);
+int fs_file_lock_in(int dir, const char *name, int excl);
+int fs_file_lock(struct session *ss, const char *name, int excl);
+void fs_file_unlock(int idx);
+void fs_release_runs(struct fs_entry *e, int held);
+int fs_grow_file(struct fs_entry *e, int add, int resv);
+void fs_take_runs(struct fs_entry *e, struct fs_entry *fresh);
+int fs_read_begin(struct fs_read *fr, struct fs_entry *e, int blk, int n,
+                  unsigned char *buf, size_t len);
+int fs_read_end(struct fs_read *fr);
+void fs_readahead(struct session *ss, int idx, long long offset, long long len,
+                  int missed);
+int fs_io_blocks(struct fs_entry *e, int blk, int n, unsigned char *buf,
+                 size_t len, int write);
+void fs_ref_dir(int idx);
+
+static inline struct fs_run *fs_runs(struct fs_entry *e) {
+  return (e->nruns > 1) ? e->runs : &e->run;
+}
+
+#endif
@@ -56,11 +56,16 @@ int main(int argc, char *argv[]) {
                   "  D name\n"
                   "  L 0|1\n"
                   "  R name\n"
+                  "  RR name offset len\n"
                   "  W name len\n"
+                  "  WA name offset len\n"
+                  "  APPEND name len\n"
                   "  mkdir name\n"
                   "  cd name|..|/\n"
                   "  pwd\n"
-                  "  rmdir name\n");
+                  "  rmdir name\n"
+                  "  SYNC\n"
+                  "  COMPACT [STAT]\n");
 
   char line[MAX_LINE];
 
@@ -79,13 +84,22 @@ int main(int argc, char *argv[]) {
     if (sscanf(line, " %15s", cmd) != 1)
       continue;
 
-    // W name len: send header, then raw bytes, then newline
-    if (strcmp(cmd, "W") == 0) {
+    // W name len / WA name offset len / APPEND name len: send header,
+    // then raw bytes, then newline
+    if (strcmp(cmd, "W") == 0 || strcmp(cmd, "WA") == 0 ||
+        strcmp(cmd, "APPEND") == 0) {
       char name[128];
+      long long offset = 0;
       int len;
 
-      if (sscanf(line, " W %127s %d", name, &len) != 2 || len < 0) {
-        fprintf(stderr, "usage: W <name> <len>\n");
+      int ok;
+      if (strcmp(cmd, "WA") == 0)
+        ok = sscanf(line, " WA %127s %lld %d", name, &offset, &len) == 3;
+      else
+        ok = sscanf(line, " %*s %127s %d", name, &len) == 2;
+      if (!ok || len < 0 || offset < 0) {
+        fprintf(stderr, "usage: W <name> <len> | WA <name> <offset> <len> | "
+                        "APPEND <name> <len>\n");
         continue;
       }
 
@@ -135,8 +149,9 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    // R name: header "rc len" then optional len bytes + '\n'
-    if (strcmp(cmd, "R") == 0) {
+    // R name / RR name offset len: header "rc len" then optional len
+    // bytes + '\n'
+    if (strcmp(cmd, "R") == 0 || strcmp(cmd, "RR") == 0) {
       if (send_all(sock, line, strlen(line)) < 0) {
         perror("send R");
         break;
@@ -158,9 +173,18 @@ int main(int argc, char *argv[]) {
 
       fputs(hdr, stdout);
 
-      if (rc != 0 || len <= 0)
+      if (rc != 0)
         continue;
 
+      if (len <= 0) {
+        char nl; // an empty body still ends in '\n'
+        if (recv_all(sock, &nl, 1) <= 0) {
+          perror("recv R nl");
+          break;
+        }
+        continue;
+      }
+
       unsigned char *buf = malloc((size_t)len);
       if (!buf) {
         fprintf(stderr, "oom\n");
@@ -231,7 +255,8 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    // other commands (F, C, D, mkdir, cd, pwd, rmdir) -> one-line reply
+    // other commands (F, C, D, mkdir, cd, pwd, rmdir, SYNC, COMPACT) ->
+    // one-line reply
     if (send_all(sock, line, strlen(line)) < 0) {
       perror("send cmd");
       break;
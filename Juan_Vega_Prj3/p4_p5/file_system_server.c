@@ -1,78 +1,295 @@
-
-#include <arpa/inet.h>
-#include <errno.h>
-#include <netinet/in.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-#define BLOCK_SIZE 128
-#define MAX_LINE 4096
-#define MAX_FILES 256
-#define MAX_NAME 64
-
+#include "alloc.h"
+#include "cache.h"
+#include "compact.h"
+#include "disk.h"
+#include "file.h"
+#include "flusher.h"
+#include "itab.h"
+#include "journal.h"
+
+#define STREAM_FIRST 4096  // first streamed chunk, small for a quick start
+#define RING_SLOTS 4       // buffers per streamed upload
+#define RING_BUF 262144    // bytes per upload buffer, whole blocks
+#define STREAM_CHUNK 65536 // largest chunk read per disk pass when streaming
+#define STREAM_DEPTH 4     // chunks in flight per streamed read
 #define FS_PORT_DEFAULT 7790
 #define DISK_PORT_DEFAULT 7780
-
-// one in-memory directory entry
-struct fs_entry {
-  int used;        // 0 = free, 1 = in use
-  int is_dir;      // 0 = file, 1 = directory
-  int parent;      // index of parent directory
-  int first_block; // first disk block for file
-  int nblocks;     // number of blocks
-  int size;        // file size in bytes
-  char name[MAX_NAME];
+#define WORKERS_DEFAULT 16 // worker threads started up front
+#define WORKERS_MAX_DEFAULT 256 // most worker threads, --max-workers
+#define ACCEPT_QUEUE 64    // accepted clients waiting for a worker
+
+/*
+ * A W payload in flight. The session thread receives into free slots
+ * of the ring while a writer thread moves filled slots to disk, so the
+ * network and the disk work at the same time in RING_SLOTS * RING_BUF
+ * bytes of memory.
+ */
+struct upload {
+  struct fs_entry *e; // holds the runs being written
+  unsigned int epoch; // fs_epoch they were allocated in
+  unsigned char *buf[RING_SLOTS];
+  size_t fill[RING_SLOTS]; // bytes in each filled slot
+  int head;                // oldest filled slot
+  int count;               // filled slots
+  int done;                // no more slots will be filled
+  int failed;              // a disk write failed; drain without writing
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t drained;
 };
 
-static struct fs_entry fs_table[MAX_FILES];
-static int fs_initialized = 0;
-static int cwd_index = 0;
-
-static int disk_sock = -1;
-static int cylinders = 0;
-static int sectors = 0;
-static int total_blocks = 0;
-static char *block_used = NULL; // bitmap for allocated blocks
-
-// generic I/O helpers
-static ssize_t send_all(int fd, const void *buf, size_t n);
-static ssize_t recv_all(int fd, void *buf, size_t n);
-static ssize_t recv_line(int fd, char *buf, size_t cap);
-
-// disk helpers
-static int disk_connect(const char *ip, int port);
-static int disk_write_block(int blk, const unsigned char *data, int len);
-static int disk_read_block(int blk, unsigned char *data);
-
-// filesystem helpers
-static int fs_alloc_entry(void);
-static int fs_find(const char *name, int is_dir, int parent);
-static int fs_alloc_contiguous(int blocks);
-static void fs_free_blocks(int first, int blocks);
-static int fs_format(void);
-static int fs_create_file(const char *name);
-static int fs_delete_file(const char *name);
-static int fs_write_file(const char *name, const unsigned char *data, int len);
-static int fs_read_file(const char *name, unsigned char **out_data,
-                        int *out_len);
-static int fs_list(int verbose, int client_fd);
-static int fs_mkdir(const char *name);
-static int fs_cd(const char *name);
-static int fs_pwd(char *buf, size_t cap);
-static int fs_rmdir(const char *name);
+/*
+ * Accepted connections waiting for a worker thread. A worker serves one
+ * connection until it closes, so when every idle worker is spoken for
+ * the accept loop starts another; the pool grows to the most sessions
+ * open at once and stays there. Past max_workers a connection is
+ * answered 2 and closed.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  int fds[ACCEPT_QUEUE];
+  int head;
+  int count;
+  int idle; // workers waiting for a connection
+} accept_q = {.lock = PTHREAD_MUTEX_INITIALIZER,
+              .not_empty = PTHREAD_COND_INITIALIZER,
+              .not_full = PTHREAD_COND_INITIALIZER};
+
+static int fs_write_at(struct session *ss, const char *name, long long offset,
+                       const unsigned char *data, int len, int append);
+static int fs_read_range(struct session *ss, const char *name, long long offset,
+                         long long len, int client_fd);
+static int start_worker(void);
+static void *worker_main(void *arg);
 static void serve_client(int client_fd);
+static int recv_payload(struct session *ss, int len, unsigned char **out);
+static int serve_command(struct session *ss, const char *line, const char *cmd);
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s <disk_server_ip> [workers] [options]\n"
+          "  --alloc POLICY            free-space policy: group (first\n"
+          "                          fit from the directory's cylinder\n"
+          "                          group), best (smallest extent that\n"
+          "                          fits), next (first fit after the\n"
+          "                          previous allocation) or bitmap (the\n"
+          "                          same by scanning the bitmap only)\n"
+          "                          (group)\n"
+          "  --cache MB                block cache budget, 0 = off (%d)\n"
+          "  --cg-cyls N               cylinders per cylinder group (%d)\n"
+          "  --compact-rate KB         compactor copy budget per second,\n"
+          "                          0 = no limit (%d)\n"
+          "  --delay MB                memory for small files not yet\n"
+          "                          given blocks, 0 = off (%d)\n"
+          "  --disk-conns N            connections to the disk server (%d)\n"
+          "  --disk-window N           requests in flight per connection "
+          "(%d)\n"
+          "  --readahead KB            largest sequential readahead window,\n"
+          "                          %d .. %d, 0 = off (%d)\n"
+          "  --flush-ms N              age at which delayed and dirty data\n"
+          "                          is written back (%d)\n"
+          "  --inline BYTES            files up to this size are kept in\n"
+          "                          memory, never on disk blocks,\n"
+          "                          0 .. %d (%d)\n"
+          "  --inodes N                inodes a format makes room for\n"
+          "                          (one per %d blocks)\n"
+          "  --journal BLOCKS          metadata journal a format makes,\n"
+          "                          %d .. %d (one per %d blocks)\n"
+          "  --max-workers N           most worker threads, one per open\n"
+          "                          session; more connections are\n"
+          "                          answered 2 (%d)\n",
+          prog, CACHE_MB_DEFAULT, CG_CYLS_DEFAULT, COMPACT_KB_DEFAULT,
+          DELAY_MB_DEFAULT, DISK_CONNS_DEFAULT, DISK_WINDOW_DEFAULT,
+          RA_MIN * BLOCK_SIZE / 1024, CACHE_BYPASS * BLOCK_SIZE / 1024,
+          RA_KB_DEFAULT, FLUSH_MS_DEFAULT,
+          INLINE_MAX, INLINE_DEFAULT, INODE_RATIO, JNL_MIN, JNL_MAX,
+          JNL_RATIO, WORKERS_MAX_DEFAULT);
+}
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <disk_server_ip>\n", argv[0]);
+  if (argc < 2) {
+    usage(argv[0]);
     return 1;
   }
 
   const char *disk_ip = argv[1];
+  int workers = WORKERS_DEFAULT;
+  int max_workers = WORKERS_MAX_DEFAULT;
+  optind = 2; // options follow the positional arguments
+  if (argc > 2 && argv[2][0] != '-') {
+    workers = atoi(argv[2]);
+    optind = 3;
+  }
+  if (workers <= 0) {
+    fprintf(stderr, "workers must be >0\n");
+    return 1;
+  }
+
+  static const struct option long_opts[] = {
+      {"alloc", required_argument, NULL, 'a'},
+      {"cache", required_argument, NULL, 'c'},
+      {"cg-cyls", required_argument, NULL, 'g'},
+      {"compact-rate", required_argument, NULL, 'k'},
+      {"disk-window", required_argument, NULL, 'w'},
+      {"disk-conns", required_argument, NULL, 'n'},
+      {"readahead", required_argument, NULL, 'r'},
+      {"delay", required_argument, NULL, 'd'},
+      {"flush-ms", required_argument, NULL, 'f'},
+      {"inline", required_argument, NULL, 'i'},
+      {"inodes", required_argument, NULL, 'I'},
+      {"journal", required_argument, NULL, 'j'},
+      {"max-workers", required_argument, NULL, 'm'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "a:c:g:k:w:n:r:d:f:i:I:j:m:", long_opts,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'a':
+      if (strcmp(optarg, "group") == 0)
+        alloc_policy = ALLOC_GROUP;
+      else if (strcmp(optarg, "best") == 0)
+        alloc_policy = ALLOC_BEST;
+      else if (strcmp(optarg, "next") == 0)
+        alloc_policy = ALLOC_NEXT;
+      else if (strcmp(optarg, "bitmap") == 0)
+        alloc_policy = ALLOC_BITMAP;
+      else {
+        fprintf(stderr, "bad alloc policy: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'c': {
+      char *end;
+      cache_mb = strtol(optarg, &end, 10);
+      if (*end != '\0' || cache_mb < 0) {
+        fprintf(stderr, "bad cache size: %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 'g':
+      cg_cyls = atoi(optarg);
+      if (cg_cyls <= 0) {
+        fprintf(stderr, "cylinders per group must be >0\n");
+        return 1;
+      }
+      break;
+    case 'k': {
+      char *end;
+      long n = strtol(optarg, &end, 10);
+      if (*end != '\0' || n < 0 || n > INT_MAX) {
+        fprintf(stderr, "bad compact rate: %s\n", optarg);
+        return 1;
+      }
+      compact_kb = (int)n;
+      break;
+    }
+    case 'w':
+      disk_window = atoi(optarg);
+      if (disk_window <= 0) {
+        fprintf(stderr, "disk window must be >0\n");
+        return 1;
+      }
+      break;
+    case 'n':
+      disk_nconns = atoi(optarg);
+      if (disk_nconns <= 0) {
+        fprintf(stderr, "disk connections must be >0\n");
+        return 1;
+      }
+      break;
+    case 'r': {
+      char *end;
+      long kb = strtol(optarg, &end, 10);
+      ra_max = (int)(kb * 1024 / BLOCK_SIZE);
+      // a window is one cache_prefetch, so it stays under the bypass
+      if (*end != '\0' || kb < 0 || kb > CACHE_BYPASS * BLOCK_SIZE / 1024 ||
+          (ra_max > 0 && ra_max < RA_MIN)) {
+        fprintf(stderr, "bad readahead size: %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 'd': {
+      char *end;
+      long mb = strtol(optarg, &end, 10);
+      if (*end != '\0' || mb < 0 || mb > 1024 * 1024) {
+        fprintf(stderr, "bad delay size: %s\n", optarg);
+        return 1;
+      }
+      delay_max = (long long)mb * 1024 * 1024;
+      break;
+    }
+    case 'f':
+      flush_ms = atoi(optarg);
+      if (flush_ms <= 0) {
+        fprintf(stderr, "flush interval must be >0\n");
+        return 1;
+      }
+      break;
+    case 'i': {
+      char *end;
+      long bytes = strtol(optarg, &end, 10);
+      if (*end != '\0' || bytes < 0 || bytes > INLINE_MAX) {
+        fprintf(stderr, "bad inline size: %s\n", optarg);
+        return 1;
+      }
+      inline_max = (int)bytes;
+      break;
+    }
+    case 'I': {
+      char *end;
+      long n = strtol(optarg, &end, 10);
+      if (*end != '\0' || n <= 0 || n > MAX_FILES) {
+        fprintf(stderr, "bad inode count: %s\n", optarg);
+        return 1;
+      }
+      inodes_opt = (int)n;
+      break;
+    }
+    case 'j': {
+      char *end;
+      long n = strtol(optarg, &end, 10);
+      if (*end != '\0' || n < JNL_MIN || n > JNL_MAX) {
+        fprintf(stderr, "bad journal size: %s\n", optarg);
+        return 1;
+      }
+      jnl_opt = (int)n;
+      break;
+    }
+    case 'm': {
+      char *end;
+      long n = strtol(optarg, &end, 10);
+      if (*end != '\0' || n <= 0 || n > INT_MAX) {
+        fprintf(stderr, "bad worker limit: %s\n", optarg);
+        return 1;
+      }
+      max_workers = (int)n;
+      break;
+    }
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (workers > max_workers) {
+    fprintf(stderr, "workers must be <= --max-workers (%d)\n", max_workers);
+    return 1;
+  }
+
+  // a client vanishing mid-reply must not kill every other session
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < FILE_LOCK_STRIPES; i++)
+    pthread_rwlock_init(&file_lock[i], NULL);
 
   // connect to lower-level disk server once at startup
   if (disk_connect(disk_ip, DISK_PORT_DEFAULT) < 0) {
@@ -80,6 +297,41 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (cache_init() < 0) {
+    fprintf(stderr, "out of memory for a %ld MB cache\n", cache_mb);
+    return 1;
+  }
+
+  // pick up the filesystem on disk, or make one on a disk without
+  int mrc = fs_mount();
+  if (mrc > 0) {
+    fprintf(stderr, "no filesystem on disk, formatting\n");
+    mrc = fs_format();
+  }
+  if (mrc < 0) {
+    fprintf(stderr, "cannot mount or format the disk\n");
+    return 1;
+  }
+  fprintf(stderr,
+          "mounted: %d inodes, %d in use, %d blocks free, %d-block journal\n",
+          sb.ninodes, ent_live, free_count, sb.jnl_blocks);
+
+  pthread_t flusher;
+  int ferr = pthread_create(&flusher, NULL, fs_flusher, NULL);
+  if (ferr != 0) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(ferr));
+    return 1;
+  }
+  pthread_detach(flusher);
+
+  pthread_t compactor;
+  int cerr = pthread_create(&compactor, NULL, fs_compactor, NULL);
+  if (cerr != 0) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(cerr));
+    return 1;
+  }
+  pthread_detach(compactor);
+
   int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (listen_fd < 0) {
     perror("fs socket");
@@ -107,9 +359,16 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  fprintf(stderr, "file_system_server listening on port %d\n", FS_PORT_DEFAULT);
+  for (int i = 0; i < workers; i++) {
+    if (start_worker() < 0)
+      return 1;
+  }
 
-  // simple single-threaded loop: serve one client at a time
+  fprintf(stderr,
+          "file_system_server listening on port %d (%d workers, at most %d)\n",
+          FS_PORT_DEFAULT, workers, max_workers);
+
+  // hand each connection to the worker pool
   while (1) {
     int client_fd = accept(listen_fd, NULL, NULL);
     if (client_fd < 0) {
@@ -119,500 +378,742 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    serve_client(client_fd);
-    close(client_fd);
+    // replies go out in pieces (header, data, '\n'); don't let Nagle
+    // hold the last piece back for the client's delayed ACK
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    // only this thread queues, and a worker leaves idle only by taking
+    // a queued connection, so the count cannot go stale before the push
+    pthread_mutex_lock(&accept_q.lock);
+    int spawn = accept_q.count >= accept_q.idle;
+    pthread_mutex_unlock(&accept_q.lock);
+    if (spawn && (workers == max_workers || start_worker() < 0)) {
+      dprintf(client_fd, "2\n"); // no thread to serve it
+      close(client_fd);
+      continue;
+    }
+    workers += spawn;
+
+    pthread_mutex_lock(&accept_q.lock);
+    while (accept_q.count == ACCEPT_QUEUE)
+      pthread_cond_wait(&accept_q.not_full, &accept_q.lock);
+    accept_q.fds[(accept_q.head + accept_q.count) % ACCEPT_QUEUE] = client_fd;
+    accept_q.count++;
+    pthread_cond_signal(&accept_q.not_empty);
+    pthread_mutex_unlock(&accept_q.lock);
   }
 
   close(listen_fd);
   return 0;
 }
 
-/* --------------- generic I/O helpers --------------- */
-
-// send exactly n bytes (unless error)
-static ssize_t send_all(int fd, const void *buf, size_t n) {
-  size_t off = 0;
-  const char *p = buf;
-
-  while (off < n) {
-    ssize_t r = send(fd, p + off, n - off, 0);
-    if (r <= 0) {
-      if (r < 0 && errno == EINTR)
-        continue;
+// read and discard a payload the command cannot use
+static int drain_payload(int client_fd, long long len) {
+  unsigned char scrap[4096];
+  for (long long left = len + (len > 0); left > 0;) {
+    size_t k = left < (long long)sizeof(scrap) ? (size_t)left : sizeof(scrap);
+    if (recv_all(client_fd, scrap, k) <= 0)
       return -1;
-    }
-    off += (size_t)r;
+    left -= (long long)k;
   }
-  return (ssize_t)off;
+  return 0;
 }
 
-// recv exactly n bytes (or return 0 on EOF)
-static ssize_t recv_all(int fd, void *buf, size_t n) {
-  size_t off = 0;
-  char *p = buf;
-
-  while (off < n) {
-    ssize_t r = recv(fd, p + off, n - off, 0);
-    if (r == 0)
-      return 0;
-    if (r < 0) {
-      if (errno == EINTR)
-        continue;
-      return -1;
-    }
-    off += (size_t)r;
-  }
-  return (ssize_t)off;
+// receive and discard a payload with fs_lock dropped; -1 if the client left
+static int fs_drain(struct session *ss, long long len) {
+  pthread_rwlock_unlock(&fs_lock);
+  int rc = drain_payload(ss->fd, len);
+  fs_lock_retake(ss);
+  return rc;
 }
 
-// read one line (up to and including '\n')
-static ssize_t recv_line(int fd, char *buf, size_t cap) {
-  size_t n = 0;
+/*
+ * Upload writer thread: filled slots to disk, in order. It holds
+ * fs_lock around each slot and writes nothing once F has run.
+ */
+static void *upload_writer(void *arg) {
+  struct upload *up = arg;
+  int blk = 0;
 
-  while (n < cap) {
-    char c;
-    ssize_t r = recv(fd, &c, 1, 0);
-    if (r == 0)
+  pthread_mutex_lock(&up->lock);
+  while (1) {
+    while (up->count == 0 && !up->done)
+      pthread_cond_wait(&up->filled, &up->lock);
+    if (up->count == 0)
       break;
-    if (r < 0) {
-      if (errno == EINTR)
-        continue;
-      return -1;
+    int slot = up->head;
+    size_t bytes = up->fill[slot];
+    int skip = up->failed;
+    pthread_mutex_unlock(&up->lock);
+
+    int nb = (int)((bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    int rc = 0;
+    if (!skip) {
+      fs_lock_shared();
+      if (atomic_load(&fs_epoch) != up->epoch)
+        rc = -1; // the blocks went with the format
+      else
+        rc = fs_io_blocks(up->e, blk, nb, up->buf[slot], bytes, 1);
+      pthread_rwlock_unlock(&fs_lock);
     }
-    buf[n++] = c;
-    if (c == '\n')
-      break;
+    blk += nb;
+
+    pthread_mutex_lock(&up->lock);
+    if (rc < 0)
+      up->failed = 1;
+    up->head = (slot + 1) % RING_SLOTS;
+    up->count--;
+    pthread_cond_signal(&up->drained);
   }
-  return (ssize_t)n;
+  pthread_mutex_unlock(&up->lock);
+  return NULL;
 }
 
-/* --------------- disk helpers --------------- */
-
-// connect to disk server and read geometry
-static int disk_connect(const char *ip, int port) {
-  disk_sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (disk_sock < 0) {
-    perror("disk socket");
-    return -1;
+/*
+ * Receive len bytes plus '\n' into e's blocks through the ring, with
+ * fs_lock dropped. 0 = written, 2 = disk error (payload still
+ * consumed), -1 = connection lost; fs_lock is held again on return,
+ * and if F ran meanwhile e's blocks are no longer its own.
+ */
+static int upload_blocks(struct session *ss, struct fs_entry *e, int len) {
+  struct upload up = {.e = e, .epoch = ss->epoch};
+  unsigned char *mem = malloc((size_t)RING_SLOTS * RING_BUF);
+  if (!mem)
+    return fs_drain(ss, len) < 0 ? -1 : 2;
+  for (int i = 0; i < RING_SLOTS; i++)
+    up.buf[i] = mem + (size_t)i * RING_BUF;
+  pthread_mutex_init(&up.lock, NULL);
+  pthread_cond_init(&up.filled, NULL);
+  pthread_cond_init(&up.drained, NULL);
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, upload_writer, &up) != 0) {
+    free(mem);
+    return fs_drain(ss, len) < 0 ? -1 : 2;
   }
 
-  struct sockaddr_in sa;
-  memset(&sa, 0, sizeof(sa));
-  sa.sin_family = AF_INET;
-  sa.sin_port = htons(port);
+  pthread_rwlock_unlock(&fs_lock);
+  int lost = 0;
+  for (size_t left = (size_t)len; left > 0;) {
+    pthread_mutex_lock(&up.lock);
+    while (up.count == RING_SLOTS)
+      pthread_cond_wait(&up.drained, &up.lock);
+    int slot = (up.head + up.count) % RING_SLOTS;
+    pthread_mutex_unlock(&up.lock);
+
+    size_t want = left < RING_BUF ? left : RING_BUF;
+    if (recv_all(ss->fd, up.buf[slot], want) <= 0) {
+      lost = 1;
+      break;
+    }
 
-  if (inet_pton(AF_INET, ip, &sa.sin_addr) != 1) {
-    fprintf(stderr, "bad disk ip\n");
-    close(disk_sock);
-    return -1;
+    pthread_mutex_lock(&up.lock);
+    up.fill[slot] = want;
+    up.count++;
+    pthread_cond_signal(&up.filled);
+    pthread_mutex_unlock(&up.lock);
+    left -= want;
   }
-
-  if (connect(disk_sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
-    perror("connect disk");
-    close(disk_sock);
+  char nl;
+  if (!lost && (recv_all(ss->fd, &nl, 1) <= 0 || nl != '\n'))
+    lost = 1;
+
+  pthread_mutex_lock(&up.lock);
+  up.done = 1;
+  pthread_cond_signal(&up.filled);
+  pthread_mutex_unlock(&up.lock);
+  pthread_join(tid, NULL);
+  fs_lock_retake(ss);
+
+  pthread_cond_destroy(&up.drained);
+  pthread_cond_destroy(&up.filled);
+  pthread_mutex_destroy(&up.lock);
+  free(mem);
+  if (lost)
     return -1;
-  }
+  return up.failed ? 2 : 0;
+}
 
-  if (send_all(disk_sock, "I\n", 2) < 0) {
-    perror("send I");
-    return -1;
-  }
+// W of a payload of up to inline_max bytes, kept in the name arena
+static int fs_write_inline(struct session *ss, const char *name,
+                           const unsigned char *buf, int len) {
+  int idx = fs_file_lock(ss, name, 1);
+  if (idx < 0)
+    return 1; // deleted while the payload came in
+  fs_jnl_begin();
+  int rc = fs_inline_set(fs_ent(idx), buf, len);
+  if (rc == 0)
+    fs_meta_data(idx);
+  fs_jnl_end();
+  fs_file_unlock(idx);
+  return rc == 0 ? 0 : 2;
+}
 
-  char buf[64];
-  ssize_t n = recv(disk_sock, buf, sizeof(buf) - 1, 0);
-  if (n <= 0) {
-    perror("recv I");
-    return -1;
+/*
+ * W of a payload in buf into a delayed buffer, which takes buf over
+ * unless this returns 3: memory or free blocks are short, for the
+ * block path to deal with.
+ */
+static int fs_write_delayed(struct session *ss, const char *name,
+                            unsigned char *buf, int len) {
+  int blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (fs_delay_reserve(len) < 0)
+    return 3;
+  struct fs_delay *d = malloc(sizeof(*d));
+  if (!d || fs_reserve_blocks(blocks) < 0) {
+    free(d);
+    fs_delay_reserve(-len);
+    return 3;
   }
-  buf[n] = '\0';
 
-  if (sscanf(buf, "%d %d", &cylinders, &sectors) != 2 || cylinders <= 0 ||
-      sectors <= 0) {
-    fprintf(stderr, "bad disk geometry: %s\n", buf);
-    return -1;
+  int idx = fs_file_lock(ss, name, 1);
+  if (idx < 0) {
+    // deleted while the payload came in
+    free(buf);
+    free(d);
+    fs_reserve_blocks(-blocks);
+    fs_delay_reserve(-len);
+    return 1;
   }
-
-  total_blocks = cylinders * sectors;
-  fprintf(stderr, "disk: C=%d S=%d blocks=%d\n", cylinders, sectors,
-          total_blocks);
+  struct fs_entry *e = fs_ent(idx);
+  fs_jnl_begin();
+  fs_release_runs(e, 1);
+  fs_delay_attach(e, idx, d, buf, len, blocks);
+  e->size = len;
+  fs_meta_data(idx);
+  fs_jnl_end();
+  fs_file_unlock(idx);
   return 0;
 }
 
-// write one logical block to disk server
-static int disk_write_block(int blk, const unsigned char *data, int len) {
-  if (blk < 0 || blk >= total_blocks || len < 0 || len > BLOCK_SIZE)
-    return -1;
-
-  int c = blk / sectors;
-  int s = blk % sectors;
-
-  char cmd[64];
-  int n = snprintf(cmd, sizeof(cmd), "W %d %d %d\n", c, s, len);
-  if (send_all(disk_sock, cmd, (size_t)n) < 0)
-    return -1;
-
-  if (len > 0 && data) {
-    if (send_all(disk_sock, data, (size_t)len) < 0)
-      return -1;
-  }
-
-  if (send_all(disk_sock, "\n", 1) < 0)
-    return -1;
-
-  char ans[2];
-  ssize_t r = recv(disk_sock, ans, sizeof(ans), 0);
-  if (r <= 0)
-    return -1;
-
-  return (ans[0] == '1') ? 0 : -1;
+// give fresh n blocks, retrying once held extents are released
+static int fs_grow_fresh(struct fs_entry *fresh, int n) {
+  if (n == 0 || fs_grow_file(fresh, n, 0) == 0)
+    return 0;
+  return fs_jnl_reclaim() && fs_grow_file(fresh, n, 0) == 0 ? 0 : -1;
 }
 
-// read one logical block from disk server
-static int disk_read_block(int blk, unsigned char *data) {
-  if (blk < 0 || blk >= total_blocks)
-    return -1;
-
-  int c = blk / sectors;
-  int s = blk % sectors;
-
-  char cmd[64];
-  int n = snprintf(cmd, sizeof(cmd), "R %d %d\n", c, s);
-  if (send_all(disk_sock, cmd, (size_t)n) < 0)
-    return -1;
-
-  char tag;
-  if (recv_all(disk_sock, &tag, 1) <= 0)
-    return -1;
-  if (tag != '1')
-    return -1;
-
-  if (recv_all(disk_sock, data, BLOCK_SIZE) <= 0)
-    return -1;
+// switch the file over to fresh's blocks, written with len bytes
+static int fs_write_swap(struct session *ss, const char *name,
+                         struct fs_entry *fresh, int len) {
+  int idx = fs_file_lock(ss, name, 1);
+  if (idx < 0) {
+    fs_release_runs(fresh, 0); // deleted meanwhile
+    return 1;
+  }
+  struct fs_entry *e = fs_ent(idx);
+  fs_jnl_begin();
+  fs_release_runs(e, 1);
+  fs_take_runs(e, fresh);
+  e->size = len;
+  fs_meta_data(idx);
+  fs_jnl_end();
+  fs_file_unlock(idx);
   return 0;
 }
 
-/* --------------- filesystem helpers --------------- */
-
-// allocate an unused fs_table slot (skip 0, root)
-static int fs_alloc_entry(void) {
-  for (int i = 1; i < MAX_FILES; i++)
-    if (!fs_table[i].used)
-      return i;
-  return -1;
-}
+/*
+ * W of a payload in buf onto new blocks. With no room for both copies
+ * the old contents go first, as a plain overwrite would; only if
+ * freeing them makes room, and only now that the whole payload is in,
+ * so a client that disconnects leaves the file as it was.
+ */
+static int fs_write_blocks(struct session *ss, const char *name,
+                           const unsigned char *buf, int len) {
+  struct fs_entry fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  fresh.parent = ss->cwd;
+  int needed = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (fs_grow_fresh(&fresh, needed) < 0) {
+    int idx = fs_file_lock(ss, name, 1);
+    if (idx < 0)
+      return 1;
+    struct fs_entry *e = fs_ent(idx);
+    int own = e->store == STORE_BLOCKS    ? e->nblocks
+              : e->store == STORE_DELAYED ? e->delay->blocks
+                                          : 0;
+    pthread_mutex_lock(&alloc_lock);
+    int room = free_count - resv_count + own >= needed;
+    pthread_mutex_unlock(&alloc_lock);
+    if (room) {
+      fs_jnl_begin();
+      fs_release_runs(e, 1);
+      e->size = 0;
+      fs_meta_data(idx);
+      fs_jnl_end();
+    }
+    fs_file_unlock(idx);
+    // the old blocks are held until the truncate is checkpointed
+    if (!room || fs_jnl_release() < 0 || fs_grow_file(&fresh, needed, 0) < 0)
+      return 2;
+  }
 
-// find entry by name / type / parent
-static int fs_find(const char *name, int is_dir, int parent) {
-  for (int i = 0; i < MAX_FILES; i++) {
-    if (!fs_table[i].used)
-      continue;
-    if (fs_table[i].parent != parent)
-      continue;
-    if (fs_table[i].is_dir != is_dir)
-      continue;
-    if (strncmp(fs_table[i].name, name, MAX_NAME) == 0)
-      return i;
+  if (len > 0 && fs_io_blocks(&fresh, 0, fresh.nblocks, (unsigned char *)buf,
+                              (size_t)len, 1) < 0) {
+    fs_release_runs(&fresh, 0);
+    return 2;
   }
-  return -1;
+  return fs_write_swap(ss, name, &fresh, len);
 }
 
-// find contiguous free blocks in bitmap
-static int fs_alloc_contiguous(int blocks) {
-  if (blocks <= 0)
-    return -1;
-
-  for (int start = 0; start + blocks <= total_blocks; start++) {
-    int ok = 1;
-    for (int i = 0; i < blocks; i++) {
-      if (block_used[start + i]) {
-        ok = 0;
-        break;
-      }
+/*
+ * W: replace a file's contents with the len-byte payload that follows,
+ * received with fs_lock dropped. Small payloads stay in memory (inline
+ * or delayed); larger ones are written to new blocks as they arrive.
+ * The file switches only once the payload is complete, so a lost
+ * client leaves it as it was. Returns the client status, -1 if the
+ * connection was lost.
+ */
+static int fs_write_stream(struct session *ss, const char *name, int len) {
+  int idx = fs_file_lock(ss, name, 0);
+  if (idx < 0)
+    return fs_drain(ss, len) < 0 ? -1 : 1;
+  fs_file_unlock(idx);
+
+  struct fs_entry fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  fresh.parent = ss->cwd;
+  int needed = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (len > RING_BUF && fs_grow_fresh(&fresh, needed) == 0) {
+    int rc = upload_blocks(ss, &fresh, len);
+    if (atomic_load(&fs_epoch) != ss->epoch) {
+      if (fresh.nruns > 1)
+        free(fresh.runs); // the blocks went with the format
+      return rc < 0 ? -1 : 1;
     }
-    if (!ok)
-      continue;
-    for (int i = 0; i < blocks; i++)
-      block_used[start + i] = 1;
-    return start;
+    if (rc != 0) {
+      fs_release_runs(&fresh, 0);
+      return rc;
+    }
+    return fs_write_swap(ss, name, &fresh, len);
   }
-  return -1;
-}
 
-// mark a run of blocks as free
-static void fs_free_blocks(int first, int blocks) {
-  if (first < 0 || blocks <= 0)
-    return;
-  for (int i = 0; i < blocks; i++) {
-    int b = first + i;
-    if (b >= 0 && b < total_blocks)
-      block_used[b] = 0;
-  }
+  // small, or no room for two copies: take the payload in whole
+  unsigned char *buf = NULL;
+  int rc = recv_payload(ss, len, &buf);
+  if (rc != 0)
+    return rc;
+  if (len > 0 && len <= inline_max)
+    rc = fs_write_inline(ss, name, buf, len);
+  else if (len > 0 && len <= DELAY_FILE_MAX &&
+           (rc = fs_write_delayed(ss, name, buf, len)) != 3)
+    return rc;
+  else
+    rc = fs_write_blocks(ss, name, buf, len);
+  free(buf);
+  return rc;
 }
 
-// reset in-memory FS and bitmap
-static int fs_format(void) {
-  memset(fs_table, 0, sizeof(fs_table));
-
-  free(block_used);
-  block_used = calloc((size_t)total_blocks, 1);
-  if (!block_used)
-    return -1;
-
-  fs_table[0].used = 1;
-  fs_table[0].is_dir = 1;
-  fs_table[0].parent = 0;
-  fs_table[0].first_block = -1;
-  fs_table[0].nblocks = 0;
-  fs_table[0].size = 0;
-  strncpy(fs_table[0].name, "/", MAX_NAME - 1);
-
-  cwd_index = 0;
-  fs_initialized = 1;
-  return 0;
-}
+/*
+ * Write len bytes at offset (or at the end if append), growing the file
+ * as needed. Only the blocks the range touches are written; a partial
+ * first or last block that holds existing data is read back first.
+ * The range must start within the file or at its end. Caller holds the
+ * file lock exclusive and is in a transaction, see fs_write_at.
+ */
+static int fs_write_locked(struct fs_entry *e, int idx, long long offset,
+                           const unsigned char *data, int len, int append) {
+  int size = e->size;
+  if (append)
+    offset = size;
+  if (offset < 0 || offset > size || offset + len > INT_MAX)
+    return 2;
+  if (len == 0)
+    return 0;
 
-// create an empty file in cwd
-static int fs_create_file(const char *name) {
-  if (fs_find(name, 0, cwd_index) >= 0)
-    return 1;
+  int off = (int)offset;
+  int end = off + len;
+  int tiny = e->store == STORE_INLINE ||
+             (e->store == STORE_BLOCKS && e->nblocks == 0);
+  if (tiny && end <= inline_max)
+    return fs_inline_write(e, off, data, len) == 0 ? 0 : 2;
+  if (e->store == STORE_INLINE && fs_inline_spill(e, idx) < 0)
+    return 2;
+  if (fs_delay_write(e, idx, off, data, len) == 0) {
+    if (end > size)
+      e->size = end;
+    return 0;
+  }
+  if (e->store == STORE_DELAYED && fs_delay_commit(e) < 0)
+    return 2;
 
-  int idx = fs_alloc_entry();
-  if (idx < 0)
+  int new_blocks = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (new_blocks > e->nblocks &&
+      fs_grow_file(e, new_blocks - e->nblocks, 0) < 0)
     return 2;
 
-  fs_table[idx].used = 1;
-  fs_table[idx].is_dir = 0;
-  fs_table[idx].parent = cwd_index;
-  fs_table[idx].first_block = -1;
-  fs_table[idx].nblocks = 0;
-  fs_table[idx].size = 0;
-  strncpy(fs_table[idx].name, name, MAX_NAME - 1);
-  fs_table[idx].name[MAX_NAME - 1] = '\0';
-  return 0;
-}
+  int b0 = off / BLOCK_SIZE;
+  int b1 = (end - 1) / BLOCK_SIZE;
+  int nb = b1 - b0 + 1;
+  unsigned char *span = calloc((size_t)nb, BLOCK_SIZE);
+  if (!span)
+    return 2;
 
-// delete file and free its blocks
-static int fs_delete_file(const char *name) {
-  int idx = fs_find(name, 0, cwd_index);
-  if (idx < 0)
-    return 1;
+  // keep the existing bytes around the range in its edge blocks
+  int head = (off % BLOCK_SIZE) != 0;
+  int tail = (end % BLOCK_SIZE) != 0 && end < size;
+  int rc = 0;
+  if (head)
+    rc = fs_io_blocks(e, b0, 1, span, BLOCK_SIZE, 0);
+  if (rc == 0 && tail && !(head && b1 == b0))
+    rc = fs_io_blocks(e, b1, 1, span + (size_t)(nb - 1) * BLOCK_SIZE,
+                      BLOCK_SIZE, 0);
+
+  if (rc == 0) {
+    memcpy(span + off % BLOCK_SIZE, data, (size_t)len);
+    rc = fs_io_blocks(e, b0, nb, span, (size_t)nb * BLOCK_SIZE, 1);
+  }
+  if (rc == 0 && end > size)
+    e->size = end;
 
-  fs_free_blocks(fs_table[idx].first_block, fs_table[idx].nblocks);
-  memset(&fs_table[idx], 0, sizeof(fs_table[idx]));
-  return 0;
+  free(span);
+  return rc == 0 ? 0 : 2;
 }
 
-// write full contents of file (overwrite)
-static int fs_write_file(const char *name, const unsigned char *data, int len) {
-  int idx = fs_find(name, 0, cwd_index);
+static int fs_write_at(struct session *ss, const char *name, long long offset,
+                       const unsigned char *data, int len, int append) {
+  int idx = fs_file_lock(ss, name, 1);
   if (idx < 0)
     return 1;
-
-  struct fs_entry *e = &fs_table[idx];
-
-  int needed = (len <= 0) ? 0 : ((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
-
-  fs_free_blocks(e->first_block, e->nblocks);
-  e->first_block = -1;
-  e->nblocks = 0;
-  e->size = 0;
-
-  if (needed == 0)
-    return 0;
-
-  int first = fs_alloc_contiguous(needed);
-  if (first < 0)
-    return 2;
-
-  e->first_block = first;
-  e->nblocks = needed;
-  e->size = len;
-
-  int off = 0;
-  for (int i = 0; i < needed; i++) {
-    unsigned char buf[BLOCK_SIZE];
-    memset(buf, 0, sizeof(buf));
-
-    int chunk = BLOCK_SIZE;
-    if (off + chunk > len)
-      chunk = len - off;
-    if (chunk > 0)
-      memcpy(buf, data + off, (size_t)chunk);
-
-    if (disk_write_block(first + i, buf, BLOCK_SIZE) < 0)
-      return 2;
-
-    off += chunk;
+  fs_jnl_begin();
+  int rc = fs_write_locked(fs_ent(idx), idx, offset, data, len, append);
+  fs_meta_data(idx); // a failed write may still have moved the contents
+  fs_jnl_end();
+  if (rc == 2 && fs_jnl_reclaim()) {
+    // blocks freed lately were held for the checkpoint; go again
+    fs_jnl_begin();
+    rc = fs_write_locked(fs_ent(idx), idx, offset, data, len, append);
+    fs_meta_data(idx);
+    fs_jnl_end();
   }
-  return 0;
+  fs_file_unlock(idx);
+  return rc;
 }
 
-// read file contents into newly allocated buffer
-static int fs_read_file(const char *name, unsigned char **out_data,
-                        int *out_len) {
-  int idx = fs_find(name, 0, cwd_index);
-  if (idx < 0)
-    return 1;
+/*
+ * Take fs_lock and the file back for the next pass of fs_read_range;
+ * -1 if it was formatted away, deleted or now ends before end. fs_lock
+ * is held either way.
+ */
+static int fs_read_relock(struct session *ss, const char *name,
+                          long long end) {
+  if (fs_lock_retake(ss) < 0)
+    return -1; // and the cwd with it
+  int idx = fs_file_lock(ss, name, 0);
+  if (idx >= 0 && fs_ent(idx)->size < end) {
+    fs_file_unlock(idx);
+    idx = -1;
+  }
+  return idx;
+}
 
-  struct fs_entry *e = &fs_table[idx];
-  *out_len = e->size;
+/*
+ * R and RR: send bytes [offset, offset + len) of a file, clipped to its
+ * end, as "0 n\n" + n bytes + "\n" ("1 0\n" if there is no such file).
+ * Each pass of up to STREAM_DEPTH chunks is read under the file lock
+ * and sent with it and fs_lock dropped. Returns -1 if the connection
+ * must be dropped (client gone, file cut short, or a disk error).
+ */
+static int fs_read_range(struct session *ss, const char *name,
+                         long long offset, long long len, int client_fd) {
+  int idx = fs_file_lock(ss, name, 0);
+  if (idx < 0) {
+    dprintf(client_fd, "1 0\n");
+    return 0;
+  }
 
-  if (e->size == 0) {
-    *out_data = NULL;
+  long long size = fs_ent(idx)->size;
+  if (offset > size)
+    offset = size;
+  if (len > size - offset)
+    len = size - offset;
+
+  unsigned char *mem =
+      len > 0 ? malloc((size_t)STREAM_DEPTH * STREAM_CHUNK) : NULL;
+  if (len > 0 && !mem) {
+    fs_file_unlock(idx);
+    dprintf(client_fd, "2 0\n");
     return 0;
   }
 
-  unsigned char *buf = malloc((size_t)e->size);
-  if (!buf)
-    return 2;
+  struct {
+    int skip;  // bytes of the first block before the range
+    int bytes; // bytes of the range in this chunk
+  } chunk[STREAM_DEPTH];
+  char hdr[32];
+  int hlen = snprintf(hdr, sizeof(hdr), "0 %lld\n", len);
+  int rc = 0;
+  int missed = 0;
+  long long step = STREAM_FIRST;
+  long long pos = offset;
+  long long end = offset + len;
 
-  int off = 0;
-  for (int i = 0; i < e->nblocks; i++) {
-    unsigned char blk[BLOCK_SIZE];
-    if (disk_read_block(e->first_block + i, blk) < 0) {
-      free(buf);
-      return 2;
+  while (1) {
+    struct fs_entry *e = fs_ent(idx);
+    int n = 0;
+    if (e->store != STORE_BLOCKS && pos < end) {
+      // bytes in memory: copy out a pass worth
+      long long want = end - pos;
+      if (want > (long long)STREAM_DEPTH * STREAM_CHUNK)
+        want = (long long)STREAM_DEPTH * STREAM_CHUNK;
+      const unsigned char *data =
+          e->store == STORE_DELAYED
+              ? e->delay->data
+              : (const unsigned char *)fs_arena_ptr(e->inl.ref);
+      memcpy(mem, data + pos, (size_t)want);
+      chunk[n].skip = 0;
+      chunk[n++].bytes = (int)want;
+      pos += want;
+    } else if (pos < end) {
+      struct fs_read fr[STREAM_DEPTH];
+      for (; n < STREAM_DEPTH && pos < end; n++) {
+        int blk = (int)(pos / BLOCK_SIZE);
+        int skip = (int)(pos % BLOCK_SIZE);
+        long long want = end - pos;
+        if (want > step - skip)
+          want = step - skip;
+        if (step < STREAM_CHUNK)
+          step *= 2;
+        int nb = (int)((skip + want + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+        if (fs_read_begin(&fr[n], e, blk, nb, mem + (size_t)n * STREAM_CHUNK,
+                          (size_t)(skip + want)) < 0) {
+          rc = -1;
+          break;
+        }
+        chunk[n].skip = skip;
+        chunk[n].bytes = (int)want;
+        pos += want;
+      }
+      for (int c = 0; c < n; c++) {
+        missed += fr[c].missed;
+        if (fs_read_end(&fr[c]) < 0)
+          rc = -1;
+      }
+    }
+    if (rc == 0 && pos == end)
+      fs_readahead(ss, idx, offset, len, missed);
+    fs_file_unlock(idx);
+
+    // the pass is in mem: let writers and F in while it goes out
+    pthread_rwlock_unlock(&fs_lock);
+    if (rc == 0 && hlen > 0 && send_all(client_fd, hdr, (size_t)hlen) < 0)
+      rc = -1;
+    hlen = 0;
+    for (int c = 0; rc == 0 && c < n; c++)
+      if (send_all(client_fd, mem + (size_t)c * STREAM_CHUNK + chunk[c].skip,
+                   (size_t)chunk[c].bytes) < 0)
+        rc = -1;
+    if (rc == 0 && pos == end && send_all(client_fd, "\n", 1) < 0)
+      rc = -1;
+    if (rc < 0 || pos == end) {
+      fs_lock_shared();
+      break;
+    }
+    if ((idx = fs_read_relock(ss, name, end)) < 0) {
+      rc = -1;
+      break;
     }
-    int chunk = BLOCK_SIZE;
-    if (off + chunk > e->size)
-      chunk = e->size - off;
-    memcpy(buf + off, blk, (size_t)chunk);
-    off += chunk;
   }
-
-  *out_data = buf;
-  return 0;
+  free(mem);
+  return rc;
 }
 
 // list entries in current directory
-static int fs_list(int verbose, int client_fd) {
-  int count = 0;
-  for (int i = 0; i < MAX_FILES; i++) {
-    if (!fs_table[i].used)
-      continue;
-    if (fs_table[i].parent != cwd_index)
-      continue;
-    count++;
-  }
-
-  dprintf(client_fd, "0 %d\n", count);
+static int fs_list(struct session *ss, int verbose, int client_fd) {
+  int dir = ss->cwd;
+  pthread_rwlock_rdlock(dir_lock(dir));
 
-  for (int i = 0; i < MAX_FILES; i++) {
-    if (!fs_table[i].used)
-      continue;
-    if (fs_table[i].parent != cwd_index)
-      continue;
+  struct fs_dir *d = fs_ent(dir)->dir;
+  dprintf(client_fd, "0 %d\n", d->nchildren);
 
+  for (int i = d->first_child; i >= 0; i = fs_ent(i)->next_sibling) {
+    struct fs_entry *e = fs_ent(i);
     if (!verbose) {
-      dprintf(client_fd, "%s%s\n", fs_table[i].name,
-              fs_table[i].is_dir ? "/" : "");
+      dprintf(client_fd, "%s%s\n", fs_name(e), e->is_dir ? "/" : "");
     } else {
-      char t = fs_table[i].is_dir ? 'D' : 'F';
-      dprintf(client_fd, "%c %s %d\n", t, fs_table[i].name, fs_table[i].size);
+      char t = e->is_dir ? 'D' : 'F';
+      dprintf(client_fd, "%c %s %d\n", t, fs_name(e), atomic_load(&e->size));
     }
   }
+
+  pthread_rwlock_unlock(dir_lock(dir));
   return 0;
 }
 
 // create new directory under cwd
-static int fs_mkdir(const char *name) {
+static int fs_mkdir(struct session *ss, const char *name) {
   if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
     return 2;
 
-  if (fs_find(name, 0, cwd_index) >= 0 || fs_find(name, 1, cwd_index) >= 0)
+  int dir = ss->cwd;
+  pthread_rwlock_wrlock(dir_lock(dir));
+
+  if (fs_find(name, 0, dir) >= 0 || fs_find(name, 1, dir) >= 0) {
+    pthread_rwlock_unlock(dir_lock(dir));
     return 1;
+  }
 
-  int idx = fs_alloc_entry();
-  if (idx < 0)
-    return 2;
+  fs_jnl_begin();
+  int idx = fs_alloc_entry(name);
+  int rc = idx < 0 ? -1 : fs_publish_entry(idx, 1, dir);
+  fs_jnl_end();
+  pthread_rwlock_unlock(dir_lock(dir));
+  return rc == 0 ? 0 : 2;
+}
 
-  fs_table[idx].used = 1;
-  fs_table[idx].is_dir = 1;
-  fs_table[idx].parent = cwd_index;
-  fs_table[idx].first_block = -1;
-  fs_table[idx].nblocks = 0;
-  fs_table[idx].size = 0;
-  strncpy(fs_table[idx].name, name, MAX_NAME - 1);
-  fs_table[idx].name[MAX_NAME - 1] = '\0';
-  return 0;
+// move the session's cwd reference from one directory to another
+static void fs_set_cwd(struct session *ss, int idx) {
+  atomic_fetch_sub(&fs_ent(ss->cwd)->dir->refs, 1);
+  ss->cwd = idx;
 }
 
 // change current working directory
-static int fs_cd(const char *name) {
+static int fs_cd(struct session *ss, const char *name) {
   if (strcmp(name, "/") == 0) {
-    cwd_index = 0;
+    fs_ref_dir(0);
+    fs_set_cwd(ss, 0);
     return 0;
   }
   if (strcmp(name, "..") == 0) {
-    cwd_index = fs_table[cwd_index].parent;
+    // the parent is not empty (we are in it), so it cannot go away
+    int up = fs_ent(ss->cwd)->parent;
+    fs_ref_dir(up);
+    fs_set_cwd(ss, up);
     return 0;
   }
 
-  int idx = fs_find(name, 1, cwd_index);
-  if (idx < 0)
+  int dir = ss->cwd;
+  pthread_rwlock_rdlock(dir_lock(dir));
+
+  int idx = fs_find(name, 1, dir);
+  if (idx < 0) {
+    pthread_rwlock_unlock(dir_lock(dir));
     return 1;
-  cwd_index = idx;
+  }
+
+  // pinned before the lock drops, so a racing rmdir sees it in use
+  fs_ref_dir(idx);
+  pthread_rwlock_unlock(dir_lock(dir));
+
+  if (fs_dir_load(idx) < 0) {
+    atomic_fetch_sub(&fs_ent(idx)->dir->refs, 1);
+    return 2;
+  }
+  fs_set_cwd(ss, idx);
   return 0;
 }
 
 // build absolute path of cwd into buf
-static int fs_pwd(char *buf, size_t cap) {
-  if (cwd_index == 0) {
+static int fs_pwd(struct session *ss, char *buf, size_t cap) {
+  if (ss->cwd == 0) {
     strncpy(buf, "/", cap);
     buf[cap - 1] = '\0';
     return 0;
   }
 
-  const char *parts[MAX_FILES];
-  int n = 0;
-  int cur = cwd_index;
-
-  while (cur != 0 && n < MAX_FILES) {
-    parts[n++] = fs_table[cur].name;
-    cur = fs_table[cur].parent;
+  // ancestors of a cwd are non-empty, so the chain is stable
+  size_t total = 0;
+  for (int cur = ss->cwd; cur != 0; cur = fs_ent(cur)->parent)
+    total += 1 + fs_ent(cur)->name_len;
+
+  // fill leaf first from the end; whatever passes cap - 1 is cut off
+  size_t end = (total < cap - 1) ? total : cap - 1;
+  size_t pos = total;
+  for (int cur = ss->cwd; cur != 0; cur = fs_ent(cur)->parent) {
+    struct fs_entry *e = fs_ent(cur);
+    const char *name = fs_name(e);
+    pos -= e->name_len;
+    for (size_t i = 0; i < e->name_len && pos + i < end; i++)
+      buf[pos + i] = name[i];
+    pos--;
+    if (pos < end)
+      buf[pos] = '/';
   }
 
-  size_t off = 0;
-  buf[off++] = '/';
-
-  for (int i = n - 1; i >= 0; i--) {
-    size_t len = strlen(parts[i]);
-    if (off + len + 1 >= cap)
-      break;
-    memcpy(buf + off, parts[i], len);
-    off += len;
-    if (i != 0)
-      buf[off++] = '/';
-  }
-
-  buf[off] = '\0';
+  buf[end] = '\0';
   return 0;
 }
 
 // remove empty directory
-static int fs_rmdir(const char *name) {
-  int idx = fs_find(name, 1, cwd_index);
-  if (idx < 0)
+static int fs_rmdir(struct session *ss, const char *name) {
+  int dir = ss->cwd;
+  pthread_rwlock_wrlock(dir_lock(dir));
+
+  int idx = fs_find(name, 1, dir);
+  if (idx < 0) {
+    pthread_rwlock_unlock(dir_lock(dir));
     return 1;
+  }
 
-  for (int i = 0; i < MAX_FILES; i++) {
-    if (!fs_table[i].used)
-      continue;
-    if (fs_table[i].parent == idx)
-      return 2; // directory not empty
+  struct fs_dir *d = fs_ent(idx)->dir;
+  pthread_rwlock_wrlock(&d->lock);
+
+  // not empty, or some session is inside
+  int busy = d->nchildren > 0 || atomic_load(&d->refs) > 0;
+
+  pthread_rwlock_unlock(&d->lock);
+  if (!busy) {
+    fs_jnl_begin();
+    fs_dir_unlink(dir, idx);
+    fs_group_count(d->group, -1);
+    fs_dir_free(d);
+    fs_free_entry(idx);
+    fs_jnl_end();
   }
 
-  memset(&fs_table[idx], 0, sizeof(fs_table[idx]));
-  return 0;
+  pthread_rwlock_unlock(dir_lock(dir));
+  return busy ? 2 : 0;
 }
 
 /* --------------- per-client handler --------------- */
 
+// add a detached worker thread to the pool
+static int start_worker(void) {
+  pthread_t tid;
+  int err = pthread_create(&tid, NULL, worker_main, NULL);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+// worker thread: serve queued connections one after another
+static void *worker_main(void *arg) {
+  (void)arg;
+
+  while (1) {
+    pthread_mutex_lock(&accept_q.lock);
+    accept_q.idle++;
+    while (accept_q.count == 0)
+      pthread_cond_wait(&accept_q.not_empty, &accept_q.lock);
+    accept_q.idle--;
+    int client_fd = accept_q.fds[accept_q.head];
+    accept_q.head = (accept_q.head + 1) % ACCEPT_QUEUE;
+    accept_q.count--;
+    pthread_cond_signal(&accept_q.not_full);
+    pthread_mutex_unlock(&accept_q.lock);
+
+    serve_client(client_fd);
+    close(client_fd);
+  }
+  return NULL;
+}
+
 // handle one client connection until they disconnect
 static void serve_client(int client_fd) {
   char line[MAX_LINE];
 
-  cwd_index = 0; // each client starts at root
+  // each client starts at root
+  struct session ss = {.fd = client_fd, .cwd = 0};
+  for (int i = 0; i < RA_STREAMS; i++)
+    ss.ra[i].file = -1;
+  fs_lock_shared();
+  ss.epoch = atomic_load(&fs_epoch);
+  fs_ref_dir(0);
+  pthread_rwlock_unlock(&fs_lock);
 
   while (1) {
     ssize_t n = recv_line(client_fd, line, sizeof(line));
@@ -635,127 +1136,207 @@ static void serve_client(int client_fd) {
     }
 
     if (strcmp(cmd, "F") == 0) {
+      pthread_mutex_lock(&fs_gate); // commands arriving now queue behind
+      pthread_rwlock_wrlock(&fs_lock);
+      pthread_mutex_unlock(&fs_gate);
       int rc = fs_format();
+      pthread_rwlock_unlock(&fs_lock);
       dprintf(client_fd, "%d\n", (rc == 0) ? 0 : 2);
+      continue;
+    }
 
-    } else if (strcmp(cmd, "C") == 0) {
-      char name[MAX_NAME];
-      if (sscanf(line, " C %63s", name) != 1) {
-        dprintf(client_fd, "2\n");
-        continue;
-      }
-      int rc = fs_create_file(name);
-      dprintf(client_fd, "%d\n", rc);
+    // everything else runs concurrently with other sessions
+    fs_lock_shared();
+    unsigned int epoch = atomic_load(&fs_epoch);
+    if (ss.epoch != epoch) {
+      ss.epoch = epoch; // formatted under us: back to root
+      ss.cwd = 0;
+      fs_ref_dir(0);
+    }
+    int alive = serve_command(&ss, line, cmd);
+    pthread_rwlock_unlock(&fs_lock);
 
-    } else if (strcmp(cmd, "D") == 0) {
-      char name[MAX_NAME];
-      if (sscanf(line, " D %63s", name) != 1) {
-        dprintf(client_fd, "2\n");
-        continue;
-      }
-      int rc = fs_delete_file(name);
-      dprintf(client_fd, "%d\n", rc);
+    if (!alive)
+      break;
+  }
 
-    } else if (strcmp(cmd, "L") == 0) {
-      int verbose = 0;
-      if (sscanf(line, " L %d", &verbose) != 1) {
-        dprintf(client_fd, "2\n");
-        continue;
-      }
-      fs_list(verbose, client_fd);
+  fs_lock_shared();
+  if (ss.epoch == atomic_load(&fs_epoch))
+    atomic_fetch_sub(&fs_ent(ss.cwd)->dir->refs, 1);
+  pthread_rwlock_unlock(&fs_lock);
+}
 
-    } else if (strcmp(cmd, "R") == 0) {
-      char name[MAX_NAME];
-      if (sscanf(line, " R %63s", name) != 1) {
-        dprintf(client_fd, "2\n");
-        continue;
-      }
+/*
+ * Receive a write payload of len bytes plus '\n' into a new buffer,
+ * with fs_lock dropped. 0 = ok, 1 = formatted meanwhile (the file is
+ * gone), 2 = out of memory (payload drained), -1 = connection dead.
+ */
+static int recv_payload(struct session *ss, int len, unsigned char **out) {
+  *out = NULL;
+  if (len == 0)
+    return 0;
 
-      unsigned char *data = NULL;
-      int len = 0;
-      int rc = fs_read_file(name, &data, &len);
-
-      if (rc != 0) {
-        dprintf(client_fd, "%d 0\n", rc);
-      } else {
-        dprintf(client_fd, "0 %d\n", len);
-        if (len > 0 && data) {
-          if (send_all(client_fd, data, (size_t)len) < 0) {
-            free(data);
-            break;
-          }
-        }
-        if (send_all(client_fd, "\n", 1) < 0) {
-          free(data);
-          break;
-        }
-      }
-      free(data);
+  unsigned char *buf = malloc((size_t)len);
+  pthread_rwlock_unlock(&fs_lock);
+  int rc = 0;
+  char nl;
+  if (!buf)
+    rc = drain_payload(ss->fd, len) < 0 ? -1 : 2;
+  else if (recv_all(ss->fd, buf, (size_t)len) <= 0 ||
+           recv_all(ss->fd, &nl, 1) <= 0 || nl != '\n')
+    rc = -1;
+  if (fs_lock_retake(ss) < 0 && rc == 0)
+    rc = 1;
+  if (rc != 0)
+    free(buf);
+  else
+    *out = buf;
+  return rc;
+}
 
-    } else if (strcmp(cmd, "W") == 0) {
-      char name[MAX_NAME];
-      int len = 0;
-      if (sscanf(line, " W %63s %d", name, &len) != 2 || len < 0) {
-        dprintf(client_fd, "2\n");
-        continue;
-      }
+// run one non-format command; returns 0 if the connection is unusable
+static int serve_command(struct session *ss, const char *line,
+                         const char *cmd) {
+  int client_fd = ss->fd;
 
-      unsigned char *buf = NULL;
-      if (len > 0) {
-        buf = malloc((size_t)len);
-        if (!buf) {
-          dprintf(client_fd, "2\n");
-          continue;
-        }
-        if (recv_all(client_fd, buf, (size_t)len) <= 0) {
-          free(buf);
-          break;
-        }
-        char nl;
-        if (recv_all(client_fd, &nl, 1) <= 0 || nl != '\n') {
-          free(buf);
-          break;
-        }
-      }
+  if (strcmp(cmd, "C") == 0) {
+    char name[MAX_NAME];
+    if (sscanf(line, " C %63s", name) != 1) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+    int rc = fs_create_file(ss, name);
+    dprintf(client_fd, "%d\n", rc);
 
-      int rc = fs_write_file(name, buf, len);
-      free(buf);
-      dprintf(client_fd, "%d\n", rc);
+  } else if (strcmp(cmd, "D") == 0) {
+    char name[MAX_NAME];
+    if (sscanf(line, " D %63s", name) != 1) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+    int rc = fs_delete_file(ss, name);
+    dprintf(client_fd, "%d\n", rc);
 
-    } else if (strcmp(cmd, "mkdir") == 0) {
-      char name[MAX_NAME];
-      if (sscanf(line, " mkdir %63s", name) != 1) {
-        dprintf(client_fd, "2\n");
-        continue;
-      }
-      int rc = fs_mkdir(name);
-      dprintf(client_fd, "%d\n", rc);
+  } else if (strcmp(cmd, "L") == 0) {
+    int verbose = 0;
+    if (sscanf(line, " L %d", &verbose) != 1) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+    fs_list(ss, verbose, client_fd);
 
-    } else if (strcmp(cmd, "cd") == 0) {
-      char name[MAX_NAME];
-      if (sscanf(line, " cd %63s", name) != 1) {
-        dprintf(client_fd, "2\n");
-        continue;
-      }
-      int rc = fs_cd(name);
-      dprintf(client_fd, "%d\n", rc);
-
-    } else if (strcmp(cmd, "pwd") == 0) {
-      char buf2[1024];
-      fs_pwd(buf2, sizeof(buf2));
-      dprintf(client_fd, "0 %s\n", buf2);
-
-    } else if (strcmp(cmd, "rmdir") == 0) {
-      char name[MAX_NAME];
-      if (sscanf(line, " rmdir %63s", name) != 1) {
-        dprintf(client_fd, "2\n");
-        continue;
-      }
-      int rc = fs_rmdir(name);
-      dprintf(client_fd, "%d\n", rc);
+  } else if (strcmp(cmd, "R") == 0) {
+    char name[MAX_NAME];
+    if (sscanf(line, " R %63s", name) != 1) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+    if (fs_read_range(ss, name, 0, LLONG_MAX, client_fd) < 0)
+      return 0;
 
-    } else {
+  } else if (strcmp(cmd, "RR") == 0) {
+    char name[MAX_NAME];
+    long long offset = 0, len = 0;
+    if (sscanf(line, " RR %63s %lld %lld", name, &offset, &len) != 3 ||
+        offset < 0 || len < 0) {
+      dprintf(client_fd, "2 0\n");
+      return 1;
+    }
+    if (fs_read_range(ss, name, offset, len, client_fd) < 0)
+      return 0;
+
+  } else if (strcmp(cmd, "W") == 0) {
+    char name[MAX_NAME];
+    int len = 0;
+    if (sscanf(line, " W %63s %d", name, &len) != 2 || len < 0) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+
+    int rc = fs_write_stream(ss, name, len);
+    if (rc < 0)
+      return 0;
+    dprintf(client_fd, "%d\n", rc);
+
+  } else if (strcmp(cmd, "WA") == 0 || strcmp(cmd, "APPEND") == 0) {
+    // WA name offset len / APPEND name len, payload as for W
+    int append = (strcmp(cmd, "APPEND") == 0);
+    char name[MAX_NAME];
+    long long offset = 0;
+    int len = 0;
+    int ok;
+    if (append)
+      ok = sscanf(line, " APPEND %63s %d", name, &len) == 2;
+    else
+      ok = sscanf(line, " WA %63s %lld %d", name, &offset, &len) == 3;
+    if (!ok || len < 0) {
       dprintf(client_fd, "2\n");
+      return 1;
     }
+
+    unsigned char *buf = NULL;
+    int rc = recv_payload(ss, len, &buf);
+    if (rc < 0)
+      return 0;
+    if (rc == 0)
+      rc = fs_write_at(ss, name, offset, buf, len, append);
+    free(buf);
+    dprintf(client_fd, "%d\n", rc);
+
+  } else if (strcmp(cmd, "SYNC") == 0) {
+    dprintf(client_fd, "%d\n", fs_sync() == 0 ? 0 : 2);
+
+  } else if (strcmp(cmd, "COMPACT") == 0) {
+    // COMPACT starts a pass, COMPACT STAT only reports
+    char arg[8] = {0};
+    if (sscanf(line, " COMPACT %7s", arg) == 1 && strcmp(arg, "STAT") != 0) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+    if (arg[0] == '\0')
+      fs_compact_kick(1);
+    int extents, largest;
+    fs_free_stats(&extents, &largest);
+    int busy;
+    long long passes, files, blocks;
+    fs_compact_stat(&busy, &passes, &files, &blocks);
+    dprintf(client_fd, "0 %d %lld %lld %lld %d %d\n", busy, passes, files,
+            blocks, extents, largest);
+
+  } else if (strcmp(cmd, "mkdir") == 0) {
+    char name[MAX_NAME];
+    if (sscanf(line, " mkdir %63s", name) != 1) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+    int rc = fs_mkdir(ss, name);
+    dprintf(client_fd, "%d\n", rc);
+
+  } else if (strcmp(cmd, "cd") == 0) {
+    char name[MAX_NAME];
+    if (sscanf(line, " cd %63s", name) != 1) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+    int rc = fs_cd(ss, name);
+    dprintf(client_fd, "%d\n", rc);
+
+  } else if (strcmp(cmd, "pwd") == 0) {
+    char buf2[1024];
+    fs_pwd(ss, buf2, sizeof(buf2));
+    dprintf(client_fd, "0 %s\n", buf2);
+
+  } else if (strcmp(cmd, "rmdir") == 0) {
+    char name[MAX_NAME];
+    if (sscanf(line, " rmdir %63s", name) != 1) {
+      dprintf(client_fd, "2\n");
+      return 1;
+    }
+    int rc = fs_rmdir(ss, name);
+    dprintf(client_fd, "%d\n", rc);
+
+  } else {
+    dprintf(client_fd, "2\n");
   }
+  return 1;
 }
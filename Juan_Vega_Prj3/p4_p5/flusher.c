@@ -0,0 +1,356 @@
+#include "alloc.h"
+#include "cache.h"
+#include "file.h"
+#include "flusher.h"
+#include "itab.h"
+#include "journal.h"
+
+pthread_mutex_t delay_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t delay_kick = PTHREAD_COND_INITIALIZER; // flusher
+static struct fs_delay *delay_head = NULL;
+static struct fs_delay *delay_tail = NULL;
+static long long delay_bytes = 0;
+long long delay_max = (long long)DELAY_MB_DEFAULT * 1024 * 1024;
+static int delay_count = 0;
+static int delay_urgent = 0; // flush everything now
+int flush_ms = FLUSH_MS_DEFAULT;
+int inline_max = INLINE_DEFAULT; // bytes, 0 = off
+
+long long fs_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Count add bytes (negative to give back) against delay_max; -1 if they
+ * do not fit. Past half the budget the flusher is woken to drain it.
+ */
+int fs_delay_reserve(long long add) {
+  pthread_mutex_lock(&delay_lock);
+  if (add > 0 && delay_bytes + add > delay_max) {
+    pthread_mutex_unlock(&delay_lock);
+    return -1;
+  }
+  delay_bytes += add;
+  if (delay_bytes > delay_max / 2 && !delay_urgent) {
+    delay_urgent = 1;
+    pthread_cond_signal(&delay_kick);
+  }
+  pthread_mutex_unlock(&delay_lock);
+  return 0;
+}
+
+// make e delayed with d holding cap bytes at data; both reserved already
+void fs_delay_attach(struct fs_entry *e, int idx, struct fs_delay *d,
+                     unsigned char *data, int cap, int blocks) {
+  d->data = data;
+  d->cap = cap;
+  d->blocks = blocks;
+  d->idx = idx;
+  d->since = fs_now_ms();
+  d->next = NULL;
+  pthread_mutex_lock(&delay_lock);
+  d->prev = delay_tail;
+  if (delay_tail)
+    delay_tail->next = d;
+  else
+    delay_head = d;
+  delay_tail = d;
+  delay_count++;
+  pthread_mutex_unlock(&delay_lock);
+  e->store = STORE_DELAYED;
+  e->delay = d;
+}
+
+// forget e's delayed data; caller holds the file lock exclusive
+void fs_delay_drop(struct fs_entry *e) {
+  struct fs_delay *d = e->delay;
+  pthread_mutex_lock(&delay_lock);
+  if (d->prev)
+    d->prev->next = d->next;
+  else
+    delay_head = d->next;
+  if (d->next)
+    d->next->prev = d->prev;
+  else
+    delay_tail = d->prev;
+  delay_count--;
+  delay_bytes -= d->cap;
+  pthread_mutex_unlock(&delay_lock);
+  fs_reserve_blocks(-d->blocks);
+  free(d->data);
+  free(d);
+  e->store = STORE_BLOCKS;
+  e->delay = NULL;
+}
+
+// drop every delayed file's data; caller holds fs_lock exclusive
+void fs_delay_reset(void) {
+  pthread_mutex_lock(&delay_lock);
+  while (delay_head) {
+    struct fs_delay *d = delay_head;
+    delay_head = d->next;
+    free(d->data);
+    free(d);
+  }
+  delay_tail = NULL;
+  delay_count = 0;
+  delay_bytes = 0;
+  pthread_mutex_unlock(&delay_lock);
+}
+
+/*
+ * WA / APPEND of [off, off + len) kept in memory, for a delayed file or
+ * one with no blocks yet. -1 leaves the file as it was: it is too big,
+ * has blocks, is inline, or the budget is spent, and the write takes
+ * the block path. Caller holds the file lock exclusive and sets the size.
+ */
+int fs_delay_write(struct fs_entry *e, int idx, int off,
+                   const unsigned char *data, int len) {
+  int end = off + len;
+  if (delay_max == 0 || end > DELAY_FILE_MAX || e->store == STORE_INLINE ||
+      (e->store == STORE_BLOCKS && e->nblocks > 0))
+    return -1;
+
+  struct fs_delay *d = e->store == STORE_DELAYED ? e->delay : NULL;
+  int cap = d ? d->cap : 0;
+  int have = d ? d->blocks : 0;
+  int need = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (need > have && fs_reserve_blocks(need - have) < 0)
+    return -1;
+  if (end > cap) {
+    // appends double the buffer, so a growing log reallocs rarely
+    int want = cap * 2 > end ? cap * 2 : end;
+    if (want > DELAY_FILE_MAX)
+      want = DELAY_FILE_MAX;
+    struct fs_delay *nd = NULL;
+    unsigned char *bigger = NULL;
+    if (fs_delay_reserve(want - cap) == 0) {
+      nd = d ? d : malloc(sizeof(*nd));
+      bigger = nd ? realloc(d ? d->data : NULL, (size_t)want) : NULL;
+      if (!bigger)
+        fs_delay_reserve(cap - want);
+    }
+    if (!bigger) {
+      if (nd != d)
+        free(nd);
+      if (need > have)
+        fs_reserve_blocks(have - need);
+      return -1;
+    }
+    if (d) {
+      d->data = bigger;
+      d->cap = want;
+    } else {
+      fs_delay_attach(e, idx, nd, bigger, want, 0);
+      d = nd;
+    }
+  }
+  if (need > have)
+    d->blocks = need;
+  memcpy(d->data + off, data, (size_t)len);
+  return 0;
+}
+
+/*
+ * Give a delayed file its blocks: allocate them in one go, write the
+ * data through the cache, and switch the file over. On failure the
+ * file stays delayed. Caller holds the file lock exclusive.
+ */
+int fs_delay_commit(struct fs_entry *e) {
+  struct fs_entry fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  fresh.parent = e->parent;
+  struct fs_delay *d = e->delay;
+  int size = e->size;
+  int needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (needed > 0) {
+    if (fs_grow_file(&fresh, needed, d->blocks) < 0)
+      return -1;
+    d->blocks = 0; // the reservation became these blocks
+    if (fs_io_blocks(&fresh, 0, needed, d->data, (size_t)size, 1) < 0) {
+      fs_release_runs(&fresh, 0);
+      // still delayed: hold the room again if nobody took it meanwhile
+      if (fs_reserve_blocks(needed) == 0)
+        d->blocks = needed;
+      return -1;
+    }
+  }
+  fs_delay_drop(e);
+  fs_take_runs(e, &fresh);
+  return 0;
+}
+
+/*
+ * Make e an inline file of the given size bytes, dropping whatever it
+ * held before. -1 leaves e as it was (the arena is out of memory).
+ * Caller holds the file lock exclusive.
+ */
+int fs_inline_set(struct fs_entry *e, const unsigned char *data,
+                  int size) {
+  struct fs_inline in = {NAME_NONE, 0};
+  if (size > 0) {
+    pthread_mutex_lock(&table_lock);
+    in.ref = fs_arena_alloc((size_t)size);
+    pthread_mutex_unlock(&table_lock);
+    if (in.ref == NAME_NONE)
+      return -1;
+    in.cap = (size + NAME_ALIGN - 1) / NAME_ALIGN * NAME_ALIGN;
+    memcpy(fs_arena_ptr(in.ref), data, (size_t)size);
+  }
+  fs_release_runs(e, 1);
+  e->store = STORE_INLINE;
+  e->inl = in;
+  e->size = size;
+  return 0;
+}
+
+/*
+ * WA / APPEND of [off, off + len) on an inline file, or a file with no
+ * blocks yet, ending within inline_max. The slot is rewritten in place
+ * while it is big enough, else moved to one of the new size.
+ */
+int fs_inline_write(struct fs_entry *e, int off,
+                    const unsigned char *data, int len) {
+  int end = off + len;
+  int size = e->size;
+  if (e->store == STORE_INLINE && end <= e->inl.cap) {
+    memcpy(fs_arena_ptr(e->inl.ref) + off, data, (size_t)len);
+    if (end > size)
+      e->size = end;
+    return 0;
+  }
+
+  unsigned char buf[INLINE_MAX];
+  if (size > 0)
+    memcpy(buf, fs_arena_ptr(e->inl.ref), (size_t)size);
+  memcpy(buf + off, data, (size_t)len);
+  return fs_inline_set(e, buf, end > size ? end : size);
+}
+
+/*
+ * An inline file outgrows inline_max: move its bytes to a delayed
+ * buffer, or to blocks, so the write can go on from there. -1 leaves
+ * it inline. Caller holds the file lock exclusive.
+ */
+int fs_inline_spill(struct fs_entry *e, int idx) {
+  struct fs_inline in = e->inl;
+  int size = e->size;
+  e->store = STORE_BLOCKS;
+  e->nruns = 0;
+  e->nblocks = 0;
+  if (size > 0) {
+    unsigned char *data = (unsigned char *)fs_arena_ptr(in.ref);
+    if (fs_delay_write(e, idx, 0, data, size) < 0) {
+      int nb = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      if (fs_grow_file(e, nb, 0) < 0) {
+        e->inl = in;
+        e->store = STORE_INLINE;
+        return -1;
+      }
+      if (fs_io_blocks(e, 0, nb, data, (size_t)size, 1) < 0) {
+        fs_release_runs(e, 0);
+        e->inl = in;
+        e->store = STORE_INLINE;
+        return -1;
+      }
+    }
+    pthread_mutex_lock(&table_lock);
+    fs_arena_release(in.ref, (size_t)in.cap);
+    pthread_mutex_unlock(&table_lock);
+  }
+  return 0;
+}
+
+/*
+ * Commit delayed files, all of them or those older than flush_ms, in
+ * the order they were delayed, so their blocks come out side by side.
+ * Caller holds fs_lock shared.
+ */
+static int fs_flush_delayed(int all) {
+  pthread_mutex_lock(&delay_lock);
+  int cnt = 0;
+  int *list = delay_count > 0 ? malloc((size_t)delay_count * sizeof(*list))
+                              : NULL;
+  long long due = fs_now_ms() - flush_ms;
+  for (struct fs_delay *d = delay_head; list && d; d = d->next)
+    if (all || d->since <= due)
+      list[cnt++] = d->idx;
+  int rc = (delay_count > 0 && !list) ? -1 : 0;
+  pthread_mutex_unlock(&delay_lock);
+
+  for (int i = 0; i < cnt; i++) {
+    pthread_rwlock_t *fl = &file_lock[list[i] % FILE_LOCK_STRIPES];
+    pthread_rwlock_wrlock(fl);
+    struct fs_entry *e = fs_ent(list[i]);
+    // skip files deleted or rewritten since
+    if (e->store == STORE_DELAYED) {
+      fs_jnl_begin();
+      if (fs_delay_commit(e) < 0)
+        rc = -1;
+      else
+        fs_meta_data(list[i]);
+      fs_jnl_end();
+    }
+    pthread_rwlock_unlock(fl);
+  }
+  free(list);
+  return rc;
+}
+
+/*
+ * SYNC: every delayed file gets its blocks, every dirty page hits disk
+ * and the extents held back for the commit are free, see fs_jnl_release.
+ */
+int fs_sync(void) {
+  int rc = fs_flush_delayed(1);
+  if (fs_jnl_release() < 0)
+    rc = -1;
+  if (cache_sync() < 0)
+    rc = -1;
+  return rc;
+}
+
+/*
+ * Background flusher: every flush_ms, or sooner when delayed data
+ * passes half its budget or the running transaction a quarter of the
+ * journal, give the delayed files that are due their blocks, commit,
+ * checkpoint a journal that is half full and write the dirty cache
+ * pages back.
+ */
+void *fs_flusher(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&delay_lock);
+  while (1) {
+    if (!delay_urgent && !jnl_urgent) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += flush_ms / 1000;
+      ts.tv_nsec += (long)(flush_ms % 1000) * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&delay_kick, &delay_lock, &ts);
+    }
+    int all = delay_urgent;
+    jnl_urgent = 0;
+    pthread_mutex_unlock(&delay_lock);
+
+    fs_lock_shared();
+    int rc = fs_flush_delayed(all);
+    if (fs_jnl_commit() < 0 || fs_jnl_checkpoint(0) < 0)
+      rc = -1;
+    if (cache_sync() < 0)
+      rc = -1;
+    pthread_rwlock_unlock(&fs_lock);
+    if (rc < 0)
+      fprintf(stderr, "flusher: write-back failed\n");
+
+    pthread_mutex_lock(&delay_lock);
+    if (all) // a failed drain waits for the next tick, not a busy loop
+      delay_urgent = rc == 0 && delay_bytes > delay_max / 2;
+  }
+  return NULL;
+}
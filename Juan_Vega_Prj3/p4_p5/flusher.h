@@ -0,0 +1,51 @@
+#ifndef FLUSHER_H
+#define FLUSHER_H
+
+#include "fs.h"
+
+#define DELAY_MB_DEFAULT 8 // memory for delayed file data, --delay
+#define DELAY_FILE_MAX (128 * 1024) // larger files get blocks at once
+#define FLUSH_MS_DEFAULT 1000       // delayed data age at flush, --flush-ms
+#define INLINE_DEFAULT INLINE_MAX   // files kept in the name arena, --inline
+
+/*
+ * Delayed allocation: a file of up to DELAY_FILE_MAX bytes with no
+ * blocks is written to a memory buffer and gets blocks later, when the
+ * flusher finds it older than flush_ms, buffers pass half of delay_max,
+ * or on SYNC. Its blocks are reserved meanwhile, so a full disk still
+ * fails the write. delay_lock guards the list; a buffer belongs to its
+ * file lock.
+ */
+struct fs_delay {
+  struct fs_delay *prev; // delay list, oldest first
+  struct fs_delay *next;
+  unsigned char *data; // the file's size bytes
+  int cap;             // bytes allocated, counted in delay_bytes
+  int blocks;          // free blocks reserved for it
+  int idx;             // entry index
+  long long since;     // ms (monotonic) the data was first delayed
+};
+
+extern pthread_mutex_t delay_lock;
+extern pthread_cond_t delay_kick;
+extern long long delay_max;
+extern int flush_ms;
+extern int inline_max;
+
+long long fs_now_ms(void);
+int fs_delay_reserve(long long add);
+void fs_delay_attach(struct fs_entry *e, int idx, struct fs_delay *d,
+                     unsigned char *data, int cap, int blocks);
+void fs_delay_drop(struct fs_entry *e);
+void fs_delay_reset(void);
+int fs_delay_write(struct fs_entry *e, int idx, int off,
+                   const unsigned char *data, int len);
+int fs_delay_commit(struct fs_entry *e);
+int fs_inline_set(struct fs_entry *e, const unsigned char *data, int size);
+int fs_inline_write(struct fs_entry *e, int off, const unsigned char *data,
+                    int len);
+int fs_inline_spill(struct fs_entry *e, int idx);
+int fs_sync(void);
+void *fs_flusher(void *arg);
+
+#endif
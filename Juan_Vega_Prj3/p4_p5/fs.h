@@ -0,0 +1,185 @@
+#ifndef FS_H
+#define FS_H
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE 128
+#define MAX_LINE 4096
+#define MAX_NAME 64
+#define FILE_LOCK_STRIPES 4096
+#define RA_MIN 32          // smallest readahead window, in blocks
+#define RA_KB_DEFAULT 128  // largest readahead window, --readahead
+#define RA_STREAMS 4       // sequential streams tracked per session
+#define INLINE_MAX (BLOCK_SIZE - 8) // what fits in an inode's data block
+
+// on-disk layout, see disk_super
+#define SUPER_MAGIC "VEGAFS2"
+#define INODE_BLOCKS 2  // per inode: names and links, then contents
+#define ITAB_PAGE (CACHE_PAGE_BLOCKS / INODE_BLOCKS) // inodes loaded at once
+#define INODE_RUNS (INLINE_MAX / 8) // runs kept in the inode itself
+#define INODE_INLINE -1 // disk_inode_b.nruns of an inline file
+#define INODE_RATIO 32  // F makes one inode per this many blocks, --inodes
+#define META_RUN 256    // most metadata blocks written in one request
+#define JNL_RATIO 32    // F makes one journal block per this many, --journal
+#define JNL_MIN 16
+#define JNL_MAX 65536
+
+// fs_entry.used states
+#define ENTRY_FREE 0
+#define ENTRY_LIVE 1
+
+// fs_entry.store: where a file's bytes are
+#define STORE_BLOCKS 0  // its runs, if any
+#define STORE_DELAYED 1 // a fs_delay buffer, blocks not allocated yet
+#define STORE_INLINE 2  // a name arena slot, never any blocks
+
+/*
+ * A directory's children: a chained hash table over their names and a
+ * list in creation order, both linked by slot index under its lock.
+ * Files have no fs_dir.
+ */
+struct fs_dir {
+  pthread_rwlock_t lock; // guards the children, see file.h
+  atomic_int refs;       // sessions whose cwd is this dir
+  int *buckets;          // head slot of each hash chain, -1 = empty
+  int nbuckets;          // power of two
+  int nchildren;
+  int first_child; // child list, creation order
+  int last_child;
+  int loaded; // children read in from disk and indexed, see fs_dir_load
+  int group;  // cylinder group its files' blocks go to
+};
+
+// a file's blocks first..first+len-1, in file order
+struct fs_run {
+  int first;
+  int len;
+};
+
+// a tiny file's bytes in the name arena
+struct fs_inline {
+  unsigned int ref; // arena offset, NAME_NONE when empty
+  int cap;          // slot size
+};
+
+/*
+ * One in-memory inode, 48 bytes. A single run sits in the union, longer
+ * run lists on the heap; delayed and inline files keep their bytes
+ * there instead of blocks.
+ */
+struct fs_entry {
+  unsigned char used;     // ENTRY_FREE / ENTRY_LIVE
+  unsigned char is_dir;   // 0 = file, 1 = directory
+  unsigned char name_len; // strlen of the name, < MAX_NAME
+  unsigned char store;    // STORE_BLOCKS / STORE_DELAYED / STORE_INLINE
+  int parent;             // index of parent directory
+  int nruns;              // runs in the file's block list
+  int nblocks;            // number of blocks
+  _Atomic int size;       // file size in bytes
+  unsigned int name_hash;
+  int hash_next;          // parent's hash chain; free list link when free
+  int prev_sibling;       // neighbours in the parent's child list
+  int next_sibling;
+  unsigned int name_ref;  // arena offset of the NUL-terminated name
+  union {
+    struct fs_dir *dir;     // directories only
+    struct fs_run run;      // files with nruns <= 1
+    struct fs_run *runs;    // files with nruns > 1
+    struct fs_delay *delay; // delayed files
+    struct fs_inline inl;   // inline files
+  };
+};
+
+/*
+ * On disk: superblock, bitmap, journal, inode table (page aligned),
+ * data. Inode i has two blocks: disk_inode_a, its name and links,
+ * changed under the parent's lock, and disk_inode_b, its contents,
+ * changed under its file lock. Inodes past ent_hwm are garbage.
+ * Integers are in host order.
+ */
+struct disk_super {
+  char magic[8];
+  int32_t total_blocks;
+  int32_t ninodes;
+  int32_t bm_start; // first bitmap block
+  int32_t bm_blocks;
+  int32_t jnl_start; // disk_jsuper, then transactions
+  int32_t jnl_blocks;
+  int32_t itab_start; // first inode table block
+  int32_t data_start;
+  int32_t ent_hwm;  // inodes ever handed out
+  int32_t ent_free; // free list head, linked through disk_inode_a.next
+  int32_t ent_live;
+};
+
+struct disk_inode_a {
+  uint8_t used;
+  uint8_t is_dir;
+  uint8_t name_len;
+  uint8_t pad;
+  int32_t parent;
+  int32_t prev; // siblings in the parent's child list
+  int32_t next; // a free inode's next free inode
+  char name[MAX_NAME];
+};
+
+struct disk_inode_b {
+  int32_t size;
+  int32_t nruns; // INODE_INLINE: size bytes in data
+  union {
+    struct fs_run runs[INODE_RUNS]; // a longer list: runs[0] locates it
+    unsigned char data[INLINE_MAX];
+    struct {
+      int32_t first;
+      int32_t last;
+      int32_t count;
+      int32_t group;
+    } kids; // directories
+  };
+};
+
+_Static_assert(sizeof(struct disk_super) <= BLOCK_SIZE, "superblock");
+_Static_assert(sizeof(struct disk_inode_a) <= BLOCK_SIZE, "inode names");
+_Static_assert(sizeof(struct disk_inode_b) == BLOCK_SIZE, "inode data");
+
+/*
+ * Sequential readahead, up to RA_STREAMS files per session (LRU). A
+ * window of blocks after a sequential read is fetched in the
+ * background; reaching it doubles the next one, a stream that stops
+ * short or finds its blocks evicted halves it.
+ */
+struct readahead {
+  int file;          // entry index of the stream, -1 = none
+  long long next;    // byte offset a sequential read starts at
+  int win;           // blocks per window, RA_MIN .. ra_max
+  int mark;          // file block whose read sends the next window
+  int end;           // file block past everything fetched, 0 = none
+  unsigned int used; // session's read count when last read, for LRU
+};
+
+// per-connection state
+struct session {
+  int fd;
+  int cwd;            // index of the working directory
+  unsigned int epoch; // fs_epoch the cwd belongs to
+  unsigned int reads; // R / RR served, ages the streams
+  struct readahead ra[RA_STREAMS];
+};
+
+#endif
@@ -0,0 +1,668 @@
+#include "alloc.h"
+#include "cache.h"
+#include "disk.h"
+#include "file.h"
+#include "flusher.h"
+#include "itab.h"
+#include "journal.h"
+
+#define DIR_BUCKETS_MIN 8 // initial hash buckets per directory
+
+pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t itab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int inodes_opt = 0;           // --inodes for the next F, 0 = by ratio
+static int itab_hwm0 = 0;     // ent_hwm at mount; older inodes load lazily
+uint64_t *itab_loaded = NULL; // inode table pages read in
+
+/*
+ * Inode slab. Chunks are allocated on demand and never freed or moved
+ * until the next format, so fs_ent() needs no lock: an index reached
+ * through a directory was published under that directory's lock, after
+ * its chunk pointer was stored. Freed slots go on a LIFO list threaded
+ * through hash_next; fresh slots come from the high-water mark.
+ */
+struct fs_entry *ent_chunks[MAX_ENTRY_CHUNKS];
+int ent_hwm = 0;   // slots ever handed out
+int ent_free = -1; // head of the free list
+int ent_live = 0;  // entries in use
+
+// name arena, same growth rules; free slots are kept per size class
+char *name_chunks[MAX_NAME_CHUNKS];
+static unsigned int name_top = 0;              // next unused arena offset
+static unsigned int name_free[NAME_CLASSES + 1]; // free list heads by class
+
+static unsigned int fs_name_alloc(const char *name, size_t len);
+static unsigned int fs_name_hash(const char *name);
+static struct fs_dir *fs_dir_new(void);
+static void fs_release_all(void);
+
+/*
+ * Fill inode idx from its two blocks on disk. Its parent links it in
+ * when that directory is loaded. Caller holds itab_lock.
+ */
+static int fs_itab_decode(int idx, const struct disk_inode_a *a,
+                          const struct disk_inode_b *b) {
+  pthread_mutex_lock(&table_lock);
+  int chunk = idx >> ENTRY_CHUNK_BITS;
+  if (!ent_chunks[chunk])
+    ent_chunks[chunk] = calloc(ENTRY_CHUNK, sizeof(struct fs_entry));
+  if (!ent_chunks[chunk]) {
+    pthread_mutex_unlock(&table_lock);
+    return -1;
+  }
+  struct fs_entry *e = fs_ent(idx);
+  if (!a->used) {
+    e->hash_next = a->next;
+    pthread_mutex_unlock(&table_lock);
+    return 0;
+  }
+  if (a->name_len >= MAX_NAME || a->parent < 0 || a->parent >= ent_hwm) {
+    pthread_mutex_unlock(&table_lock);
+    return -1;
+  }
+  e->name_ref = fs_name_alloc(a->name, a->name_len);
+  pthread_mutex_unlock(&table_lock);
+  if (e->name_ref == NAME_NONE)
+    return -1;
+
+  e->used = ENTRY_LIVE;
+  e->is_dir = a->is_dir;
+  e->name_len = a->name_len;
+  e->name_hash = fs_name_hash(fs_name(e));
+  e->parent = a->parent;
+  e->prev_sibling = a->prev;
+  e->next_sibling = a->next;
+  e->hash_next = -1;
+  e->store = STORE_BLOCKS;
+  e->nruns = 0;
+  e->nblocks = 0;
+  e->size = 0;
+  e->dir = NULL;
+  if (e->is_dir) {
+    e->dir = fs_dir_new();
+    if (!e->dir)
+      return -1;
+    e->dir->first_child = b->kids.first;
+    e->dir->last_child = b->kids.last;
+    e->dir->nchildren = b->kids.count;
+    e->dir->loaded = 0;
+    // out of range if --cg-cyls changed since the directory was made
+    int g = b->kids.group;
+    e->dir->group = g >= 0 && g < cg_count ? g : 0;
+    fs_group_count(e->dir->group, 1);
+    return 0;
+  }
+
+  e->size = b->size;
+  if (b->nruns == INODE_INLINE) {
+    if (b->size < 0 || b->size > INLINE_MAX)
+      return -1;
+    e->store = STORE_INLINE;
+    e->inl.ref = NAME_NONE;
+    e->inl.cap = 0;
+    if (b->size > 0) {
+      pthread_mutex_lock(&table_lock);
+      e->inl.ref = fs_arena_alloc((size_t)b->size);
+      pthread_mutex_unlock(&table_lock);
+      if (e->inl.ref == NAME_NONE)
+        return -1;
+      e->inl.cap = (b->size + NAME_ALIGN - 1) / NAME_ALIGN * NAME_ALIGN;
+      memcpy(fs_arena_ptr(e->inl.ref), b->data, (size_t)b->size);
+    }
+    return 0;
+  }
+  if (b->nruns < 0 || b->size < 0)
+    return -1;
+  if (b->nruns <= 1) {
+    e->run = b->runs[0];
+  } else {
+    struct fs_run *list = malloc((size_t)(b->nruns + 1) * sizeof(*list));
+    if (!list)
+      return -1;
+    struct fs_run ext = {-1, 0};
+    if (b->nruns <= INODE_RUNS) {
+      memcpy(list, b->runs, (size_t)b->nruns * sizeof(*list));
+    } else {
+      ext = b->runs[0];
+      size_t bytes = (size_t)b->nruns * sizeof(*list);
+      int nb = (int)((bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
+      if (nb > ext.len) {
+        free(list);
+        return -1;
+      }
+      struct cache_read cr;
+      cache_read_begin(&cr, ext.first, nb, (unsigned char *)list, bytes);
+      if (cache_read_end(&cr) < 0) {
+        free(list);
+        return -1;
+      }
+    }
+    list[b->nruns] = ext;
+    e->runs = list;
+  }
+  e->nruns = b->nruns;
+  for (int i = 0; i < e->nruns; i++)
+    e->nblocks += fs_runs(e)[i].len;
+  return 0;
+}
+
+/*
+ * Read a page of the inode table in, once. Only inodes below itab_hwm0
+ * come from disk; newer ones were made in memory.
+ */
+static int fs_itab_load(int page) {
+  pthread_mutex_lock(&itab_lock);
+  if (itab_loaded[page / 64] & (1ull << (page % 64))) {
+    pthread_mutex_unlock(&itab_lock);
+    return 0;
+  }
+
+  int first = page * ITAB_PAGE;
+  int rc = 0;
+  if (first < itab_hwm0) {
+    unsigned char *buf = malloc((size_t)ITAB_PAGE * INODE_BLOCKS * BLOCK_SIZE);
+    rc = buf ? fs_meta_read(sb.itab_start + first * INODE_BLOCKS,
+                            ITAB_PAGE * INODE_BLOCKS, buf)
+             : -1;
+    for (int i = 0; rc == 0 && i < ITAB_PAGE && first + i < itab_hwm0; i++) {
+      const unsigned char *raw = buf + (size_t)i * INODE_BLOCKS * BLOCK_SIZE;
+      struct disk_inode_a a;
+      struct disk_inode_b b;
+      memcpy(&a, raw, sizeof(a));
+      memcpy(&b, raw + BLOCK_SIZE, sizeof(b));
+      rc = fs_itab_decode(first + i, &a, &b);
+    }
+    free(buf);
+  }
+  if (rc == 0)
+    itab_loaded[page / 64] |= 1ull << (page % 64);
+  else
+    fprintf(stderr, "inode table page %d unreadable\n", page);
+  pthread_mutex_unlock(&itab_lock);
+  return rc;
+}
+
+/*
+ * Read a directory's children in and index them, the first time it is
+ * entered; -1 on a disk error or a broken child list.
+ */
+int fs_dir_load(int idx) {
+  struct fs_dir *d = fs_ent(idx)->dir;
+  pthread_rwlock_wrlock(&d->lock);
+  if (d->loaded) {
+    pthread_rwlock_unlock(&d->lock);
+    return 0;
+  }
+
+  int nb = DIR_BUCKETS_MIN;
+  while (nb < d->nchildren)
+    nb *= 2;
+  int *b = malloc((size_t)nb * sizeof(*b));
+  int rc = b ? 0 : -1;
+  for (int i = 0; i < nb && b; i++)
+    b[i] = -1;
+
+  int seen = 0;
+  for (int c = d->first_child; rc == 0 && c >= 0; seen++) {
+    if (c >= itab_hwm0 || seen >= d->nchildren ||
+        fs_itab_load(c / ITAB_PAGE) < 0) {
+      rc = -1;
+      break;
+    }
+    struct fs_entry *e = fs_ent(c);
+    if (e->used != ENTRY_LIVE || e->parent != idx) {
+      rc = -1;
+      break;
+    }
+    unsigned int slot = e->name_hash & (unsigned int)(nb - 1);
+    e->hash_next = b[slot];
+    b[slot] = c;
+    c = e->next_sibling;
+  }
+  if (rc == 0 && seen != d->nchildren)
+    rc = -1;
+
+  if (rc == 0) {
+    free(d->buckets);
+    d->buckets = b;
+    d->nbuckets = nb;
+    d->loaded = 1;
+  } else {
+    free(b);
+  }
+  pthread_rwlock_unlock(&d->lock);
+  return rc;
+}
+
+/*
+ * Pick up the filesystem on disk: replay the journal, then read the
+ * superblock and bitmap, and the inode table as directories are
+ * entered. 1 if the disk holds no filesystem of this size, -1 on a
+ * disk or memory error.
+ */
+int fs_mount(void) {
+  union {
+    struct disk_super s;
+    unsigned char raw[BLOCK_SIZE];
+  } b;
+  if (fs_meta_read(0, 1, b.raw) < 0)
+    return -1;
+  if (memcmp(b.s.magic, SUPER_MAGIC, sizeof(b.s.magic)) != 0 ||
+      b.s.total_blocks != total_blocks)
+    return 1;
+  struct disk_super disk = b.s;
+  if (fs_layout(disk.ninodes, disk.jnl_blocks) < 0 ||
+      disk.bm_start != sb.bm_start || disk.jnl_start != sb.jnl_start ||
+      disk.jnl_blocks != sb.jnl_blocks || disk.itab_start != sb.itab_start)
+    return 1;
+
+  fs_release_all();
+  sb = disk;
+  if (fs_free_space_reset() < 0 || fs_meta_reset() < 0)
+    return -1;
+  int replayed = fs_jnl_replay();
+  if (replayed < 0 || fs_meta_read(0, 1, b.raw) < 0)
+    return -1;
+  if (replayed > 0)
+    fprintf(stderr, "journal: replayed %d transactions\n", replayed);
+  sb = b.s; // the counts may have moved on
+  if (sb.ent_hwm <= 0 || sb.ent_hwm > sb.ninodes)
+    return -1;
+  size_t bytes = (size_t)bm_nwords * sizeof(*bm_words);
+  unsigned char *raw = malloc((size_t)sb.bm_blocks * BLOCK_SIZE);
+  if (!raw || fs_meta_read(sb.bm_start, sb.bm_blocks, raw) < 0) {
+    free(raw);
+    return -1;
+  }
+  memcpy(bm_words, raw, bytes);
+  free(raw);
+  if (fs_free_space_load() < 0)
+    return -1;
+
+  ent_hwm = sb.ent_hwm;
+  ent_free = sb.ent_free;
+  ent_live = sb.ent_live;
+  itab_hwm0 = ent_hwm;
+  if (fs_itab_load(0) < 0 || fs_ent(0)->used != ENTRY_LIVE ||
+      !fs_ent(0)->is_dir || fs_dir_load(0) < 0)
+    return -1;
+  atomic_fetch_add(&fs_epoch, 1);
+  return 0;
+}
+
+/* --------------- filesystem helpers --------------- */
+
+// take an arena slot of at least bytes (> 0); caller holds table_lock
+unsigned int fs_arena_alloc(size_t bytes) {
+  int cls = (int)((bytes + NAME_ALIGN - 1) / NAME_ALIGN);
+  unsigned int size = (unsigned int)cls * NAME_ALIGN;
+  unsigned int ref = name_free[cls];
+
+  if (ref != NAME_NONE) {
+    // free slots hold the next free offset in their first bytes
+    memcpy(&name_free[cls], fs_arena_ptr(ref), sizeof(unsigned int));
+  } else {
+    // a slot never straddles two chunks
+    unsigned int room = NAME_CHUNK - (name_top & (NAME_CHUNK - 1));
+    if (room < size)
+      name_top += room;
+    unsigned int chunk = name_top >> NAME_CHUNK_BITS;
+    if (chunk >= MAX_NAME_CHUNKS)
+      return NAME_NONE;
+    if (!name_chunks[chunk]) {
+      name_chunks[chunk] = malloc(NAME_CHUNK);
+      if (!name_chunks[chunk])
+        return NAME_NONE;
+    }
+    ref = name_top;
+    name_top += size;
+  }
+  return ref;
+}
+
+// return a slot of size bytes to its class; caller holds table_lock
+void fs_arena_release(unsigned int ref, size_t size) {
+  int cls = (int)((size + NAME_ALIGN - 1) / NAME_ALIGN);
+  memcpy(fs_arena_ptr(ref), &name_free[cls], sizeof(unsigned int));
+  name_free[cls] = ref;
+}
+
+// store a name in the arena; caller holds table_lock
+static unsigned int fs_name_alloc(const char *name, size_t len) {
+  unsigned int ref = fs_arena_alloc(len + 1);
+  if (ref != NAME_NONE) {
+    char *p = fs_arena_ptr(ref);
+    memcpy(p, name, len);
+    p[len] = '\0';
+  }
+  return ref;
+}
+
+static void fs_name_release(unsigned int ref, size_t len) {
+  fs_arena_release(ref, len + 1);
+}
+
+// take a free inode and store its name; caller fills and publishes it
+int fs_alloc_entry(const char *name) {
+  size_t len = strnlen(name, MAX_NAME - 1);
+
+  // the free list runs through inodes on disk: read the head's page in
+  pthread_mutex_lock(&table_lock);
+  int head = ent_free;
+  while (head >= 0) {
+    pthread_mutex_unlock(&table_lock);
+    if (fs_itab_load(head / ITAB_PAGE) < 0)
+      return -1;
+    pthread_mutex_lock(&table_lock);
+    if (ent_free == head)
+      break;
+    head = ent_free;
+  }
+
+  int idx = ent_free;
+  if (idx < 0) {
+    if (ent_hwm >= sb.ninodes) {
+      pthread_mutex_unlock(&table_lock);
+      return -1;
+    }
+    int chunk = ent_hwm >> ENTRY_CHUNK_BITS;
+    if (!ent_chunks[chunk]) {
+      ent_chunks[chunk] = calloc(ENTRY_CHUNK, sizeof(struct fs_entry));
+      if (!ent_chunks[chunk]) {
+        pthread_mutex_unlock(&table_lock);
+        return -1;
+      }
+    }
+    idx = ent_hwm;
+  }
+
+  unsigned int ref = fs_name_alloc(name, len);
+  if (ref == NAME_NONE) {
+    pthread_mutex_unlock(&table_lock);
+    return -1;
+  }
+
+  struct fs_entry *e = fs_ent(idx);
+  if (idx == ent_free)
+    ent_free = e->hash_next;
+  else
+    ent_hwm++;
+  ent_live++;
+
+  e->used = ENTRY_LIVE;
+  e->name_ref = ref;
+  e->name_len = (unsigned char)len;
+  pthread_mutex_unlock(&table_lock);
+  return idx;
+}
+
+// release an unlinked inode and its name
+void fs_free_entry(int idx) {
+  struct fs_entry *e = fs_ent(idx);
+  pthread_mutex_lock(&table_lock);
+  fs_name_release(e->name_ref, e->name_len);
+  e->used = ENTRY_FREE;
+  e->dir = NULL;
+  e->hash_next = ent_free;
+  ent_free = idx;
+  ent_live--;
+  fs_meta_links(idx);
+  pthread_mutex_unlock(&table_lock);
+}
+
+// FNV-1a over the name
+static unsigned int fs_name_hash(const char *name) {
+  unsigned int h = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    h ^= *p;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static struct fs_dir *fs_dir_new(void) {
+  struct fs_dir *d = calloc(1, sizeof(*d));
+  if (!d)
+    return NULL;
+  d->buckets = malloc(DIR_BUCKETS_MIN * sizeof(*d->buckets));
+  if (!d->buckets) {
+    free(d);
+    return NULL;
+  }
+  for (int i = 0; i < DIR_BUCKETS_MIN; i++)
+    d->buckets[i] = -1;
+  d->nbuckets = DIR_BUCKETS_MIN;
+  d->first_child = -1;
+  d->last_child = -1;
+  d->loaded = 1;
+  pthread_rwlock_init(&d->lock, NULL);
+  atomic_init(&d->refs, 0);
+  return d;
+}
+
+void fs_dir_free(struct fs_dir *d) {
+  if (!d)
+    return;
+  pthread_rwlock_destroy(&d->lock);
+  free(d->buckets);
+  free(d);
+}
+
+// double the bucket array and rechain every child
+static void fs_dir_grow(struct fs_dir *d) {
+  int nb = d->nbuckets * 2;
+  int *b = malloc((size_t)nb * sizeof(*b));
+  if (!b)
+    return; // keep the longer chains, still correct
+  for (int i = 0; i < nb; i++)
+    b[i] = -1;
+
+  for (int i = d->first_child; i >= 0; i = fs_ent(i)->next_sibling) {
+    struct fs_entry *e = fs_ent(i);
+    unsigned int slot = e->name_hash & (unsigned int)(nb - 1);
+    e->hash_next = b[slot];
+    b[slot] = i;
+  }
+
+  free(d->buckets);
+  d->buckets = b;
+  d->nbuckets = nb;
+}
+
+// link idx into parent's index; caller holds parent's lock exclusive
+static void fs_dir_link(int parent, int idx) {
+  struct fs_dir *d = fs_ent(parent)->dir;
+  struct fs_entry *e = fs_ent(idx);
+
+  unsigned int slot = e->name_hash & (unsigned int)(d->nbuckets - 1);
+  e->hash_next = d->buckets[slot];
+  d->buckets[slot] = idx;
+
+  e->prev_sibling = d->last_child;
+  e->next_sibling = -1;
+  if (d->last_child >= 0)
+    fs_ent(d->last_child)->next_sibling = idx;
+  else
+    d->first_child = idx;
+  d->last_child = idx;
+
+  if (++d->nchildren > d->nbuckets)
+    fs_dir_grow(d);
+
+  fs_meta_links(idx);
+  if (e->prev_sibling >= 0)
+    fs_meta_links(e->prev_sibling);
+  fs_meta_data(parent);
+}
+
+// unlink idx from parent's index; caller holds parent's lock exclusive
+void fs_dir_unlink(int parent, int idx) {
+  struct fs_dir *d = fs_ent(parent)->dir;
+  struct fs_entry *e = fs_ent(idx);
+
+  int *pp = &d->buckets[e->name_hash & (unsigned int)(d->nbuckets - 1)];
+  while (*pp != idx)
+    pp = &fs_ent(*pp)->hash_next;
+  *pp = e->hash_next;
+
+  if (e->prev_sibling >= 0)
+    fs_ent(e->prev_sibling)->next_sibling = e->next_sibling;
+  else
+    d->first_child = e->next_sibling;
+  if (e->next_sibling >= 0)
+    fs_ent(e->next_sibling)->prev_sibling = e->prev_sibling;
+  else
+    d->last_child = e->prev_sibling;
+
+  d->nchildren--;
+  if (e->prev_sibling >= 0)
+    fs_meta_links(e->prev_sibling);
+  if (e->next_sibling >= 0)
+    fs_meta_links(e->next_sibling);
+  fs_meta_data(parent);
+}
+
+// fill a fresh inode and link it into parent; caller holds parent's lock
+int fs_publish_entry(int idx, int is_dir, int parent) {
+  struct fs_entry *e = fs_ent(idx);
+  e->is_dir = (unsigned char)is_dir;
+  e->parent = parent;
+  e->nruns = 0;
+  e->nblocks = 0;
+  atomic_store(&e->size, 0);
+  e->name_hash = fs_name_hash(fs_name(e));
+  e->dir = NULL;
+  if (is_dir) {
+    e->dir = fs_dir_new();
+    if (!e->dir) {
+      fs_free_entry(idx);
+      return -1;
+    }
+    e->dir->group = fs_pick_group();
+  }
+  e->store = STORE_BLOCKS;
+  fs_meta_data(idx);
+  fs_dir_link(parent, idx);
+  return 0;
+}
+
+// find entry by name / type / parent; caller holds parent's lock
+int fs_find(const char *name, int is_dir, int parent) {
+  struct fs_dir *d = fs_ent(parent)->dir;
+  if (!d)
+    return -1;
+
+  size_t len = strlen(name);
+  unsigned int h = fs_name_hash(name);
+  for (int i = d->buckets[h & (unsigned int)(d->nbuckets - 1)]; i >= 0;
+       i = fs_ent(i)->hash_next) {
+    struct fs_entry *e = fs_ent(i);
+    if (e->name_hash != h || e->is_dir != is_dir || e->name_len != len)
+      continue;
+    if (memcmp(fs_name(e), name, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// drop every inode, directory and name; caller holds fs_lock exclusive
+static void fs_release_all(void) {
+  for (int i = 0; i < ent_hwm; i++) {
+    if (!ent_chunks[i >> ENTRY_CHUNK_BITS]) {
+      i |= ENTRY_CHUNK - 1; // never loaded
+      continue;
+    }
+    struct fs_entry *e = fs_ent(i);
+    if (e->used != ENTRY_LIVE)
+      continue;
+    if (e->is_dir)
+      fs_dir_free(e->dir);
+    else if (e->nruns > 1)
+      free(e->runs);
+  }
+  for (int c = 0; c < MAX_ENTRY_CHUNKS; c++) {
+    free(ent_chunks[c]);
+    ent_chunks[c] = NULL;
+  }
+  for (unsigned int c = 0; c < MAX_NAME_CHUNKS && name_chunks[c]; c++) {
+    free(name_chunks[c]);
+    name_chunks[c] = NULL;
+  }
+
+  fs_delay_reset();
+
+  ent_hwm = 0;
+  ent_free = -1;
+  ent_live = 0;
+  name_top = 0;
+  for (int i = 0; i <= NAME_CLASSES; i++)
+    name_free[i] = NAME_NONE;
+}
+
+/*
+ * Make an empty filesystem on disk: a fresh superblock, bitmap and
+ * journal and a root directory, written before returning. The inode
+ * table is not cleared. Caller holds fs_lock exclusive.
+ */
+int fs_format(void) {
+  fs_release_all();
+  cache_reset();
+
+  int ninodes = inodes_opt ? inodes_opt : total_blocks / INODE_RATIO;
+  if (ninodes > MAX_FILES)
+    ninodes = MAX_FILES;
+  int jblocks = jnl_opt ? jnl_opt : total_blocks / JNL_RATIO;
+  if (jblocks < JNL_MIN)
+    jblocks = JNL_MIN;
+  if (jblocks > JNL_MAX)
+    jblocks = JNL_MAX;
+  if (fs_layout(ninodes, jblocks) < 0) {
+    fprintf(stderr, "disk too small for %d inodes\n", ninodes);
+    return -1;
+  }
+  if (fs_free_space_reset() < 0 || fs_meta_reset() < 0)
+    return -1;
+
+  if (fs_jnl_format() < 0)
+    return -1;
+  itab_hwm0 = 0;
+  sb.ent_hwm = -1; // make the first write-back store the superblock
+
+  // the metadata area is never handed out; every bitmap block goes out
+  pthread_mutex_lock(&alloc_lock);
+  bm_mark(0, sb.data_start, 1);
+  if (alloc_policy != ALLOC_BITMAP) {
+    struct fs_extent *x = ext_find_at(0);
+    if (x)
+      ext_carve(x, sb.data_start);
+  }
+  memset(bm_dirty, 0xff, (size_t)(sb.bm_blocks + 63) / 64 * sizeof(*bm_dirty));
+  pthread_mutex_unlock(&alloc_lock);
+
+  // the root is the first inode handed out, so it lands at index 0
+  int root = fs_alloc_entry("/");
+  if (root != 0)
+    return -1;
+  struct fs_entry *e = fs_ent(root);
+  e->is_dir = 1;
+  e->parent = 0;
+  e->prev_sibling = -1;
+  e->next_sibling = -1;
+  e->nruns = 0;
+  e->nblocks = 0;
+  e->size = 0;
+  e->dir = fs_dir_new();
+  if (!e->dir)
+    return -1;
+  fs_group_count(0, 1);
+  e->name_hash = fs_name_hash(fs_name(e));
+  fs_meta_links(root);
+  fs_meta_data(root);
+
+  atomic_fetch_add(&fs_epoch, 1); // every session falls back to root
+  if (fs_jnl_commit() < 0 || fs_jnl_checkpoint(1) < 0)
+    return -1;
+  return 0;
+}
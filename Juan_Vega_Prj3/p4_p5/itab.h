@@ -0,0 +1,56 @@
+#ifndef ITAB_H
+#define ITAB_H
+
+#include "fs.h"
+
+// inode slab: fixed directory of chunks, so entries never move
+#define ENTRY_CHUNK_BITS 12
+#define ENTRY_CHUNK (1 << ENTRY_CHUNK_BITS) // entries per chunk
+#ifndef MAX_FILES
+#define MAX_FILES (1 << 24)
+#endif
+#define MAX_ENTRY_CHUNKS ((MAX_FILES + ENTRY_CHUNK - 1) / ENTRY_CHUNK)
+
+// name arena: names and inline file data live in 8-byte-aligned slots
+// of 64 KB chunks
+#define NAME_CHUNK_BITS 16
+#define NAME_CHUNK (1u << NAME_CHUNK_BITS)
+#define MAX_NAME_CHUNKS (1u << 16) // 4 GB of names, addressed by a uint32
+#define NAME_ALIGN 8
+#define NAME_CLASSES (INLINE_MAX / NAME_ALIGN) // slot sizes 8, 16, .., 120
+#define NAME_NONE 0xffffffffu
+
+extern struct fs_entry *ent_chunks[MAX_ENTRY_CHUNKS];
+extern char *name_chunks[MAX_NAME_CHUNKS];
+extern pthread_mutex_t table_lock;
+extern int inodes_opt;
+extern uint64_t *itab_loaded;
+extern int ent_hwm;
+extern int ent_free;
+extern int ent_live;
+
+int fs_dir_load(int idx);
+int fs_mount(void);
+unsigned int fs_arena_alloc(size_t bytes);
+void fs_arena_release(unsigned int ref, size_t size);
+int fs_alloc_entry(const char *name);
+void fs_free_entry(int idx);
+void fs_dir_free(struct fs_dir *d);
+void fs_dir_unlink(int parent, int idx);
+int fs_publish_entry(int idx, int is_dir, int parent);
+int fs_find(const char *name, int is_dir, int parent);
+int fs_format(void);
+
+static inline struct fs_entry *fs_ent(int idx) {
+  return &ent_chunks[idx >> ENTRY_CHUNK_BITS][idx & (ENTRY_CHUNK - 1)];
+}
+
+static inline char *fs_arena_ptr(unsigned int ref) {
+  return name_chunks[ref >> NAME_CHUNK_BITS] + (ref & (NAME_CHUNK - 1));
+}
+
+static inline const char *fs_name(const struct fs_entry *e) {
+  return fs_arena_ptr(e->name_ref);
+}
+
+#endif
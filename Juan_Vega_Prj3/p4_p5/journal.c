@@ -0,0 +1,767 @@
+#include "alloc.h"
+#include "cache.h"
+#include "disk.h"
+#include "file.h"
+#include "flusher.h"
+#include "itab.h"
+#include "journal.h"
+
+/*
+ * The journal: a disk_jsuper, then transactions back to back, the first
+ * numbered disk_jsuper.seq. A commit writes every changed metadata block
+ * as one disk_txn of records (block number, byte count, bytes) before
+ * any goes home through the cache. A checkpoint syncs the cache and
+ * starts the journal over. Mounting replays transactions in order up to
+ * the first that does not check out.
+ */
+#define JNL_MAGIC "VEGAJNL"
+#define TXN_MAGIC 0x4e584a56u // "VJXN"
+#define TXN_REC 6 // record header: block number, then bytes kept
+
+struct disk_jsuper {
+  char magic[8];
+  uint32_t id;  // made by F; a transaction of another filesystem is stale
+  uint32_t seq; // of the transaction right after this block
+};
+
+struct disk_txn {
+  uint32_t magic;
+  uint32_t id;
+  uint32_t seq;
+  int32_t nblocks; // this header and the records after it
+  uint32_t sum;    // FNV-1a over the nblocks, with sum itself zero
+  int32_t nrec;
+};
+
+// a metadata block image waiting for the next commit
+struct meta_blk {
+  struct meta_blk *next; // hash chain
+  int blk;
+  int len; // bytes up to the last nonzero one
+  unsigned char data[BLOCK_SIZE];
+};
+
+struct disk_super sb; // layout, and the counts last written
+int jnl_urgent = 0;   // transaction is big, commit now; delay_lock
+int jnl_opt = 0;      // --journal for the next F, 0 = by ratio
+
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t meta_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct meta_blk **meta_buckets = NULL; // changed blocks by number
+static int meta_nbuckets = 0;                 // power of two
+static int meta_count = 0;
+static long meta_bytes = 0; // records they make, TXN_REC + len each
+static uint64_t *meta_redo = NULL; // inode halves to encode again, see
+static int meta_nredo = 0;         // fs_meta_queue; under meta_lock
+static pthread_mutex_t jnl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jnl_idle = PTHREAD_COND_INITIALIZER; // handles / close
+static int jnl_handles = 0; // operations in the running transaction
+static int jnl_closing = 0; // a commit is waiting for them to leave
+static uint32_t jnl_id = 0;  // the rest under meta_flush_lock
+static uint32_t jnl_seq = 0; // of the next transaction
+static int jnl_head = 0;     // where it goes, past the disk_jsuper
+static struct fs_run *jnl_defer = NULL; // freed extents, see fs_free_ext
+static int jnl_ndefer = 0;              // under meta_lock
+static int jnl_defer_cap = 0;
+static int jnl_defer_done = 0; // of those, freed by a committed transaction
+
+static void fs_meta_redo(int idx, int h);
+
+// layout for ninodes inodes and a journal of at least jblocks; -1 if the
+// disk is too small
+int fs_layout(int ninodes, int jblocks) {
+  memset(&sb, 0, sizeof(sb));
+  memcpy(sb.magic, SUPER_MAGIC, sizeof(sb.magic));
+  sb.total_blocks = total_blocks;
+  sb.ninodes = (ninodes + ITAB_PAGE - 1) / ITAB_PAGE * ITAB_PAGE;
+  sb.bm_start = 1;
+  sb.bm_blocks = (total_blocks + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+  // the journal also takes the rest of the page the bitmap ends in
+  sb.jnl_start = sb.bm_start + sb.bm_blocks;
+  sb.itab_start = (sb.jnl_start + jblocks + CACHE_PAGE_BLOCKS - 1) /
+                  CACHE_PAGE_BLOCKS * CACHE_PAGE_BLOCKS;
+  sb.jnl_blocks = sb.itab_start - sb.jnl_start;
+  long long end = sb.itab_start + (long long)sb.ninodes * INODE_BLOCKS;
+  if (end >= total_blocks)
+    return -1;
+  sb.data_start = (int)end;
+  sb.ent_free = -1;
+  return 0;
+}
+
+// drop pending blocks and size the dirty and loaded maps for sb
+int fs_meta_reset(void) {
+  for (int i = 0; i < meta_nbuckets; i++) {
+    while (meta_buckets[i]) {
+      struct meta_blk *m = meta_buckets[i];
+      meta_buckets[i] = m->next;
+      free(m);
+    }
+  }
+  meta_count = 0;
+  meta_bytes = 0;
+  meta_nredo = 0;
+  jnl_ndefer = 0;
+  jnl_defer_done = 0;
+  if (!meta_buckets) {
+    meta_nbuckets = 1024;
+    meta_buckets = calloc((size_t)meta_nbuckets, sizeof(*meta_buckets));
+    if (!meta_buckets)
+      return -1;
+  }
+
+  free(bm_dirty);
+  free(itab_loaded);
+  free(meta_redo);
+  bm_dirty = calloc((size_t)(sb.bm_blocks + 63) / 64, sizeof(*bm_dirty));
+  int pages = sb.ninodes / ITAB_PAGE;
+  itab_loaded = calloc((size_t)(pages + 63) / 64, sizeof(*itab_loaded));
+  meta_redo = calloc((size_t)(sb.ninodes * 2 + 63) / 64, sizeof(*meta_redo));
+  return bm_dirty && itab_loaded && meta_redo ? 0 : -1;
+}
+
+// double the pending hash; caller holds meta_lock
+static void fs_meta_grow(void) {
+  int nb = meta_nbuckets * 2;
+  struct meta_blk **b = calloc((size_t)nb, sizeof(*b));
+  if (!b)
+    return; // longer chains, still correct
+  for (int i = 0; i < meta_nbuckets; i++) {
+    while (meta_buckets[i]) {
+      struct meta_blk *m = meta_buckets[i];
+      meta_buckets[i] = m->next;
+      m->next = b[m->blk & (nb - 1)];
+      b[m->blk & (nb - 1)] = m;
+    }
+  }
+  free(meta_buckets);
+  meta_buckets = b;
+  meta_nbuckets = nb;
+}
+
+/*
+ * Put a metadata block image in the running transaction, replacing an
+ * older image of the same block (or, if !replace, yielding to it).
+ * -1 if there is no memory for it: the caller marks what to encode
+ * again at commit, see fs_meta_redo, and nothing goes out unjournaled.
+ */
+static int fs_meta_queue(int blk, const void *data, int replace) {
+  const unsigned char *p = data;
+  int len = BLOCK_SIZE;
+  while (len > 0 && p[len - 1] == 0)
+    len--;
+
+  pthread_mutex_lock(&meta_lock);
+  struct meta_blk *m = meta_buckets[blk & (meta_nbuckets - 1)];
+  while (m && m->blk != blk)
+    m = m->next;
+  if (!m) {
+    m = malloc(sizeof(*m));
+    if (!m) {
+      pthread_mutex_unlock(&meta_lock);
+      return -1;
+    }
+    m->blk = blk;
+    m->len = 0;
+    m->next = meta_buckets[blk & (meta_nbuckets - 1)];
+    meta_buckets[blk & (meta_nbuckets - 1)] = m;
+    meta_bytes += TXN_REC;
+    if (++meta_count > meta_nbuckets)
+      fs_meta_grow();
+  } else if (!replace) {
+    pthread_mutex_unlock(&meta_lock);
+    return 0;
+  }
+  meta_bytes += len - m->len;
+  m->len = len;
+  memcpy(m->data, data, BLOCK_SIZE);
+  pthread_mutex_unlock(&meta_lock);
+  return 0;
+}
+
+static int fs_meta_put(int blk, const void *data) {
+  return fs_meta_queue(blk, data, 1);
+}
+
+// give an image a failed commit took back to the running transaction
+static void fs_meta_requeue(struct meta_blk *m) {
+  pthread_mutex_lock(&meta_lock);
+  struct meta_blk **head = &meta_buckets[m->blk & (meta_nbuckets - 1)];
+  struct meta_blk *x = *head;
+  while (x && x->blk != m->blk)
+    x = x->next;
+  if (x) {
+    free(m); // a newer image is queued
+  } else {
+    m->next = *head;
+    *head = m;
+    meta_bytes += TXN_REC + m->len;
+    if (++meta_count > meta_nbuckets)
+      fs_meta_grow();
+  }
+  pthread_mutex_unlock(&meta_lock);
+}
+
+// half h (0 = links, 1 = contents) of inode idx to be encoded at commit
+static void fs_meta_redo(int idx, int h) {
+  int bit = idx * 2 + h;
+  pthread_mutex_lock(&meta_lock);
+  if (!(meta_redo[bit / 64] & (1ull << (bit % 64)))) {
+    meta_redo[bit / 64] |= 1ull << (bit % 64);
+    meta_nredo++;
+  }
+  pthread_mutex_unlock(&meta_lock);
+}
+
+// drop the images of blocks being freed from the running transaction
+static void fs_meta_forget(int first, int blocks) {
+  pthread_mutex_lock(&meta_lock);
+  for (int blk = first; blk < first + blocks; blk++) {
+    struct meta_blk **pp = &meta_buckets[blk & (meta_nbuckets - 1)];
+    while (*pp && (*pp)->blk != blk)
+      pp = &(*pp)->next;
+    if (*pp) {
+      struct meta_blk *m = *pp;
+      *pp = m->next;
+      meta_bytes -= TXN_REC + m->len;
+      free(m);
+      meta_count--;
+    }
+  }
+  pthread_mutex_unlock(&meta_lock);
+}
+
+int fs_meta_read(int blk, int n, unsigned char *buf) {
+  struct cache_read cr;
+  cache_read_begin(&cr, blk, n, buf, (size_t)n * BLOCK_SIZE);
+  return cache_read_end(&cr);
+}
+
+/*
+ * Queue inode idx's name-and-links block. Caller holds the parent's
+ * lock exclusive, or table_lock for an inode it just freed.
+ */
+void fs_meta_links(int idx) {
+  struct fs_entry *e = fs_ent(idx);
+  union {
+    struct disk_inode_a a;
+    unsigned char raw[BLOCK_SIZE];
+  } b;
+  memset(&b, 0, sizeof(b));
+  if (e->used == ENTRY_LIVE) {
+    b.a.used = 1;
+    b.a.is_dir = e->is_dir;
+    b.a.name_len = e->name_len;
+    b.a.parent = e->parent;
+    b.a.prev = e->prev_sibling;
+    b.a.next = e->next_sibling;
+    memcpy(b.a.name, fs_name(e), e->name_len);
+  } else {
+    b.a.next = e->hash_next;
+  }
+  if (fs_meta_put(sb.itab_start + idx * INODE_BLOCKS, b.raw) < 0)
+    fs_meta_redo(idx, 0);
+}
+
+/*
+ * Queue inode idx's contents block, and the out-of-line run list of a
+ * file with more runs than the inode holds. Caller holds the file lock
+ * exclusive, or a directory's own lock. A delayed file is recorded
+ * empty until it gets its blocks.
+ */
+void fs_meta_data(int idx) {
+  struct fs_entry *e = fs_ent(idx);
+  struct disk_inode_b b;
+  int lost = 0;
+  memset(&b, 0, sizeof(b));
+  if (e->is_dir) {
+    b.kids.first = e->dir->first_child;
+    b.kids.last = e->dir->last_child;
+    b.kids.count = e->dir->nchildren;
+    b.kids.group = e->dir->group;
+  } else if (e->store == STORE_INLINE) {
+    b.size = e->size;
+    b.nruns = INODE_INLINE;
+    if (b.size > 0)
+      memcpy(b.data, fs_arena_ptr(e->inl.ref), (size_t)b.size);
+  } else if (e->store == STORE_BLOCKS) {
+    struct fs_run *r = fs_runs(e);
+    b.size = e->size;
+    b.nruns = e->nruns;
+    if (e->nruns <= INODE_RUNS) {
+      memcpy(b.runs, r, (size_t)e->nruns * sizeof(*r));
+    } else {
+      struct fs_run ext = r[e->nruns]; // see fs_grow_file
+      b.runs[0] = ext;
+      int per = BLOCK_SIZE / (int)sizeof(*r);
+      for (int i = 0; i * per < e->nruns; i++) {
+        struct fs_run part[BLOCK_SIZE / sizeof(struct fs_run)];
+        int k = e->nruns - i * per < per ? e->nruns - i * per : per;
+        memset(part, 0, sizeof(part));
+        memcpy(part, r + i * per, (size_t)k * sizeof(*r));
+        lost |= fs_meta_put(ext.first + i, part) < 0;
+      }
+    }
+  }
+  lost |= fs_meta_put(sb.itab_start + idx * INODE_BLOCKS + 1, &b) < 0;
+  if (lost)
+    fs_meta_redo(idx, 1);
+}
+
+static int fs_meta_blk_cmp(const void *a, const void *b) {
+  int x = (*(struct meta_blk *const *)a)->blk;
+  int y = (*(struct meta_blk *const *)b)->blk;
+  return (x > y) - (x < y);
+}
+
+// FNV-1a, as fs_name_hash, over a journal block range
+static uint32_t fs_jnl_sum(const unsigned char *p, size_t n) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < n; i++) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// the next transaction will start the journal
+static int fs_jnl_write_super(void) {
+  union {
+    struct disk_jsuper j;
+    unsigned char raw[BLOCK_SIZE];
+  } b;
+  memset(&b, 0, sizeof(b));
+  memcpy(b.j.magic, JNL_MAGIC, sizeof(b.j.magic));
+  b.j.id = jnl_id;
+  b.j.seq = jnl_seq;
+  return disk_write_run(sb.jnl_start, 1, b.raw, BLOCK_SIZE);
+}
+
+// a new id: no transaction left in the journal checks out against it
+int fs_jnl_format(void) {
+  struct disk_jsuper old;
+  unsigned char raw[BLOCK_SIZE];
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  jnl_id = (uint32_t)now.tv_sec * 2654435761u ^ (uint32_t)now.tv_nsec;
+  if (disk_read_run(sb.jnl_start, 1, raw, BLOCK_SIZE) == 0) {
+    memcpy(&old, raw, sizeof(old));
+    if (memcmp(old.magic, JNL_MAGIC, sizeof(old.magic)) == 0)
+      jnl_id = old.id + 1;
+  }
+  jnl_seq = 1;
+  jnl_head = 0;
+  return fs_jnl_write_super();
+}
+
+/*
+ * Join the running transaction, so that a commit takes all of this
+ * operation's metadata changes or none of them. Called with the
+ * operation's directory and file locks held and no leaf lock; its
+ * fs_meta_links, fs_meta_data and freed blocks all come before
+ * fs_jnl_end. A transaction that has grown to half the journal is
+ * committed first, by whoever joins next.
+ */
+void fs_jnl_begin(void) {
+  long full = (long)(sb.jnl_blocks - 1) * BLOCK_SIZE / 2;
+  int tried = 0;
+  pthread_mutex_lock(&jnl_lock);
+  while (1) {
+    while (jnl_closing)
+      pthread_cond_wait(&jnl_idle, &jnl_lock);
+    pthread_mutex_lock(&meta_lock);
+    long bytes = meta_bytes;
+    pthread_mutex_unlock(&meta_lock);
+    if (bytes < full || tried)
+      break;
+    pthread_mutex_unlock(&jnl_lock);
+    fs_jnl_commit(); // a failure leaves it to the flusher
+    tried = 1;
+    pthread_mutex_lock(&jnl_lock);
+  }
+  jnl_handles++;
+  pthread_mutex_unlock(&jnl_lock);
+}
+
+// leave the running transaction; past a quarter journal, wake the flusher
+void fs_jnl_end(void) {
+  pthread_mutex_lock(&jnl_lock);
+  if (--jnl_handles == 0 && jnl_closing)
+    pthread_cond_broadcast(&jnl_idle);
+  pthread_mutex_unlock(&jnl_lock);
+
+  pthread_mutex_lock(&meta_lock);
+  int big = meta_bytes >= (long)(sb.jnl_blocks - 1) * BLOCK_SIZE / 4;
+  pthread_mutex_unlock(&meta_lock);
+  if (big) {
+    pthread_mutex_lock(&delay_lock);
+    if (!jnl_urgent) {
+      jnl_urgent = 1;
+      pthread_cond_signal(&delay_kick);
+    }
+    pthread_mutex_unlock(&delay_lock);
+  }
+}
+
+/*
+ * Make every transaction in the journal redundant: sync the cache,
+ * which committed blocks were written to, and start the journal over.
+ * Extents freed by committed transactions are handed out from here on.
+ * Caller holds meta_flush_lock.
+ */
+static int fs_jnl_checkpoint_locked(void) {
+  if (cache_sync() < 0 || fs_jnl_write_super() < 0)
+    return -1;
+  jnl_head = 0;
+
+  pthread_mutex_lock(&meta_lock);
+  int n = jnl_defer_done;
+  struct fs_run *runs = n > 0 ? malloc((size_t)n * sizeof(*runs)) : NULL;
+  if (runs) {
+    memcpy(runs, jnl_defer, (size_t)n * sizeof(*runs));
+    memmove(jnl_defer, jnl_defer + n,
+            (size_t)(jnl_ndefer - n) * sizeof(*runs));
+    jnl_ndefer -= n;
+    jnl_defer_done = 0;
+  }
+  pthread_mutex_unlock(&meta_lock);
+  for (int i = 0; runs && i < n; i++)
+    fs_free_blocks(runs[i].first, runs[i].len);
+  free(runs);
+  return 0;
+}
+
+// checkpoint once the journal is half full, or extents wait on it
+int fs_jnl_checkpoint(int force) {
+  pthread_mutex_lock(&meta_flush_lock);
+  pthread_mutex_lock(&meta_lock);
+  int freed = jnl_defer_done > 0;
+  pthread_mutex_unlock(&meta_lock);
+  int rc = 0;
+  if (force || freed || jnl_head > (sb.jnl_blocks - 1) / 2)
+    rc = fs_jnl_checkpoint_locked();
+  pthread_mutex_unlock(&meta_flush_lock);
+  return rc;
+}
+
+/*
+ * Commit, checkpoint and commit again: extents fs_free_ext held back
+ * for what is committed now are free, in the bitmap on disk too.
+ * Caller holds fs_lock shared and no handle.
+ */
+int fs_jnl_release(void) {
+  if (fs_jnl_commit() < 0 || fs_jnl_checkpoint(0) < 0 || fs_jnl_commit() < 0)
+    return -1;
+  return 0;
+}
+
+// out of space: 1 if extents were held back and now are free to retry
+int fs_jnl_reclaim(void) {
+  pthread_mutex_lock(&meta_lock);
+  int held = jnl_ndefer > 0;
+  pthread_mutex_unlock(&meta_lock);
+  return held && fs_jnl_release() == 0;
+}
+
+/*
+ * Append a transaction of cnt blocks, sorted, to the journal, after a
+ * checkpoint if it does not fit behind the last one. 1 if it is too
+ * big for the journal at all and was not written. Caller holds
+ * meta_flush_lock.
+ */
+static int fs_jnl_log(struct meta_blk **list, int cnt) {
+  size_t bytes = sizeof(struct disk_txn);
+  for (int i = 0; i < cnt; i++)
+    bytes += TXN_REC + (size_t)list[i]->len;
+  int nblocks = (int)((bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
+  int room = sb.jnl_blocks - 1;
+  if (nblocks > room)
+    return 1;
+  if (jnl_head + nblocks > room && fs_jnl_checkpoint_locked() < 0)
+    return -1;
+
+  unsigned char *buf = calloc((size_t)nblocks, BLOCK_SIZE);
+  if (!buf)
+    return -1;
+  unsigned char *p = buf + sizeof(struct disk_txn);
+  for (int i = 0; i < cnt; i++) {
+    int32_t blk = list[i]->blk;
+    uint16_t len = (uint16_t)list[i]->len;
+    memcpy(p, &blk, sizeof(blk));
+    memcpy(p + sizeof(blk), &len, sizeof(len));
+    memcpy(p + TXN_REC, list[i]->data, len);
+    p += TXN_REC + len;
+  }
+  struct disk_txn t = {TXN_MAGIC, jnl_id, jnl_seq, nblocks, 0, cnt};
+  memcpy(buf, &t, sizeof(t));
+  t.sum = fs_jnl_sum(buf, (size_t)nblocks * BLOCK_SIZE);
+  memcpy(buf, &t, sizeof(t));
+
+  int rc = disk_write_run(sb.jnl_start + 1 + jnl_head, nblocks, buf,
+                          (size_t)nblocks * BLOCK_SIZE);
+  free(buf);
+  if (rc < 0)
+    return -1;
+  jnl_head += nblocks;
+  jnl_seq++;
+  return 0;
+}
+
+/*
+ * Encode again the inode halves fs_meta_queue had no memory for; -1 if
+ * some still have none. Caller commits, with every handle out.
+ */
+static int fs_meta_redo_all(void) {
+  int words = (sb.ninodes * 2 + 63) / 64;
+  pthread_mutex_lock(&meta_lock);
+  for (int w = 0; meta_nredo > 0 && w < words; w++) {
+    uint64_t bits = meta_redo[w];
+    meta_redo[w] = 0;
+    meta_nredo -= __builtin_popcountll(bits);
+    pthread_mutex_unlock(&meta_lock);
+    for (; bits; bits &= bits - 1) {
+      int bit = w * 64 + __builtin_ctzll(bits);
+      if (bit % 2 == 0)
+        fs_meta_links(bit / 2);
+      else if (fs_ent(bit / 2)->used == ENTRY_LIVE)
+        fs_meta_data(bit / 2);
+    }
+    pthread_mutex_lock(&meta_lock);
+  }
+  int left = meta_nredo;
+  pthread_mutex_unlock(&meta_lock);
+  return left > 0 ? -1 : 0;
+}
+
+/*
+ * Commit the running transaction once its operations have left, with
+ * the changed bitmap blocks and superblock; new operations start the
+ * next one meanwhile. File data is synced first, then the blocks go to
+ * the journal in one write and home through the cache. Caller holds
+ * fs_lock.
+ */
+int fs_jnl_commit(void) {
+  pthread_mutex_lock(&meta_flush_lock);
+  pthread_mutex_lock(&jnl_lock);
+  jnl_closing = 1;
+  while (jnl_handles > 0)
+    pthread_cond_wait(&jnl_idle, &jnl_lock);
+  pthread_mutex_unlock(&jnl_lock);
+
+  int lost = fs_meta_redo_all() < 0;
+  pthread_mutex_lock(&table_lock);
+  int sb_changed = sb.ent_hwm != ent_hwm || sb.ent_free != ent_free ||
+                   sb.ent_live != ent_live;
+  sb.ent_hwm = ent_hwm;
+  sb.ent_free = ent_free;
+  sb.ent_live = ent_live;
+  unsigned char sb_raw[BLOCK_SIZE] = {0};
+  memcpy(sb_raw, &sb, sizeof(sb));
+  if (sb_changed && fs_meta_put(0, sb_raw) < 0) {
+    sb.ent_hwm = -1; // store it next time
+    lost = 1;
+  }
+  pthread_mutex_unlock(&table_lock);
+
+  pthread_mutex_lock(&alloc_lock);
+  size_t bm_bytes = (size_t)bm_nwords * sizeof(*bm_words);
+  for (int k = 0; k < sb.bm_blocks; k++) {
+    if (!(bm_dirty[k / 64] & (1ull << (k % 64))))
+      continue;
+    unsigned char raw[BLOCK_SIZE] = {0};
+    size_t off = (size_t)k * BLOCK_SIZE;
+    size_t n = bm_bytes - off < BLOCK_SIZE ? bm_bytes - off : BLOCK_SIZE;
+    memcpy(raw, (unsigned char *)bm_words + off, n);
+    if (fs_meta_put(sb.bm_start + k, raw) == 0)
+      bm_dirty[k / 64] &= ~(1ull << (k % 64));
+    else
+      lost = 1;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+
+  // short of memory for an image: keep it all for the next try
+  pthread_mutex_lock(&meta_lock);
+  int cnt = 0;
+  struct meta_blk **list = !lost && meta_count > 0
+                               ? malloc((size_t)meta_count * sizeof(*list))
+                               : NULL;
+  int ok = !lost && (meta_count == 0 || list);
+  for (int i = 0; ok && i < meta_nbuckets; i++) {
+    for (struct meta_blk *m = meta_buckets[i]; m; m = m->next)
+      list[cnt++] = m;
+    meta_buckets[i] = NULL;
+  }
+  if (ok) {
+    meta_count = 0;
+    meta_bytes = 0;
+  }
+  int nfreed = jnl_ndefer - jnl_defer_done; // extents freed in it
+  pthread_mutex_unlock(&meta_lock);
+
+  pthread_mutex_lock(&jnl_lock);
+  jnl_closing = 0;
+  pthread_cond_broadcast(&jnl_idle);
+  pthread_mutex_unlock(&jnl_lock);
+  if (!ok) {
+    pthread_mutex_unlock(&meta_flush_lock);
+    return -1;
+  }
+
+  qsort(list, (size_t)cnt, sizeof(*list), fs_meta_blk_cmp);
+  int rc = cnt > 0 ? cache_sync() : 0;
+  int logged = rc == 0 && cnt > 0 ? fs_jnl_log(list, cnt) : 0;
+  if (logged == 1)
+    fprintf(stderr, "journal too small for %d blocks, written in place\n",
+            cnt);
+  if (rc < 0 || logged < 0) {
+    for (int i = 0; i < cnt; i++)
+      fs_meta_requeue(list[i]);
+    free(list);
+    pthread_mutex_unlock(&meta_flush_lock);
+    return -1;
+  }
+  pthread_mutex_lock(&meta_lock);
+  jnl_defer_done += nfreed;
+  pthread_mutex_unlock(&meta_lock);
+
+  unsigned char *buf = cnt > 0 ? malloc((size_t)META_RUN * BLOCK_SIZE) : NULL;
+  for (int i = 0; i < cnt;) {
+    int n = 1;
+    while (buf && i + n < cnt && n < META_RUN &&
+           list[i + n]->blk == list[i]->blk + n)
+      n++;
+    int wrc;
+    if (buf) {
+      for (int j = 0; j < n; j++)
+        memcpy(buf + (size_t)j * BLOCK_SIZE, list[i + j]->data, BLOCK_SIZE);
+      wrc = cache_write_run(list[i]->blk, n, buf, (size_t)n * BLOCK_SIZE);
+    } else {
+      wrc = cache_write_run(list[i]->blk, 1, list[i]->data, BLOCK_SIZE);
+    }
+    for (int j = 0; j < n; j++) {
+      if (wrc < 0)
+        fs_meta_requeue(list[i + j]);
+      else
+        free(list[i + j]);
+    }
+    if (wrc < 0)
+      rc = -1;
+    i += n;
+  }
+  if (logged == 1 && cache_sync() < 0)
+    rc = -1;
+  free(buf);
+  free(list);
+  pthread_mutex_unlock(&meta_flush_lock);
+  return rc;
+}
+
+/*
+ * Check one transaction's records, and with write set copy them to
+ * their homes through the cache. -1 if a record is malformed or a
+ * write fails.
+ */
+static int fs_jnl_apply(const unsigned char *t, size_t bytes, int nrec,
+                        int write) {
+  size_t off = sizeof(struct disk_txn);
+  for (int i = 0; i < nrec; i++) {
+    int32_t blk;
+    uint16_t len;
+    if (off + TXN_REC > bytes)
+      return -1;
+    memcpy(&blk, t + off, sizeof(blk));
+    memcpy(&len, t + off + sizeof(blk), sizeof(len));
+    off += TXN_REC;
+    if (len > BLOCK_SIZE || off + len > bytes || blk < 0 ||
+        blk >= total_blocks ||
+        (blk >= sb.jnl_start && blk < sb.jnl_start + sb.jnl_blocks))
+      return -1;
+    if (write) {
+      unsigned char img[BLOCK_SIZE] = {0};
+      memcpy(img, t + off, len);
+      if (cache_write_run(blk, 1, img, BLOCK_SIZE) < 0)
+        return -1;
+    }
+    off += len;
+  }
+  return 0;
+}
+
+/*
+ * Replay the journal onto the disk and start it over: every
+ * transaction from disk_jsuper.seq on that is whole and ours, in
+ * order. Returns how many, or -1 on a disk error or a journal that
+ * was never made.
+ */
+int fs_jnl_replay(void) {
+  size_t bytes = (size_t)sb.jnl_blocks * BLOCK_SIZE;
+  unsigned char *buf = malloc(bytes);
+  if (!buf || disk_read_run(sb.jnl_start, sb.jnl_blocks, buf, bytes) < 0) {
+    free(buf);
+    return -1;
+  }
+  struct disk_jsuper j;
+  memcpy(&j, buf, sizeof(j));
+  if (memcmp(j.magic, JNL_MAGIC, sizeof(j.magic)) != 0) {
+    free(buf);
+    return -1;
+  }
+  jnl_id = j.id;
+  jnl_seq = j.seq;
+
+  int n = 0;
+  int rc = 0;
+  int room = sb.jnl_blocks - 1;
+  for (int pos = 0; pos < room;) {
+    unsigned char *t = buf + (size_t)(1 + pos) * BLOCK_SIZE;
+    struct disk_txn h;
+    memcpy(&h, t, sizeof(h));
+    if (h.magic != TXN_MAGIC || h.id != jnl_id || h.seq != jnl_seq ||
+        h.nblocks < 1 || h.nblocks > room - pos)
+      break;
+    size_t len = (size_t)h.nblocks * BLOCK_SIZE;
+    struct disk_txn z = h;
+    z.sum = 0;
+    memcpy(t, &z, sizeof(z));
+    if (fs_jnl_sum(t, len) != h.sum || fs_jnl_apply(t, len, h.nrec, 0) < 0)
+      break;
+    if (fs_jnl_apply(t, len, h.nrec, 1) < 0) {
+      rc = -1;
+      break;
+    }
+    pos += h.nblocks;
+    jnl_seq++;
+    n++;
+  }
+  free(buf);
+
+  jnl_seq++; // whatever stopped the replay is never expected again
+  jnl_head = 0;
+  if (rc == 0 && (cache_sync() < 0 || fs_jnl_write_super() < 0))
+    rc = -1;
+  return rc < 0 ? -1 : n;
+}
+
+/*
+ * Free blocks a committed inode pointed to. A replay could still write
+ * them or point at them, so they are handed out again only after the
+ * next checkpoint.
+ */
+void fs_free_ext(struct fs_run ext) {
+  fs_meta_forget(ext.first, ext.len);
+  pthread_mutex_lock(&meta_lock);
+  if (jnl_ndefer == jnl_defer_cap) {
+    int cap = jnl_defer_cap ? jnl_defer_cap * 2 : 64;
+    struct fs_run *bigger = realloc(jnl_defer, (size_t)cap * sizeof(ext));
+    if (bigger) {
+      jnl_defer = bigger;
+      jnl_defer_cap = cap;
+    }
+  }
+  int kept = jnl_ndefer < jnl_defer_cap;
+  if (kept)
+    jnl_defer[jnl_ndefer++] = ext;
+  pthread_mutex_unlock(&meta_lock);
+  if (!kept)
+    fs_free_blocks(ext.first, ext.len); // no memory to hold them back
+}
@@ -0,0 +1,25 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "fs.h"
+
+extern int jnl_urgent;
+extern int jnl_opt;
+extern struct disk_super sb;
+
+int fs_layout(int ninodes, int jblocks);
+int fs_meta_reset(void);
+int fs_meta_read(int blk, int n, unsigned char *buf);
+void fs_meta_links(int idx);
+void fs_meta_data(int idx);
+int fs_jnl_format(void);
+void fs_jnl_begin(void);
+void fs_jnl_end(void);
+int fs_jnl_checkpoint(int force);
+int fs_jnl_release(void);
+int fs_jnl_reclaim(void);
+int fs_jnl_commit(void);
+int fs_jnl_replay(void);
+void fs_free_ext(struct fs_run ext);
+
+#endif
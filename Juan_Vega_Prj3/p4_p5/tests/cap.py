@@ -0,0 +1,34 @@
+# Worker cap: with --max-workers CAP, connection CAP + 1 is answered 2
+# and closed, and a slot freed by a client that leaves is reused.
+# usage: cap.py CAP
+import socket, sys, time
+from fs import FS, FS_PORT
+
+cap = int(sys.argv[1])
+held = [FS() for _ in range(cap)]
+for c in held:
+    assert c.cmd("pwd") == "0 /"
+
+x = socket.create_connection(("127.0.0.1", FS_PORT))
+x.settimeout(5)
+reply = b""
+while True:
+    b = x.recv(16)
+    if not b:
+        break
+    reply += b
+assert reply == b"2\n", reply
+x.close()
+
+held.pop().close()
+for _ in range(50):
+    # the freed worker notices the close on its own time
+    y = FS()
+    y.s.settimeout(5)
+    r = y.cmd("pwd")
+    y.close()
+    if r == "0 /":
+        break
+    time.sleep(0.1)
+assert r == "0 /", r
+print("cap: ok")
@@ -0,0 +1,95 @@
+# Kill-and-remount check, run in two phases around a kill -9 of the
+# server.
+#   crash.py write STATE   build a tree, SYNC it, then change more files
+#                          without a SYNC and start a compaction
+#   crash.py check STATE   after the remount: everything synced is
+#                          intact, every unsynced file is whole in its
+#                          old or its new contents (or empty, if the new
+#                          ones were still in a delayed buffer), and the
+#                          tree works
+import os, pickle, random, sys
+from fs import FS
+
+DIRS = ["", "d1", "d1/d2", "d3"]
+SIZES = [0, 1, 50, 128, 129, 1000, 20000, 140000, 300000]
+INLINE_MAX = 120           # default --inline
+DELAY_FILE_MAX = 128 * 1024
+
+phase, path = sys.argv[1], sys.argv[2]
+a = FS()
+
+if phase == "write":
+    a.format()
+    rnd = random.Random(1)
+    synced, pending = {}, {}
+    for d in DIRS:
+        if d:
+            a.cd(os.path.dirname(d))
+            assert a.cmd(f"mkdir {os.path.basename(d)}") == "0"
+        a.cd(d)
+        for i in range(30):
+            n = f"f{i}"
+            data = os.urandom(rnd.choice(SIZES))
+            assert a.cmd(f"C {n}") == "0" and a.write(n, data) == "0"
+            synced[(d, n)] = data
+        # a file in many runs: appends interleaved with other allocations
+        data = b""
+        for k in range(40):
+            assert a.cmd(f"C tmp{k}") == "0"
+            assert a.write(f"tmp{k}", os.urandom(600)) == "0"
+            c = os.urandom(700)
+            assert a.cmd("C frag") in ("0", "1") and a.append("frag", c) == "0"
+            data += c
+            a.sync()
+        synced[(d, "frag")] = data
+        for k in range(40):
+            assert a.cmd(f"D tmp{k}") == "0"
+        for i in range(0, 30, 3):
+            assert a.cmd(f"D f{i}") == "0"
+            del synced[(d, f"f{i}")]
+        # patch a file in place
+        n = "f1"
+        old = synced[(d, n)]
+        off = len(old) // 2
+        patch = os.urandom(300)
+        assert a.write_at(n, off, patch) == "0"
+        synced[(d, n)] = old[:off] + patch + old[off + len(patch):]
+    a.sync()
+
+    # not synced: each file must come back as it was or as written here
+    for (d, n), data in list(synced.items())[::4]:
+        a.cd(d)
+        new = os.urandom(rnd.choice(SIZES))
+        assert a.write(n, new) == "0"
+        pending[(d, n)] = (synced.pop((d, n)), new)
+    assert a.cmd("COMPACT").startswith("0 ")
+    pickle.dump((synced, pending), open(path, "wb"))
+    print("crash: written", len(synced), len(pending))
+
+else:
+    synced, pending = pickle.load(open(path, "rb"))
+    for (d, n), data in synced.items():
+        a.cd(d)
+        assert a.read(n) == (0, data), (d, n, len(data))
+    for (d, n), (old, new) in pending.items():
+        a.cd(d)
+        rc, got = a.read(n)
+        # a delayed file is recorded empty until it gets its blocks
+        ok = [old, new]
+        if INLINE_MAX < len(new) <= DELAY_FILE_MAX:
+            ok.append(b"")
+        assert rc == 0 and got in ok, (d, n, rc, len(got))
+    for d in DIRS:
+        a.cd(d)
+        names = set(x.split()[0].rstrip("/") for x in a.ls())
+        want = set(n for (dd, n) in list(synced) + list(pending) if dd == d)
+        sub = set(os.path.basename(x) for x in DIRS
+                  if x and os.path.dirname(x) == d)
+        assert names == want | sub, (d, names ^ (want | sub))
+    # the remounted tree takes new writes
+    a.cd("")
+    assert a.read("f0")[0] == 1
+    assert a.cmd("C again") == "0" and a.write("again", b"hello") == "0"
+    a.sync()
+    assert a.read("again") == (0, b"hello")
+    print("crash: ok", len(synced) + len(pending))
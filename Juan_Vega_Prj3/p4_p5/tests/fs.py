@@ -0,0 +1,70 @@
+# Minimal client for the file system server's line protocol.
+import socket
+
+FS_PORT = 7790
+
+
+class FS:
+    def __init__(self, port=FS_PORT):
+        self.s = socket.create_connection(("127.0.0.1", port))
+        self.f = self.s.makefile("rb")
+
+    def close(self):
+        self.f.close()
+        self.s.close()
+
+    def line(self):
+        return self.f.readline().decode().rstrip("\n")
+
+    def cmd(self, c):
+        self.s.sendall((c + "\n").encode())
+        return self.line()
+
+    def sync(self):
+        # SYNC answers 2 while a commit cannot complete; retry until it does
+        while self.cmd("SYNC") != "0":
+            pass
+
+    def send(self, head, data):
+        # payload and its trailing newline follow the header when non-empty
+        self.s.sendall(head.encode() + b"\n" + (data + b"\n" if data else b""))
+        return self.line()
+
+    def write(self, name, data):
+        return self.send(f"W {name} {len(data)}", data)
+
+    def write_at(self, name, off, data):
+        return self.send(f"WA {name} {off} {len(data)}", data)
+
+    def append(self, name, data):
+        return self.send(f"APPEND {name} {len(data)}", data)
+
+    def _body(self):
+        rc, n = map(int, self.line().split())
+        if rc != 0:
+            return rc, None
+        d = self.f.read(n)
+        self.f.read(1)
+        return rc, d
+
+    def read(self, name):
+        self.s.sendall(f"R {name}\n".encode())
+        return self._body()
+
+    def read_at(self, name, off, ln):
+        self.s.sendall(f"RR {name} {off} {ln}\n".encode())
+        return self._body()
+
+    def ls(self, verbose=0):
+        self.s.sendall(f"L {verbose}\n".encode())
+        rc, n = map(int, self.line().split())
+        return [self.line() for _ in range(n)]
+
+    def format(self):
+        while self.cmd("F") != "0":
+            pass
+
+    def cd(self, path):
+        assert self.cmd("cd /") == "0"
+        for p in path.split("/") if path else []:
+            assert self.cmd(f"cd {p}") == "0", (path, p)
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Runs the file system server tests against a live disk_server on a
+# scratch image. Both servers use their fixed ports (7780, 7790), so
+# nothing else may hold them.
+# usage: run_tests.sh [file_system_server binary] [stress threads iters]
+# make test runs it on the normal build, make test-tsan on a
+# ThreadSanitizer one.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+top=$here/../..
+fs_bin=$(cd "$(dirname "${1:-$top/p4_p5/file_system_server}")" && pwd)
+fs_bin=$fs_bin/$(basename "${1:-file_system_server}")
+threads=${2:-6}
+iters=${3:-150}
+work=$(mktemp -d)
+ds_pid=
+fs_pid=
+
+stop() {
+  [ -n "$fs_pid" ] && kill $1 "$fs_pid" && wait "$fs_pid" 2>/dev/null || :
+  fs_pid=
+}
+cleanup() {
+  rc=$?
+  stop
+  [ $rc -eq 0 ] || tail -n 20 "$work/fs.log" >&2
+  [ -n "$ds_pid" ] && kill "$ds_pid" 2>/dev/null || :
+  rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+# wait until a port takes connections
+ready() {
+  i=0
+  until python3 -c "import socket
+socket.create_connection(('127.0.0.1', $1)).close()" 2>/dev/null; do
+    i=$((i + 1))
+    [ $i -lt 100 ] || { echo "port $1 never opened" >&2; exit 1; }
+    sleep 0.1
+  done
+}
+start() {
+  "$fs_bin" 127.0.0.1 "$@" >>"$work/fs.log" 2>&1 &
+  fs_pid=$!
+  ready 7790
+}
+
+"$top/p3/disk_server" 1024 128 0 "$work/disk.img" >"$work/ds.log" 2>&1 &
+ds_pid=$!
+ready 7780
+cd "$here"
+
+start
+python3 stress.py "$threads" "$iters"
+stop
+
+start
+python3 crash.py write "$work/crash.pkl"
+stop -9
+start
+python3 crash.py check "$work/crash.pkl"
+stop
+
+start 2 --max-workers 4
+python3 cap.py 4
+stop
+
+# a sanitizer build reports to the server's log
+if grep -q "Sanitizer" "$work/fs.log"; then
+  cat "$work/fs.log" >&2
+  exit 1
+fi
+echo "all tests passed"
@@ -0,0 +1,85 @@
+# Concurrent W / WA / APPEND / R / RR / D / SYNC / COMPACT against a
+# shadow copy of every file. Each thread owns its files, so any
+# difference is a server bug.
+# usage: stress.py [threads] [iterations]
+import os, random, sys, threading, traceback
+from fs import FS
+
+THREADS = int(sys.argv[1]) if len(sys.argv) > 1 else 4
+ITERS = int(sys.argv[2]) if len(sys.argv) > 2 else 300
+# inline, delayed, block-backed and streamed (> 256K) payloads
+SIZES = [0, 1, 100, 128, 129, 1000, 5000, 40000, 140000, 300000]
+
+errors = []
+
+
+def run(t):
+    c = FS()
+    rnd = random.Random(t)
+    names = [f"t{t}_{i}" for i in range(4)]
+    shadow = {}
+    for n in names:
+        assert c.cmd(f"C {n}") == "0"
+        shadow[n] = b""
+    for it in range(ITERS):
+        n = rnd.choice(names)
+        cur = shadow[n]
+        op = rnd.random()
+        data = os.urandom(rnd.choice(SIZES)) if op < 0.7 else b""
+        if op < 0.25:
+            rc, exp = c.write(n, data), data
+        elif op < 0.45:
+            off = rnd.randint(0, len(cur))
+            rc = c.write_at(n, off, data)
+            exp = cur[:off] + data + cur[off + len(data):]
+        elif op < 0.7:
+            rc, exp = c.append(n, data), cur + data
+        elif op < 0.75:
+            assert c.cmd(f"D {n}") == "0" and c.cmd(f"C {n}") == "0"
+            shadow[n] = b""
+            continue
+        elif op < 0.85:
+            off = rnd.randint(0, len(cur) + 10)
+            ln = rnd.choice([128, 1000, 4096, rnd.randint(0, 70000)])
+            for _ in range(rnd.choice([1, 4, 8])):
+                exp = cur[off:off + ln]
+                assert c.read_at(n, off, ln) == (0, exp), (t, it, n, "RR")
+                off = min(off + ln, len(cur))
+            continue
+        elif op < 0.87:
+            c.sync()
+            continue
+        elif op < 0.88:
+            assert c.cmd("COMPACT").startswith("0 "), (t, it, "COMPACT")
+            continue
+        else:
+            assert c.read(n) == (0, cur), (t, it, n, "R")
+            continue
+        if rc == "0":
+            shadow[n] = exp
+        else:
+            # out of space: start the file over
+            assert rc == "2", (t, it, n, rc)
+            assert c.cmd(f"D {n}") == "0" and c.cmd(f"C {n}") == "0"
+            shadow[n] = b""
+    for n in names:
+        assert c.read(n) == (0, shadow[n]), (t, n, "final")
+    c.close()
+
+
+def guard(t):
+    try:
+        run(t)
+    except Exception as e:
+        traceback.print_exc()
+        errors.append(e)
+
+
+FS().format()
+threads = [threading.Thread(target=guard, args=(t,)) for t in range(THREADS)]
+for x in threads:
+    x.start()
+for x in threads:
+    x.join()
+print("stress: FAIL" if errors else "stress: ok")
+sys.exit(1 if errors else 0)